@@ -0,0 +1,52 @@
+/// @file
+/// @brief Minimal stand-in for the Arduino core, for building headers on a host
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <string>
+
+/**
+ * @brief Just enough of Arduino's String for timestamp.h and the old
+ * String-based request building that the benchmark compares against.
+ */
+class String : public std::string
+{
+public:
+    String() = default;
+    String(const char *str): std::string(str) {}
+    String(long value): std::string(std::to_string(value)) {}
+
+    void concat(char c) {
+        push_back(c);
+    }
+
+    void concat(const char *str) {
+        append(str);
+    }
+
+    void concat(const String& str) {
+        append(str);
+    }
+
+    String substring(std::size_t from) const {
+        return String(c_str() + from);
+    }
+};
+
+#endif // HOST_ARDUINO_H
@@ -0,0 +1,215 @@
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks RequestWriter against the String-based code it replaced, then
+// times building a measurement request body both ways.
+//
+// Exits with a non-zero status if any output differs.
+
+#include "request-writer.h"
+#include "timestamp.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr auto DEVICE_ID = "6a2f4c1e-0b7d-4e4f-9a55-0123456789ab";
+static constexpr std::time_t BASE_TIME = 1714566896;
+static constexpr unsigned TIMESTAMP_CHECKS = 2000000;
+static constexpr unsigned BENCH_ROUNDS = 1000000;
+
+// The URL encoder that RequestWriter replaced (formerly url-encode.h).
+static String urlEncode(const char *msg)
+{
+    const char *hex = "0123456789ABCDEF";
+    String encodedMsg = "";
+
+    while (*msg != '\0') {
+        if (('a' <= *msg && *msg <= 'z') || ('A' <= *msg && *msg <= 'Z') ||
+            ('0' <= *msg && *msg <= '9') || *msg == '-' || *msg == '_' ||
+            *msg == '.' || *msg == '~')
+        {
+            encodedMsg += *msg;
+        } else {
+            encodedMsg += '%';
+            encodedMsg += hex[(unsigned char)*msg >> 4];
+            encodedMsg += hex[*msg & 0xf];
+        }
+        msg++;
+    }
+    return encodedMsg;
+}
+
+// Builds a measurement body the way API::Request used to.
+static String buildWithString(std::time_t t, float min, float max, float mean)
+{
+    String params;
+    params.reserve(128);
+
+    const auto addParam = [&params](const char *param, String value) {
+        params.concat('&');
+        params.concat(param);
+        params.concat('=');
+        params.concat(urlEncode(value.c_str()));
+    };
+
+    addParam("device",    DEVICE_ID);
+    addParam("timestamp", Timestamp(t));
+    addParam("min",       String(std::lround(min)));
+    addParam("max",       String(std::lround(max)));
+    addParam("mean",      String(std::lround(mean)));
+    return params.substring(1);
+}
+
+// Builds a measurement body the way API::sendMeasurement does now.
+static void buildWithWriter(RequestWriter& request, std::time_t t, float min, float max, float mean)
+{
+    request.clear();
+    request.addParam("device",    DEVICE_ID)
+           .addParam("timestamp", Timestamp(t))
+           .addParam("min",       std::lround(min))
+           .addParam("max",       std::lround(max))
+           .addParam("mean",      std::lround(mean));
+}
+
+static bool checkTimestamps()
+{
+    std::mt19937_64 rng (1);
+
+    for (auto i = 0u; i < TIMESTAMP_CHECKS; ++i) {
+        // Day boundaries first, then random times up to the year 2223.
+        const auto t = i < 1000 ? static_cast<std::time_t>(i) * (DAY_TO_SEC(1) - 1)
+                                : static_cast<std::time_t>(rng() % 8000000000ull);
+
+        char text[TIMESTAMP_FORMAT_LENGTH + 1];
+        text[formatTimestamp(text, t)] = '\0';
+
+        const String expected = Timestamp(t);
+        if (expected != text) {
+            std::printf("timestamp %lld: \"%s\", expected \"%s\"\n",
+                static_cast<long long>(t), text, expected.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool checkIntegers()
+{
+    static constexpr long values[] = {
+        0, 1, -1, 9, 10, -10, 123456789, -987654321, 2147483647,
+        -2147483647 - 1, 9223372036854775807L, -9223372036854775807L - 1
+    };
+
+    for (auto v : values) {
+        char text[21];
+        text[formatInteger(text, v)] = '\0';
+
+        if (String(v) != text) {
+            std::printf("integer %ld: \"%s\"\n", v, text);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool checkEncoding()
+{
+    char bytes[256];
+    for (auto i = 1; i < 256; ++i)
+        bytes[i - 1] = static_cast<char>(i);
+    bytes[255] = '\0';
+
+    char buffer[1024];
+    RequestWriter request (buffer, sizeof(buffer));
+    request.putEncoded(bytes);
+
+    if (!request.ok() || urlEncode(bytes) != request.c_str()) {
+        std::printf("encoding differs: \"%s\"\n", request.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool checkBodies()
+{
+    char buffer[256];
+    RequestWriter request (buffer, sizeof(buffer));
+
+    for (auto i = 0; i < 1000; ++i) {
+        const auto t = BASE_TIME + i * 301;
+        const auto min = 30.f + i % 17 * 0.7f, max = min + i % 29, mean = (min + max) / 2;
+
+        buildWithWriter(request, t, min, max, mean);
+        const auto expected = buildWithString(t, min, max, mean);
+        if (!request.ok() || expected != request.c_str()) {
+            std::printf("body \"%s\", expected \"%s\"\n", request.c_str(), expected.c_str());
+            return false;
+        }
+    }
+
+    // Overflow keeps the text that fit and is reported.
+    char small[10];
+    RequestWriter tiny (small, sizeof(small));
+    tiny.addParam("abc", "defghij");
+    if (tiny.ok() || std::strlen(small) >= sizeof(small)) {
+        std::printf("overflow not reported: \"%s\"\n", small);
+        return false;
+    }
+
+    return true;
+}
+
+template<typename Func>
+static double nsPerRound(Func func)
+{
+    const auto start = Clock::now();
+    for (auto i = 0u; i < BENCH_ROUNDS; ++i)
+        func(i);
+    const auto elapsed = Clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / BENCH_ROUNDS;
+}
+
+int main()
+{
+    if (!checkTimestamps() || !checkIntegers() || !checkEncoding() || !checkBodies())
+        return 1;
+
+    std::puts("RequestWriter matches the String-based output.");
+
+    char buffer[256];
+    RequestWriter request (buffer, sizeof(buffer));
+    volatile std::size_t sink = 0;
+
+    const auto writer = nsPerRound([&](unsigned i) {
+        buildWithWriter(request, BASE_TIME + i, 41.2f, 77.6f, 55.f);
+        sink = sink + request.length();
+    });
+    const auto string = nsPerRound([&](unsigned i) {
+        sink = sink + buildWithString(BASE_TIME + i, 41.2f, 77.6f, 55.f).length();
+    });
+
+    std::printf("Measurement body: RequestWriter %.0f ns, String %.0f ns\n", writer, string);
+    return 0;
+}
@@ -0,0 +1,625 @@
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "gateway.h"
+#include "json.h"
+
+#include <algorithm>
+#include <cstdio>
+
+static constexpr char FORM_CONTENT_TYPE[] = "application/x-www-form-urlencoded";
+static constexpr char JSON_CONTENT_TYPE[] = "application/json";
+
+/** Seconds that devices are asked to wait when the gateway cannot take more. */
+static constexpr unsigned OVERLOAD_RETRY_SEC = 300;
+/** Shortest and longest pause after a failed upstream request, in seconds. */
+static constexpr unsigned BACKOFF_MIN_SEC = 5;
+static constexpr unsigned BACKOFF_MAX_SEC = 300;
+/** Largest firmware image that is cached. */
+static constexpr std::size_t MAX_IMAGE_SIZE = 4 * 1024 * 1024;
+
+/**
+ * Checks that a form value is a whole number, so that it can be put in JSON as-is.
+ */
+static bool isInteger(std::string_view str) noexcept
+{
+    if (!str.empty() && str.front() == '-')
+        str.remove_prefix(1);
+    return !str.empty() && str.size() < 20 &&
+        std::all_of(str.begin(), str.end(), [](char c) { return c >= '0' && c <= '9'; });
+}
+
+/**
+ * Checks if the public API could not take a request right now, so that it
+ * should be retried later.
+ */
+static bool isTransient(const Upstream::Response& resp) noexcept
+{
+    return resp.status == 0 || resp.status == 429 || resp.status >= 500;
+}
+
+/**
+ * Gets the "result" member of an API response.
+ */
+static std::string resultOf(std::string_view body)
+{
+    std::string result;
+    std::size_t pos = 0;
+
+    json::forEachMember(body, pos, [&](const std::string& key, std::string_view value) {
+        if (key == "result") {
+            std::size_t p = 0;
+            result = json::readString(value, p).value_or("");
+        }
+        return true;
+    });
+
+    return result;
+}
+
+/**
+ * Gets the text of the "config" object of an API response, or empty.
+ */
+static std::string configOf(std::string_view body)
+{
+    std::string config;
+    std::size_t pos = 0;
+
+    json::forEachMember(body, pos, [&](const std::string& key, std::string_view value) {
+        if (key == "config" && !value.empty() && value.front() == '{')
+            config = value;
+        return true;
+    });
+
+    return config;
+}
+
+/**
+ * Checks if the public API refused a request for reasons that are specific
+ * to the device (e.g. a bad token or malformed data), so that sending it
+ * again would not help.
+ */
+static bool isRefused(const Upstream::Response& resp) noexcept
+{
+    return resp.status == 400 || resp.status == 401 || resp.status == 403;
+}
+
+/**
+ * Checks if the public API lacks an endpoint.
+ */
+static bool isMissing(const Upstream::Response& resp) noexcept
+{
+    return resp.status == 404 || resp.status == 405;
+}
+
+/**
+ * Turns a queued packet back into the form the device would send to the
+ * "measurement" endpoint.
+ */
+static std::string packetForm(const std::string& device, std::string_view packet)
+{
+    auto form = "device=" + urlEncode(device);
+    std::size_t pos = 0;
+
+    json::forEachMember(packet, pos, [&](const std::string& key, std::string_view value) {
+        std::size_t p = 0;
+        const auto str = json::readString(value, p);
+        form.append("&").append(urlEncode(key)).append("=").append(urlEncode(str ? *str : std::string(value)));
+        return true;
+    });
+
+    return form;
+}
+
+static HttpResponse retryLater(unsigned seconds, std::string_view message)
+{
+    auto resp = HttpResponse::result(503, "error", message);
+    resp.headers.emplace_back("Retry-After", std::to_string(seconds));
+    return resp;
+}
+
+Gateway::Gateway(Config config_, Upstream& upstream_):
+    config(std::move(config_)),
+    upstream(upstream_) {}
+
+void Gateway::handle(HttpRequest&& req, Server::Responder respond)
+{
+    if (req.path.compare(0, config.prefix.size(), config.prefix) != 0) {
+        respond(HttpResponse::result(404, "error", "Not found"));
+        return;
+    }
+
+    const std::string_view endpoint = std::string_view(req.path).substr(config.prefix.size());
+
+    if (req.method == "POST" && endpoint == "measurements")
+        handleMeasurements(req, respond);
+    else if (req.method == "POST" && endpoint == "measurement")
+        handleMeasurement(req, respond);
+    else if (req.method == "POST" && endpoint == "device/register")
+        handleRegister(req, respond);
+    else if (req.method == "GET" && endpoint == "software/latest")
+        handleLatest(respond);
+    else if (req.method == "GET" && endpoint.compare(0, 4, "ota/") == 0)
+        handleImage(endpoint.substr(4), respond);
+    else
+        respond(HttpResponse::result(404, "error", "Not found"));
+}
+
+void Gateway::handleMeasurement(HttpRequest& req, Server::Responder& respond)
+{
+    const auto authorization = req.header("authorization");
+    if (authorization.compare(0, 6, "Token ") != 0) {
+        respond(HttpResponse::result(401, "error", "Missing token"));
+        return;
+    }
+
+    const auto form = parseForm(req.body);
+    const auto device = findValue(form, "device");
+    if (device.empty()) {
+        respond(HttpResponse::result(400, "error", "Missing device"));
+        return;
+    }
+
+    // Diagnostics are rare and go to the public API as they are.
+    if (!findValue(form, "version").empty()) {
+        if (queued + forwards.size() >= config.maxQueued) {
+            ++counters.overloaded;
+            respond(retryLater(OVERLOAD_RETRY_SEC, "Gateway is full"));
+            return;
+        }
+
+        forwards.push_back({"measurement", FORM_CONTENT_TYPE, std::string(authorization), std::move(req.body)});
+        respond(HttpResponse::result(200, "ok", "Queued"));
+        return;
+    }
+
+    const auto timestamp = findValue(form, "timestamp");
+    const auto min = findValue(form, "min");
+    const auto max = findValue(form, "max");
+    const auto mean = findValue(form, "mean");
+    const auto seq = findValue(form, "seq");
+
+    if (timestamp.empty() || !isInteger(min) || !isInteger(max) || !isInteger(mean) ||
+        (!seq.empty() && !isInteger(seq)))
+    {
+        respond(HttpResponse::result(400, "error", "Invalid measurement"));
+        return;
+    }
+
+    // The same object that the device would put in a "measurements" request.
+    auto packet = std::string("{\"timestamp\":") + json::quote(timestamp);
+    packet.append(",\"min\":").append(min)
+          .append(",\"max\":").append(max)
+          .append(",\"mean\":").append(mean);
+    if (!seq.empty())
+        packet.append(",\"seq\":").append(seq);
+    packet += '}';
+
+    if (queued >= config.maxQueued) {
+        ++counters.overloaded;
+        respond(retryLater(OVERLOAD_RETRY_SEC, "Gateway is full"));
+        return;
+    }
+
+    std::vector<std::string> packets;
+    packets.push_back(std::move(packet));
+    enqueue(std::string(device), authorization, std::move(packets));
+    respond(HttpResponse::result(200, "ok", "Queued"));
+}
+
+void Gateway::handleMeasurements(HttpRequest& req, Server::Responder& respond)
+{
+    const auto authorization = req.header("authorization");
+    if (authorization.compare(0, 6, "Token ") != 0) {
+        respond(HttpResponse::result(401, "error", "Missing token"));
+        return;
+    }
+
+    // Devices fall back to JSON when CBOR is refused.
+    if (req.header("content-type").compare(0, sizeof(JSON_CONTENT_TYPE) - 1, JSON_CONTENT_TYPE) != 0) {
+        respond(HttpResponse::result(415, "error", "Only JSON is accepted"));
+        return;
+    }
+
+    std::string device;
+    std::vector<std::string> packets;
+    std::size_t pos = 0;
+
+    const auto valid = json::forEachMember(req.body, pos, [&](const std::string& key, std::string_view value) {
+        std::size_t p = 0;
+
+        if (key == "device") {
+            const auto str = json::readString(value, p);
+            if (!str)
+                return false;
+            device = *str;
+        } else if (key == "measurements") {
+            return json::forEachElement(value, p, [&](std::string_view element) {
+                if (element.empty() || element.front() != '{')
+                    return false;
+                packets.emplace_back(element);
+                return true;
+            });
+        }
+
+        return true;
+    });
+
+    if (!valid || device.empty() || packets.empty()) {
+        respond(HttpResponse::result(400, "error", "Invalid measurements"));
+        return;
+    }
+
+    if (queued + packets.size() > config.maxQueued) {
+        ++counters.overloaded;
+        respond(retryLater(OVERLOAD_RETRY_SEC, "Gateway is full"));
+        return;
+    }
+
+    enqueue(device, authorization, std::move(packets));
+
+    auto resp = HttpResponse::result(200, "ok", "Queued");
+    if (const auto c = configs.find(device); c != configs.end()) {
+        resp.body.pop_back();
+        resp.body.append(",\"config\":").append(c->second).append("}");
+        configs.erase(c);
+    }
+    respond(std::move(resp));
+}
+
+void Gateway::handleRegister(HttpRequest& req, Server::Responder& respond)
+{
+    // The device needs the token from the answer, so it waits for the public API.
+    Upstream::Request request;
+    request.url = config.upstreamUrl + "device/register";
+    request.contentType = FORM_CONTENT_TYPE;
+    request.body = std::move(req.body);
+
+    upstream.submit(std::move(request), [respond = std::move(respond)](Upstream::Response&& resp) {
+        if (isTransient(resp)) {
+            respond(retryLater(resp.retryAfter > 0 ? resp.retryAfter : BACKOFF_MAX_SEC,
+                "Registration is unavailable"));
+        } else {
+            HttpResponse out;
+            out.status = static_cast<int>(resp.status);
+            out.body = std::move(resp.body);
+            respond(std::move(out));
+        }
+    });
+}
+
+void Gateway::handleLatest(Server::Responder& respond)
+{
+    const auto now = Clock::now();
+
+    if (!latest.body.empty()) {
+        // A stale answer is still good enough while a fresh one is fetched.
+        respond(HttpResponse{200, JSON_CONTENT_TYPE, {}, latestBody(), {}});
+
+        if (now - latest.fetched >= std::chrono::seconds(config.otaCacheSec) && !latest.fetching)
+            fetchLatest();
+        return;
+    }
+
+    latest.waiting.push_back(std::move(respond));
+    if (!latest.fetching)
+        fetchLatest();
+}
+
+void Gateway::handleImage(std::string_view name, Server::Responder& respond)
+{
+    if (!latest.image || name != latest.imageName) {
+        respond(HttpResponse::result(404, "error", "Not found"));
+        return;
+    }
+
+    HttpResponse resp;
+    resp.contentType = "application/octet-stream";
+    resp.sharedBody = latest.image;
+    respond(std::move(resp));
+}
+
+void Gateway::enqueue(const std::string& device, std::string_view authorization, std::vector<std::string>&& packets)
+{
+    const auto now = Clock::now();
+    auto& queue = devices[device];
+
+    queue.authorization = authorization;
+    for (auto& packet : packets)
+        queue.packets.push_back({now, std::move(packet)});
+
+    queued += packets.size();
+    counters.received += packets.size();
+
+    if (queue.packets.size() >= config.batchSize) {
+        markDue(device, queue);
+        sendDue();
+    }
+}
+
+void Gateway::tick()
+{
+    const auto now = Clock::now();
+    const auto maxAge = std::chrono::seconds(config.flushSec);
+
+    for (auto& [device, queue] : devices) {
+        if (!queue.sending && !queue.packets.empty() &&
+            (flushing || now - queue.packets.front().received >= maxAge))
+        {
+            markDue(device, queue);
+        }
+    }
+
+    sendDue();
+}
+
+void Gateway::markDue(const std::string& device, DeviceQueue& queue)
+{
+    if (!queue.due) {
+        queue.due = true;
+        dueDevices.push_back(device);
+    }
+}
+
+void Gateway::sendDue()
+{
+    if (Clock::now() < pausedUntil)
+        return;
+
+    while (!forwards.empty() && inFlight < config.maxInFlight)
+        sendForward();
+
+    while (!dueDevices.empty() && inFlight < config.maxInFlight) {
+        const auto device = std::move(dueDevices.front());
+        dueDevices.pop_front();
+
+        const auto it = devices.find(device);
+        if (it == devices.end())
+            continue;
+
+        auto& queue = it->second;
+        queue.due = false;
+        if (queue.sending)
+            continue;
+
+        if (!queue.packets.empty())
+            sendBatch(device, queue);
+        else
+            devices.erase(it);
+    }
+}
+
+void Gateway::sendBatch(const std::string& device, DeviceQueue& queue)
+{
+    const auto batch = useBatch;
+    const auto count = batch ? std::min<std::size_t>(queue.packets.size(), config.batchSize) : 1;
+
+    Upstream::Request request;
+    request.authorization = queue.authorization;
+
+    if (batch) {
+        request.url = config.upstreamUrl + "measurements";
+        request.contentType = JSON_CONTENT_TYPE;
+
+        auto& body = request.body;
+        body.reserve(64 + count * 96);
+        body.append("{\"device\":").append(json::quote(device)).append(",\"measurements\":[");
+        for (std::size_t i = 0; i < count; ++i) {
+            if (i > 0)
+                body += ',';
+            body += queue.packets[i].json;
+        }
+        body.append("]}");
+    } else {
+        request.url = config.upstreamUrl + "measurement";
+        request.contentType = FORM_CONTENT_TYPE;
+        request.body = packetForm(device, queue.packets.front().json);
+    }
+
+    queue.sending = true;
+    ++inFlight;
+    ++counters.batches;
+
+    upstream.submit(std::move(request), [this, device, count, batch](Upstream::Response&& resp) {
+        --inFlight;
+
+        auto& queue = devices[device];
+        queue.sending = false;
+
+        // Without the batch endpoint, the packets go one at a time instead.
+        if (batch && isMissing(resp)) {
+            if (useBatch) {
+                std::fprintf(stderr, "Public API has no measurements endpoint, sending packets singly\n");
+                useBatch = false;
+            }
+            markDue(device, queue);
+            sendDue();
+            return;
+        }
+
+        // Only refusals that are specific to the device drop its packets;
+        // anything else is kept and retried after a pause.
+        const auto retry = isTransient(resp) || (resp.status != 200 && !isRefused(resp));
+        upstreamResult(resp, retry);
+        if (retry) {
+            markDue(device, queue);
+            return;
+        }
+
+        if (resp.status == 200 && resultOf(resp.body) == "ok") {
+            counters.delivered += count;
+            if (auto config = configOf(resp.body); !config.empty())
+                configs[device] = std::move(config);
+        } else if (resp.status == 200) {
+            counters.rejected += count;
+        } else {
+            // Retrying a refused request (e.g. a bad token) would not help.
+            counters.dropped += count;
+            std::fprintf(stderr, "Dropped %zu packets from %s: HTTP %ld %s\n",
+                count, device.c_str(), resp.status, resp.body.substr(0, 200).c_str());
+        }
+
+        queue.packets.erase(queue.packets.begin(), queue.packets.begin() + count);
+        queued -= count;
+
+        if (queue.packets.empty() && !queue.due)
+            devices.erase(device);
+        else if (queue.packets.size() >= config.batchSize || flushing)
+            markDue(device, queue);
+
+        sendDue();
+    });
+}
+
+void Gateway::sendForward()
+{
+    auto forward = std::move(forwards.front());
+    forwards.pop_front();
+
+    Upstream::Request request;
+    request.url = config.upstreamUrl + forward.endpoint;
+    request.contentType = forward.contentType;
+    request.authorization = forward.authorization;
+    request.body = forward.body;
+
+    ++inFlight;
+
+    upstream.submit(std::move(request), [this, forward = std::move(forward)](Upstream::Response&& resp) mutable {
+        --inFlight;
+        upstreamResult(resp, isTransient(resp));
+
+        if (isTransient(resp))
+            forwards.push_front(std::move(forward));
+        else if (resp.status != 200)
+            std::fprintf(stderr, "Forwarded %s refused: HTTP %ld\n", forward.endpoint.c_str(), resp.status);
+
+        sendDue();
+    });
+}
+
+void Gateway::upstreamResult(const Upstream::Response& resp, bool failed)
+{
+    if (!failed) {
+        failures = 0;
+        return;
+    }
+
+    ++failures;
+
+    auto pause = resp.retryAfter;
+    if (pause == 0)
+        pause = BACKOFF_MIN_SEC << std::min(failures - 1, 6u);
+    pause = std::min(pause, BACKOFF_MAX_SEC);
+
+    pausedUntil = std::max(pausedUntil, Clock::now() + std::chrono::seconds(pause));
+
+    std::fprintf(stderr, "Public API unavailable (%s), pausing %u s\n",
+        resp.status == 0 ? resp.error.c_str() : std::to_string(resp.status).c_str(), pause);
+}
+
+void Gateway::fetchLatest()
+{
+    Upstream::Request request;
+    request.method = "GET";
+    request.url = config.upstreamUrl + "software/latest";
+
+    latest.fetching = true;
+
+    upstream.submit(std::move(request), [this](Upstream::Response&& resp) {
+        latest.fetching = false;
+
+        std::string version, url;
+        std::size_t pos = 0;
+        const auto valid = resp.status == 200 &&
+            json::forEachMember(resp.body, pos, [&](const std::string& key, std::string_view value) {
+                std::size_t p = 0;
+                if (key == "version")
+                    version = json::readString(value, p).value_or("");
+                else if (key == "url")
+                    url = json::readString(value, p).value_or("");
+                return true;
+            }) &&
+            resultOf(resp.body) == "ok" && !version.empty() && !url.empty();
+
+        if (valid) {
+            latest.body = std::move(resp.body);
+            latest.version = std::move(version);
+            latest.url = std::move(url);
+            latest.fetched = Clock::now();
+
+            if (!config.publicUrl.empty() && latest.url != latest.imageUrl && !latest.downloading)
+                fetchImage();
+        } else if (!latest.body.empty()) {
+            // Keep the previous answer, and try again on a later request.
+            latest.fetched = Clock::now() - std::chrono::seconds(config.otaCacheSec) + std::chrono::seconds(BACKOFF_MAX_SEC);
+        }
+
+        for (auto& respond : latest.waiting) {
+            if (latest.body.empty())
+                respond(retryLater(BACKOFF_MAX_SEC, "Update check failed"));
+            else
+                respond(HttpResponse{200, JSON_CONTENT_TYPE, {}, latestBody(), {}});
+        }
+        latest.waiting.clear();
+    });
+}
+
+void Gateway::fetchImage()
+{
+    Upstream::Request request;
+    request.method = "GET";
+    request.url = latest.url;
+    request.maxResponse = MAX_IMAGE_SIZE;
+
+    latest.downloading = true;
+
+    upstream.submit(std::move(request), [this, url = latest.url](Upstream::Response&& resp) {
+        latest.downloading = false;
+
+        if (resp.status != 200 || resp.body.empty()) {
+            std::fprintf(stderr, "Firmware download failed: %s\n",
+                resp.status == 0 ? resp.error.c_str() : std::to_string(resp.status).c_str());
+            return;
+        }
+
+        // Name the file after its version, keeping only characters safe in a path.
+        std::string name;
+        for (const auto c : latest.version) {
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                c == '.' || c == '-' || c == '_')
+            {
+                name += c;
+            }
+        }
+
+        latest.image = std::make_shared<const std::string>(std::move(resp.body));
+        latest.imageUrl = url;
+        latest.imageName = name + ".bin";
+
+        std::fprintf(stderr, "Cached firmware %s (%zu bytes)\n", latest.version.c_str(), latest.image->size());
+    });
+}
+
+std::string Gateway::latestBody() const
+{
+    // Images are signed, so devices can safely download them from the gateway.
+    if (latest.image && latest.imageUrl == latest.url) {
+        return std::string("{\"result\":\"ok\",\"version\":") + json::quote(latest.version) +
+            ",\"url\":" + json::quote(config.publicUrl + "ota/" + latest.imageName) + '}';
+    }
+
+    return latest.body;
+}
@@ -0,0 +1,238 @@
+/// @file
+/// @brief Device API endpoints: collection, batching and OTA caching
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include "server.h"
+#include "upstream.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Answers the device API on behalf of the public API.
+ *
+ * Measurements (the "measurement" and "measurements" endpoints) are accepted
+ * right away and queued per device. Each device's queue is sent upstream as
+ * one "measurements" request, with the device's own token, once it holds
+ * Config::batchSize packets or its oldest packet has waited
+ * Config::flushSec. While the public API is unreachable, queues keep
+ * growing (up to Config::maxQueued packets) and are sent once it is back.
+ *
+ * Reporting settings ("config") that the public API returns for a device are
+ * passed on in the answer to that device's next upload.
+ *
+ * Registration needs the public API's answer, so it is forwarded and the
+ * device waits. Diagnostics (a "measurement" with a version) are forwarded
+ * as they are, in the background.
+ *
+ * The "software/latest" answer is cached for Config::otaCacheSec. If
+ * Config::publicUrl is set, the firmware image is downloaded once and
+ * served from the gateway's "ota/" endpoint instead of the original URL.
+ */
+class Gateway
+{
+public:
+    using Clock = Server::Clock;
+
+    /** Settings, given on the command line. */
+    struct Config {
+        /** Base URL of the public API. */
+        std::string upstreamUrl = "https://api.tracket.info/v1/";
+        /** Path prefix of the device API on this gateway. */
+        std::string prefix = "/v1/";
+        /** Base URL that devices use for this gateway, for serving OTA images; empty to not cache images. */
+        std::string publicUrl;
+        /** Most packets to send upstream in one request. */
+        unsigned batchSize = 48;
+        /** Longest that a packet waits to be sent upstream, in seconds. */
+        unsigned flushSec = 900;
+        /** Most packets to hold; devices are asked to retry later beyond this. */
+        std::size_t maxQueued = 1000000;
+        /** Seconds to reuse the "software/latest" answer for. */
+        unsigned otaCacheSec = 3600;
+        /** Most upstream requests in progress at once. */
+        unsigned maxInFlight = 32;
+    };
+
+    /** Counters for the periodic status line. */
+    struct Stats {
+        /** Packets accepted from devices. */
+        uint64_t received = 0;
+        /** Packets that the public API accepted. */
+        uint64_t delivered = 0;
+        /** Packets that the public API rejected. */
+        uint64_t rejected = 0;
+        /** Packets dropped after a request was refused (e.g. a bad token). */
+        uint64_t dropped = 0;
+        /** Upstream measurement requests made. */
+        uint64_t batches = 0;
+        /** Requests turned away because the queue was full. */
+        uint64_t overloaded = 0;
+    };
+
+    Gateway(Config config_, Upstream& upstream_);
+
+    /**
+     * Handles a request from a device.
+     */
+    void handle(HttpRequest&& req, Server::Responder respond);
+
+    /**
+     * Finds queues that have waited long enough and sends them; call about
+     * once a second.
+     */
+    void tick();
+
+    /**
+     * Sends every queue regardless of age, e.g. before exiting.
+     */
+    void flushAll() noexcept {
+        flushing = true;
+    }
+
+    /**
+     * Checks if nothing is queued or being sent.
+     */
+    bool idle() const noexcept {
+        return queued == 0 && forwards.empty() && inFlight == 0;
+    }
+
+    /**
+     * Gets the number of packets waiting to be sent upstream.
+     */
+    std::size_t queuedPackets() const noexcept {
+        return queued;
+    }
+
+    /**
+     * Provides the counters.
+     */
+    const Stats& stats() const noexcept {
+        return counters;
+    }
+
+private:
+    /** A measurement waiting to be sent. */
+    struct Packet {
+        /** When the packet arrived. */
+        Clock::time_point received;
+        /** The measurement as a JSON object, in the form the public API expects. */
+        std::string json;
+    };
+
+    /** Packets waiting to be sent for one device. */
+    struct DeviceQueue {
+        /** Authorization header from the device's latest request. */
+        std::string authorization;
+        /** Packets, oldest first. */
+        std::deque<Packet> packets;
+        /** Set while a batch of this queue is being sent. */
+        bool sending = false;
+        /** Set while the device is in the due list. */
+        bool due = false;
+    };
+
+    /** A request forwarded as it was received. */
+    struct Forward {
+        std::string endpoint;
+        std::string contentType;
+        std::string authorization;
+        std::string body;
+    };
+
+    /** The cached "software/latest" answer. */
+    struct LatestSoftware {
+        /** Response body from the public API. */
+        std::string body;
+        /** Version and download URL from the body. */
+        std::string version, url;
+        /** When the answer was received. */
+        Clock::time_point fetched;
+        /** Set while asking the public API. */
+        bool fetching = false;
+        /** Devices waiting for the answer. */
+        std::vector<Server::Responder> waiting;
+        /** Cached firmware image and the URL it came from. */
+        std::shared_ptr<const std::string> image;
+        std::string imageUrl;
+        /** File name the image is served under. */
+        std::string imageName;
+        /** Set while downloading the image. */
+        bool downloading = false;
+    };
+
+    Config config;
+    Upstream& upstream;
+    std::unordered_map<std::string, DeviceQueue> devices;
+    /** Settings from the public API waiting to be passed on, by device. */
+    std::unordered_map<std::string, std::string> configs;
+    /** Devices with a batch ready to send, in the order they became ready. */
+    std::deque<std::string> dueDevices;
+    std::deque<Forward> forwards;
+    LatestSoftware latest;
+    /** Total packets in all queues. */
+    std::size_t queued = 0;
+    /** Upstream requests in progress. */
+    unsigned inFlight = 0;
+    /** Failed upstream attempts in a row, for backing off. */
+    unsigned failures = 0;
+    /** No upstream measurement requests are made before this time. */
+    Clock::time_point pausedUntil;
+    bool flushing = false;
+    /** Cleared once the public API turns out to have no "measurements"
+     * endpoint; packets are then sent one per "measurement" request. */
+    bool useBatch = true;
+    Stats counters;
+
+    void handleMeasurement(HttpRequest& req, Server::Responder& respond);
+    void handleMeasurements(HttpRequest& req, Server::Responder& respond);
+    void handleRegister(HttpRequest& req, Server::Responder& respond);
+    void handleLatest(Server::Responder& respond);
+    void handleImage(std::string_view name, Server::Responder& respond);
+
+    /** Adds packets to a device's queue. */
+    void enqueue(const std::string& device, std::string_view authorization, std::vector<std::string>&& packets);
+    /** Adds a device to the due list. */
+    void markDue(const std::string& device, DeviceQueue& queue);
+    /** Sends due batches and forwards, as far as the in-flight limit allows. */
+    void sendDue();
+    /** Sends the front of a device's queue upstream. */
+    void sendBatch(const std::string& device, DeviceQueue& queue);
+    /** Sends the next forwarded request upstream. */
+    void sendForward();
+    /**
+     * Records the outcome of an upstream attempt for backing off.
+     * @param failed True if the request should be retried later
+     */
+    void upstreamResult(const Upstream::Response& resp, bool failed);
+
+    void fetchLatest();
+    void fetchImage();
+    /** Builds the "software/latest" answer, pointing at the cached image if there is one. */
+    std::string latestBody() const;
+};
+
+#endif // GATEWAY_H
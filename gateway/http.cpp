@@ -0,0 +1,262 @@
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "http.h"
+#include "json.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+/** Compares two strings, ignoring case. */
+static bool equalsIgnoreCase(std::string_view a, std::string_view b) noexcept
+{
+    return a.size() == b.size() && std::equal(a.cbegin(), a.cend(), b.cbegin(),
+        [](char x, char y) { return std::tolower(static_cast<unsigned char>(x)) ==
+                                    std::tolower(static_cast<unsigned char>(y)); });
+}
+
+/** Removes leading and trailing spaces and tabs. */
+static std::string_view trim(std::string_view str) noexcept
+{
+    while (!str.empty() && (str.front() == ' ' || str.front() == '\t'))
+        str.remove_prefix(1);
+    while (!str.empty() && (str.back() == ' ' || str.back() == '\t'))
+        str.remove_suffix(1);
+    return str;
+}
+
+std::string_view HttpRequest::header(std::string_view name) const noexcept
+{
+    return findValue(headers, name);
+}
+
+HttpResponse HttpResponse::result(int status, std::string_view result, std::string_view message)
+{
+    HttpResponse resp;
+    resp.status = status;
+    resp.body = "{\"result\":" + json::quote(result) + ",\"message\":" + json::quote(message) + '}';
+    return resp;
+}
+
+std::string HttpResponse::head(bool keepAlive) const
+{
+    const auto length = sharedBody ? sharedBody->size() : body.size();
+
+    std::string str;
+    str.reserve(160);
+    str += "HTTP/1.1 ";
+    str += std::to_string(status);
+    str += ' ';
+    str += reasonPhrase(status);
+    str += "\r\nContent-Type: ";
+    str += contentType;
+    str += "\r\nContent-Length: ";
+    str += std::to_string(length);
+    str += keepAlive ? "\r\nConnection: keep-alive\r\n" : "\r\nConnection: close\r\n";
+    for (const auto& [name, value] : headers) {
+        str += name;
+        str += ": ";
+        str += value;
+        str += "\r\n";
+    }
+    str += "\r\n";
+    return str;
+}
+
+HttpParser::Status HttpParser::parse(std::string& buffer, HttpRequest& request, int& error)
+{
+    const auto end = buffer.find("\r\n\r\n");
+    if (end == std::string::npos) {
+        if (buffer.size() <= MaxHeaderSize)
+            return Status::Incomplete;
+
+        error = 431;
+        return Status::Error;
+    }
+
+    error = 400;
+
+    const std::string_view head (buffer.data(), end);
+    auto lineEnd = head.find("\r\n");
+    const auto requestLine = head.substr(0, lineEnd);
+
+    // Request line: method, target and version separated by single spaces.
+    const auto sp1 = requestLine.find(' ');
+    const auto sp2 = requestLine.rfind(' ');
+    if (sp1 == std::string_view::npos || sp2 == sp1)
+        return Status::Error;
+
+    const auto target = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+    const auto version = requestLine.substr(sp2 + 1);
+    if (version != "HTTP/1.1" && version != "HTTP/1.0")
+        return Status::Error;
+
+    request = {};
+    request.method = requestLine.substr(0, sp1);
+    const auto question = target.find('?');
+    request.path = target.substr(0, question);
+    if (question != std::string_view::npos)
+        request.query = target.substr(question + 1);
+
+    std::size_t contentLength = 0;
+    bool keepAlive = version == "HTTP/1.1";
+
+    while (lineEnd != std::string_view::npos) {
+        const auto start = lineEnd + 2;
+        lineEnd = head.find("\r\n", start);
+        const auto line = head.substr(start, lineEnd == std::string_view::npos ? lineEnd : lineEnd - start);
+
+        const auto colon = line.find(':');
+        if (colon == std::string_view::npos || colon == 0)
+            return Status::Error;
+
+        std::string name (line.substr(0, colon));
+        std::transform(name.begin(), name.end(), name.begin(),
+            [](unsigned char c) { return std::tolower(c); });
+        const auto value = trim(line.substr(colon + 1));
+
+        if (name == "content-length") {
+            char *numEnd;
+            const std::string str (value);
+            contentLength = std::strtoul(str.c_str(), &numEnd, 10);
+            if (str.empty() || *numEnd != '\0')
+                return Status::Error;
+        } else if (name == "transfer-encoding") {
+            error = 501;
+            return Status::Error;
+        } else if (name == "connection") {
+            if (equalsIgnoreCase(value, "close"))
+                keepAlive = false;
+            else if (equalsIgnoreCase(value, "keep-alive"))
+                keepAlive = true;
+        }
+
+        request.headers.emplace_back(std::move(name), value);
+    }
+
+    if (contentLength > MaxBodySize) {
+        error = 413;
+        return Status::Error;
+    }
+
+    const auto total = end + 4 + contentLength;
+    if (buffer.size() < total)
+        return Status::Incomplete;
+
+    request.body = buffer.substr(end + 4, contentLength);
+    request.keepAlive = keepAlive;
+    buffer.erase(0, total);
+    return Status::Complete;
+}
+
+const char *reasonPhrase(int status) noexcept
+{
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    default:  return "Unknown";
+    }
+}
+
+std::string urlDecode(std::string_view str)
+{
+    const auto hex = [](char c) {
+        return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    };
+
+    std::string out;
+    out.reserve(str.size());
+
+    for (auto i = 0u; i < str.size(); ++i) {
+        if (str[i] == '+') {
+            out += ' ';
+        } else if (str[i] == '%' && i + 2 < str.size() &&
+                   std::isxdigit(static_cast<unsigned char>(str[i + 1])) &&
+                   std::isxdigit(static_cast<unsigned char>(str[i + 2])))
+        {
+            out += static_cast<char>(hex(str[i + 1]) << 4 | hex(str[i + 2]));
+            i += 2;
+        } else {
+            out += str[i];
+        }
+    }
+
+    return out;
+}
+
+std::string urlEncode(std::string_view str)
+{
+    static constexpr char Hex[] = "0123456789ABCDEF";
+
+    std::string out;
+    out.reserve(str.size());
+
+    for (const char c : str) {
+        if (std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '.' || c == '_' || c == '~') {
+            out += c;
+        } else {
+            out += '%';
+            out += Hex[static_cast<unsigned char>(c) >> 4];
+            out += Hex[c & 0xF];
+        }
+    }
+
+    return out;
+}
+
+HttpHeaders parseForm(std::string_view body)
+{
+    HttpHeaders pairs;
+
+    while (!body.empty()) {
+        const auto amp = body.find('&');
+        const auto field = body.substr(0, amp);
+        const auto eq = field.find('=');
+
+        if (!field.empty()) {
+            pairs.emplace_back(urlDecode(field.substr(0, eq)),
+                eq == std::string_view::npos ? std::string() : urlDecode(field.substr(eq + 1)));
+        }
+
+        if (amp == std::string_view::npos)
+            break;
+        body.remove_prefix(amp + 1);
+    }
+
+    return pairs;
+}
+
+std::string_view findValue(const HttpHeaders& pairs, std::string_view name) noexcept
+{
+    for (const auto& [n, v] : pairs) {
+        if (n == name)
+            return v;
+    }
+
+    return {};
+}
@@ -0,0 +1,147 @@
+/// @file
+/// @brief Incremental HTTP/1.1 request parsing and response formatting
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/** Header fields as name/value pairs. */
+using HttpHeaders = std::vector<std::pair<std::string, std::string>>;
+
+/**
+ * @brief An HTTP request received from a device.
+ */
+struct HttpRequest {
+    /** Request method, e.g. "POST". */
+    std::string method;
+    /** Request path, without the query string. */
+    std::string path;
+    /** Query string, without the '?'. */
+    std::string query;
+    /** Header fields; names are lowercase. */
+    HttpHeaders headers;
+    /** Request body. */
+    std::string body;
+    /** True if the connection may be used for further requests. */
+    bool keepAlive = true;
+
+    /**
+     * Finds a header field.
+     * @param name Lowercase field name
+     * @return The field's value, or empty if there is no such field
+     */
+    std::string_view header(std::string_view name) const noexcept;
+};
+
+/**
+ * @brief An HTTP response to be sent to a device.
+ */
+struct HttpResponse {
+    /** Status code. */
+    int status = 200;
+    /** Content type of the body. */
+    std::string contentType = "application/json";
+    /** Additional header fields. */
+    HttpHeaders headers;
+    /** Response body. */
+    std::string body;
+    /**
+     * Body shared between responses, e.g. a cached firmware image.
+     * Sent instead of body when set.
+     */
+    std::shared_ptr<const std::string> sharedBody;
+
+    /**
+     * Creates a JSON response in the API's form: {"result":..,"message":..}.
+     * @param status Status code
+     * @param result "ok" or "error"
+     * @param message Message for the device's log
+     */
+    static HttpResponse result(int status, std::string_view result, std::string_view message);
+
+    /**
+     * Formats the status line and header fields.
+     * @param keepAlive True to keep the connection open afterwards
+     */
+    std::string head(bool keepAlive) const;
+};
+
+/**
+ * @brief Parses requests from the bytes received on a connection.
+ *
+ * Requests may arrive in pieces; parse() is called again as more bytes
+ * arrive. Chunked request bodies are not supported, as devices always send
+ * a Content-Length.
+ */
+class HttpParser
+{
+public:
+    /** Largest request line and header that is accepted. */
+    static constexpr std::size_t MaxHeaderSize = 8192;
+    /** Largest request body that is accepted. */
+    static constexpr std::size_t MaxBodySize = 65536;
+
+    /** Outcome of a parse() call. */
+    enum class Status {
+        Incomplete, /** More bytes are needed. */
+        Complete,   /** A request was parsed. */
+        Error       /** The request is invalid; the connection should be closed. */
+    };
+
+    /**
+     * Parses one request from the front of the buffer.
+     * @param buffer Received bytes; a parsed request's bytes are removed
+     * @param request Filled in when a request is complete
+     * @param error Set to the status code to reply with on error
+     */
+    static Status parse(std::string& buffer, HttpRequest& request, int& error);
+};
+
+/**
+ * Gets the reason phrase for a status code, e.g. "Not Found" for 404.
+ */
+const char *reasonPhrase(int status) noexcept;
+
+/**
+ * Decodes a URL-encoded ("%2B" and '+') string.
+ */
+std::string urlDecode(std::string_view str);
+
+/**
+ * Encodes a string for a form value, e.g. "+" as "%2B".
+ */
+std::string urlEncode(std::string_view str);
+
+/**
+ * Splits a form-encoded body ("a=1&b=2") into decoded name/value pairs.
+ */
+HttpHeaders parseForm(std::string_view body);
+
+/**
+ * Finds a value by name.
+ * @return The value, or empty if there is none
+ */
+std::string_view findValue(const HttpHeaders& pairs, std::string_view name) noexcept;
+
+#endif // HTTP_H
@@ -0,0 +1,216 @@
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "json.h"
+
+#include <cctype>
+#include <cstdio>
+
+namespace json {
+
+static void skipSpace(std::string_view text, std::size_t& pos) noexcept
+{
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+        ++pos;
+}
+
+/** Checks for and skips the given character after any whitespace. */
+static bool expect(std::string_view text, std::size_t& pos, char c) noexcept
+{
+    skipSpace(text, pos);
+    if (pos < text.size() && text[pos] == c) {
+        ++pos;
+        return true;
+    }
+    return false;
+}
+
+/** Skips a number, e.g. -12.5e3. */
+static bool skipNumber(std::string_view text, std::size_t& pos) noexcept
+{
+    const auto digits = [&] {
+        const auto start = pos;
+        while (pos < text.size() && std::isdigit(static_cast<unsigned char>(text[pos])))
+            ++pos;
+        return pos > start;
+    };
+
+    if (pos < text.size() && text[pos] == '-')
+        ++pos;
+    if (!digits())
+        return false;
+    if (pos < text.size() && text[pos] == '.') {
+        ++pos;
+        if (!digits())
+            return false;
+    }
+    if (pos < text.size() && (text[pos] == 'e' || text[pos] == 'E')) {
+        ++pos;
+        if (pos < text.size() && (text[pos] == '+' || text[pos] == '-'))
+            ++pos;
+        if (!digits())
+            return false;
+    }
+    return true;
+}
+
+std::optional<std::string> readString(std::string_view text, std::size_t& pos)
+{
+    if (!expect(text, pos, '"'))
+        return {};
+
+    std::string str;
+    while (pos < text.size()) {
+        const auto c = text[pos++];
+
+        if (c == '"') {
+            return str;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            return {};
+        } else if (c != '\\') {
+            str += c;
+        } else if (pos < text.size()) {
+            switch (const auto e = text[pos++]; e) {
+            case '"': case '\\': case '/': str += e; break;
+            case 'b': str += '\b'; break;
+            case 'f': str += '\f'; break;
+            case 'n': str += '\n'; break;
+            case 'r': str += '\r'; break;
+            case 't': str += '\t'; break;
+            case 'u':
+                if (pos + 4 > text.size())
+                    return {};
+                str += "\\u";
+                str += text.substr(pos, 4);
+                pos += 4;
+                break;
+            default:
+                return {};
+            }
+        }
+    }
+
+    return {};
+}
+
+using MemberFn = std::function<bool(const std::string&, std::string_view)>;
+using ElementFn = std::function<bool(std::string_view)>;
+
+static bool members(std::string_view text, std::size_t& pos, const MemberFn& fn, unsigned depth);
+static bool elements(std::string_view text, std::size_t& pos, const ElementFn& fn, unsigned depth);
+
+bool skipValue(std::string_view text, std::size_t& pos, unsigned depth)
+{
+    if (depth > MaxDepth)
+        return false;
+
+    skipSpace(text, pos);
+    if (pos >= text.size())
+        return false;
+
+    switch (text[pos]) {
+    case '"':
+        return readString(text, pos).has_value();
+    case '{':
+        return members(text, pos, [](const auto&, auto) { return true; }, depth);
+    case '[':
+        return elements(text, pos, [](auto) { return true; }, depth);
+    case 't':
+        pos += 4;
+        return pos <= text.size() && text.substr(pos - 4, 4) == "true";
+    case 'f':
+        pos += 5;
+        return pos <= text.size() && text.substr(pos - 5, 5) == "false";
+    case 'n':
+        pos += 4;
+        return pos <= text.size() && text.substr(pos - 4, 4) == "null";
+    default:
+        return skipNumber(text, pos);
+    }
+}
+
+static bool members(std::string_view text, std::size_t& pos, const MemberFn& fn, unsigned depth)
+{
+    if (!expect(text, pos, '{'))
+        return false;
+    if (expect(text, pos, '}'))
+        return true;
+
+    do {
+        const auto key = readString(text, pos);
+        if (!key || !expect(text, pos, ':'))
+            return false;
+
+        skipSpace(text, pos);
+        const auto start = pos;
+        if (!skipValue(text, pos, depth + 1) || !fn(*key, text.substr(start, pos - start)))
+            return false;
+    } while (expect(text, pos, ','));
+
+    return expect(text, pos, '}');
+}
+
+static bool elements(std::string_view text, std::size_t& pos, const ElementFn& fn, unsigned depth)
+{
+    if (!expect(text, pos, '['))
+        return false;
+    if (expect(text, pos, ']'))
+        return true;
+
+    do {
+        skipSpace(text, pos);
+        const auto start = pos;
+        if (!skipValue(text, pos, depth + 1) || !fn(text.substr(start, pos - start)))
+            return false;
+    } while (expect(text, pos, ','));
+
+    return expect(text, pos, ']');
+}
+
+bool forEachMember(std::string_view text, std::size_t& pos, const MemberFn& fn)
+{
+    return members(text, pos, fn, 0);
+}
+
+bool forEachElement(std::string_view text, std::size_t& pos, const ElementFn& fn)
+{
+    return elements(text, pos, fn, 0);
+}
+
+std::string quote(std::string_view str)
+{
+    std::string out;
+    out.reserve(str.size() + 2);
+    out += '"';
+
+    for (const auto c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char esc[8];
+            std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += c;
+        }
+    }
+
+    out += '"';
+    return out;
+}
+
+} // namespace json
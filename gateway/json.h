@@ -0,0 +1,81 @@
+/// @file
+/// @brief Minimal JSON reading and writing for the device API's bodies
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef JSON_H
+#define JSON_H
+
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/**
+ * The gateway only needs to pick a few fields out of small, flat bodies and
+ * to pass measurement objects on unchanged, so values are located within the
+ * text rather than parsed into a tree.
+ */
+namespace json {
+
+/** Deepest nesting of arrays and objects that is accepted. */
+constexpr unsigned MaxDepth = 8;
+
+/**
+ * Skips over one value, checking its syntax.
+ * @param text JSON text
+ * @param pos Position of the value (or whitespace before it); moved past it
+ * @return True if the value is valid
+ */
+bool skipValue(std::string_view text, std::size_t& pos, unsigned depth = 0);
+
+/**
+ * Reads a string value, decoding escapes (\\uXXXX is kept as-is).
+ * @param text JSON text
+ * @param pos Position of the string (or whitespace before it); moved past it
+ * @return The string, or nothing if there is no valid string at pos
+ */
+std::optional<std::string> readString(std::string_view text, std::size_t& pos);
+
+/**
+ * Visits each member of an object.
+ * @param text JSON text
+ * @param pos Position of the object (or whitespace before it); moved past it
+ * @param fn Called with each key and the text of its value; returns false to fail
+ * @return True if the object is valid and fn accepted every member
+ */
+bool forEachMember(std::string_view text, std::size_t& pos,
+    const std::function<bool(const std::string&, std::string_view)>& fn);
+
+/**
+ * Visits each element of an array.
+ * @param text JSON text
+ * @param pos Position of the array (or whitespace before it); moved past it
+ * @param fn Called with the text of each element; returns false to fail
+ * @return True if the array is valid and fn accepted every element
+ */
+bool forEachElement(std::string_view text, std::size_t& pos,
+    const std::function<bool(std::string_view)>& fn);
+
+/**
+ * Formats a string as a quoted JSON string.
+ */
+std::string quote(std::string_view str);
+
+} // namespace json
+
+#endif // JSON_H
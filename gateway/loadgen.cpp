@@ -0,0 +1,313 @@
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Load generator for trying the gateway with many devices at once.
+//
+// "loadgen upstream" stands in for the public API, counting the packets it
+// receives. "loadgen devices" simulates devices that each connect and upload
+// a batch of measurements, like the firmware does, and reports the latency
+// of the gateway's answers.
+
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static void raiseFileLimit()
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static bool parseAddress(const std::string& str, sockaddr_in& addr)
+{
+    const auto colon = str.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(std::strtoul(str.c_str() + colon + 1, nullptr, 10)));
+    return inet_pton(AF_INET, str.substr(0, colon).c_str(), &addr.sin_addr) == 1;
+}
+
+/**
+ * Counts the measurements in a "measurements" body.
+ */
+static std::size_t countPackets(const std::string& body)
+{
+    std::size_t count = 0;
+    for (auto pos = body.find("\"timestamp\""); pos != std::string::npos; pos = body.find("\"timestamp\"", pos + 1))
+        ++count;
+    return count;
+}
+
+static int runUpstream(const std::string& listen)
+{
+    sockaddr_in addr;
+    if (!parseAddress(listen, addr)) {
+        std::fprintf(stderr, "Bad address: %s\n", listen.c_str());
+        return 1;
+    }
+
+    uint64_t requests = 0, packets = 0;
+    uint64_t lastPackets = 0;
+
+    Server server ([&](HttpRequest&& req, Server::Responder respond) {
+        ++requests;
+
+        if (req.path.size() > 13 && req.path.compare(req.path.size() - 13, 13, "/measurements") == 0)
+            packets += countPackets(req.body);
+
+        respond(HttpResponse::result(200, "ok", "Stored"));
+    });
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    if (!server.listen(ip, ntohs(addr.sin_port)))
+        return 1;
+
+    server.every(5000, [&] {
+        if (packets != lastPackets) {
+            std::printf("upstream: %lu requests, %lu packets\n", requests, packets);
+            std::fflush(stdout);
+            lastPackets = packets;
+        }
+    });
+
+    server.run();
+    return 0;
+}
+
+/** One simulated device. */
+struct Device {
+    int fd = -1;
+    unsigned id;
+    unsigned round = 0;
+    std::string out;
+    std::size_t sent = 0;
+    std::string in;
+    Clock::time_point started;
+};
+
+static std::string makeRequest(unsigned id, unsigned round, unsigned packets, const std::string& host)
+{
+    char uuid[40];
+    std::snprintf(uuid, sizeof(uuid), "00000000-0000-4000-8000-%012u", id);
+
+    std::string body = std::string("{\"device\":\"") + uuid + "\",\"measurements\":[";
+    for (unsigned i = 0; i < packets; ++i) {
+        char packet[160];
+        std::snprintf(packet, sizeof(packet),
+            "%s{\"timestamp\":\"2024-06-01T12:%02u:%02uZ\",\"min\":41,\"max\":67,\"mean\":52,\"seq\":%u}",
+            i > 0 ? "," : "", (round * packets + i) / 60 % 60, (round * packets + i) % 60,
+            round * packets + i + 1);
+        body += packet;
+    }
+    body += "]}";
+
+    return "POST /v1/measurements HTTP/1.1\r\nHost: " + host +
+        "\r\nAuthorization: Token loadgen\r\nContent-Type: application/json\r\nContent-Length: " +
+        std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+}
+
+static int runDevices(const std::string& target, unsigned count, unsigned rounds, unsigned packets)
+{
+    sockaddr_in addr;
+    if (!parseAddress(target, addr)) {
+        std::fprintf(stderr, "Bad address: %s\n", target.c_str());
+        return 1;
+    }
+
+    const auto epollFd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<Device> devices (count);
+    std::vector<double> latencies;
+    latencies.reserve(static_cast<std::size_t>(count) * rounds);
+    uint64_t errors = 0;
+    unsigned remaining = count;
+
+    const auto start = [&](Device& dev) {
+        dev.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        const int one = 1;
+        setsockopt(dev.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        dev.out = makeRequest(dev.id, dev.round, packets, target);
+        dev.sent = 0;
+        dev.in.clear();
+        dev.started = Clock::now();
+
+        if (connect(dev.fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 && errno != EINPROGRESS) {
+            std::perror("connect");
+            std::exit(1);
+        }
+
+        epoll_event ev {};
+        ev.events = EPOLLOUT | EPOLLIN;
+        ev.data.ptr = &dev;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, dev.fd, &ev);
+    };
+
+    const auto finish = [&](Device& dev, bool ok) {
+        if (ok)
+            latencies.push_back(std::chrono::duration<double, std::milli>(Clock::now() - dev.started).count());
+        else
+            ++errors;
+
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, dev.fd, nullptr);
+        close(dev.fd);
+        dev.fd = -1;
+
+        if (++dev.round < rounds)
+            start(dev);
+        else
+            --remaining;
+    };
+
+    const auto begin = Clock::now();
+
+    for (unsigned i = 0; i < count; ++i) {
+        devices[i].id = i;
+        start(devices[i]);
+    }
+
+    std::vector<epoll_event> events (1024);
+    while (remaining > 0) {
+        const auto n = epoll_wait(epollFd, events.data(), events.size(), 1000);
+
+        for (int i = 0; i < n; ++i) {
+            auto& dev = *static_cast<Device *>(events[i].data.ptr);
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                finish(dev, false);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && dev.sent < dev.out.size()) {
+                const auto r = send(dev.fd, dev.out.data() + dev.sent, dev.out.size() - dev.sent, MSG_NOSIGNAL);
+                if (r > 0)
+                    dev.sent += r;
+                else if (errno != EAGAIN) {
+                    finish(dev, false);
+                    continue;
+                }
+
+                if (dev.sent == dev.out.size()) {
+                    epoll_event ev {};
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = &dev;
+                    epoll_ctl(epollFd, EPOLL_CTL_MOD, dev.fd, &ev);
+                }
+            }
+
+            if (events[i].events & EPOLLIN) {
+                char buffer[4096];
+                ssize_t r;
+                while ((r = recv(dev.fd, buffer, sizeof(buffer), 0)) > 0)
+                    dev.in.append(buffer, r);
+
+                // The gateway closes the connection after answering.
+                if (r == 0 || (r < 0 && errno != EAGAIN))
+                    finish(dev, dev.in.compare(0, 12, "HTTP/1.1 200") == 0);
+            }
+        }
+    }
+
+    const auto seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    std::sort(latencies.begin(), latencies.end());
+
+    const auto percentile = [&](double p) {
+        return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1,
+            static_cast<std::size_t>(p * latencies.size()))];
+    };
+
+    std::printf("%u devices x %u uploads of %u packets: %zu ok, %lu failed in %.2f s\n",
+        count, rounds, packets, latencies.size(), errors, seconds);
+    std::printf("%.0f uploads/s, %.0f packets/s; latency p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+        latencies.size() / seconds, latencies.size() * packets / seconds,
+        percentile(0.50), percentile(0.99), latencies.empty() ? 0.0 : latencies.back());
+
+    close(epollFd);
+    return errors == 0 ? 0 : 1;
+}
+
+static void usage(const char *name)
+{
+    std::printf(
+        "Usage: %s upstream [--listen ADDR:PORT]\n"
+        "       %s devices [--target ADDR:PORT] [--devices N] [--rounds N] [--packets N]\n",
+        name, name);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const std::string mode = argv[1];
+    std::string listen = "127.0.0.1:9090";
+    std::string target = "127.0.0.1:8080";
+    unsigned devices = 1000, rounds = 1, packets = 4;
+
+    for (int i = 2; i + 1 < argc; i += 2) {
+        const std::string arg = argv[i];
+        const char *value = argv[i + 1];
+
+        if (arg == "--listen")
+            listen = value;
+        else if (arg == "--target")
+            target = value;
+        else if (arg == "--devices")
+            devices = std::strtoul(value, nullptr, 10);
+        else if (arg == "--rounds")
+            rounds = std::strtoul(value, nullptr, 10);
+        else if (arg == "--packets")
+            packets = std::strtoul(value, nullptr, 10);
+    }
+
+    raiseFileLimit();
+    std::signal(SIGPIPE, SIG_IGN);
+
+    if (mode == "upstream")
+        return runUpstream(listen);
+    else if (mode == "devices")
+        return runDevices(target, devices, rounds, packets);
+
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,209 @@
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "gateway.h"
+#include "server.h"
+#include "upstream.h"
+
+#include <curl/curl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+/** Seconds between status lines. */
+static constexpr unsigned STATUS_INTERVAL_SEC = 60;
+/** Most seconds to spend sending queues after being asked to exit. */
+static constexpr unsigned SHUTDOWN_TIMEOUT_SEC = 30;
+
+static void usage(const char *name)
+{
+    std::printf(
+        "Usage: %s [options]\n"
+        "  --listen ADDR:PORT     Address to serve devices on (default 0.0.0.0:8080)\n"
+        "  --upstream URL         Public API base URL (default https://api.tracket.info/v1/)\n"
+        "  --public-url URL       This gateway's base URL as devices see it, e.g.\n"
+        "                         http://192.168.1.10:8080/v1/; enables firmware caching\n"
+        "  --batch N              Packets per upstream request (default 48)\n"
+        "  --flush SEC            Longest a packet is held (default 900)\n"
+        "  --max-queued N         Packets held before devices are asked to wait (default 1000000)\n"
+        "  --connections N        Connections kept open to the public API (default 8)\n"
+        "  --ota-cache SEC        Seconds to reuse the latest software answer (default 3600)\n",
+        name);
+}
+
+/**
+ * Raises the open file limit so that thousands of devices can connect.
+ */
+static void raiseFileLimit()
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * Makes sure that a base URL ends with a slash.
+ */
+static std::string withSlash(std::string url)
+{
+    if (!url.empty() && url.back() != '/')
+        url += '/';
+    return url;
+}
+
+int main(int argc, char *argv[])
+{
+    Gateway::Config config;
+    std::string listenAddress = "0.0.0.0";
+    uint16_t listenPort = 8080;
+    unsigned connections = 8;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (arg == "--help" || arg == "-h") {
+            usage(argv[0]);
+            return 0;
+        } else if (value == nullptr) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (arg == "--listen") {
+            const std::string str = value;
+            const auto colon = str.rfind(':');
+            if (colon == std::string::npos) {
+                std::fprintf(stderr, "--listen needs ADDR:PORT\n");
+                return 1;
+            }
+            listenAddress = str.substr(0, colon);
+            listenPort = static_cast<uint16_t>(std::strtoul(str.c_str() + colon + 1, nullptr, 10));
+        } else if (arg == "--upstream") {
+            config.upstreamUrl = withSlash(value);
+        } else if (arg == "--public-url") {
+            config.publicUrl = withSlash(value);
+        } else if (arg == "--batch") {
+            config.batchSize = std::max(1ul, std::strtoul(value, nullptr, 10));
+        } else if (arg == "--flush") {
+            config.flushSec = std::strtoul(value, nullptr, 10);
+        } else if (arg == "--max-queued") {
+            config.maxQueued = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--connections") {
+            connections = std::max(1ul, std::strtoul(value, nullptr, 10));
+        } else if (arg == "--ota-cache") {
+            config.otaCacheSec = std::strtoul(value, nullptr, 10);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+
+        ++i;
+    }
+
+    // Up to four requests per connection keep them busy without queueing in libcurl.
+    config.maxInFlight = connections * 4;
+
+    raiseFileLimit();
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    // Signals are read from the event loop, so that queues can be sent before exiting.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+    const auto signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    {
+        Upstream upstream (connections);
+        Gateway gateway (config, upstream);
+        Server server ([&gateway](HttpRequest&& req, Server::Responder respond) {
+            gateway.handle(std::move(req), std::move(respond));
+        });
+
+        if (!server.listen(listenAddress, listenPort))
+            return 1;
+
+        bool exiting = false;
+        unsigned ticks = 0;
+
+        server.watch(upstream.eventFd(), [&upstream] { upstream.dispatch(); });
+        server.watch(signalFd, [&] {
+            signalfd_siginfo info;
+            if (read(signalFd, &info, sizeof(info)) <= 0)
+                return;
+
+            if (exiting) {
+                // Asked twice: give up on what is queued.
+                server.stop();
+                return;
+            }
+
+            std::printf("Exiting; sending %zu queued packets\n", gateway.queuedPackets());
+            std::fflush(stdout);
+            exiting = true;
+            ticks = 0;
+            server.stopListening();
+            gateway.flushAll();
+        });
+
+        server.every(1000, [&] {
+            gateway.tick();
+            ++ticks;
+
+            if (exiting) {
+                if (gateway.idle() || ticks >= SHUTDOWN_TIMEOUT_SEC)
+                    server.stop();
+            } else if (ticks % STATUS_INTERVAL_SEC == 0) {
+                const auto& s = server.stats();
+                const auto& g = gateway.stats();
+                const auto& u = upstream.stats();
+
+                std::printf("connections %u (peak %u), requests %lu, "
+                    "packets received %lu, queued %zu, delivered %lu, rejected %lu, dropped %lu, "
+                    "upstream requests %lu (failed %lu)\n",
+                    s.open, s.peak, s.requests,
+                    g.received, gateway.queuedPackets(), g.delivered, g.rejected, g.dropped,
+                    u.requests, u.failures);
+                std::fflush(stdout);
+            }
+        });
+
+        std::printf("Listening on %s:%u, forwarding to %s\n",
+            listenAddress.c_str(), listenPort, config.upstreamUrl.c_str());
+        std::fflush(stdout);
+
+        server.run();
+
+        if (gateway.queuedPackets() > 0)
+            std::fprintf(stderr, "Exited with %zu packets unsent\n", gateway.queuedPackets());
+    }
+
+    close(signalFd);
+    curl_global_cleanup();
+    return 0;
+}
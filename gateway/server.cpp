@@ -0,0 +1,356 @@
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+/** Most connections accepted per readiness event, so that others get a turn. */
+static constexpr unsigned ACCEPT_BATCH = 256;
+
+Server::Server(Handler handler_):
+    handler(std::move(handler_)),
+    epollFd(epoll_create1(EPOLL_CLOEXEC)),
+    lastSweep(Clock::now()) {}
+
+Server::~Server()
+{
+    for (auto& [fd, conn] : connections)
+        ::close(fd);
+    if (listenFd >= 0)
+        ::close(listenFd);
+    if (timerFd >= 0)
+        ::close(timerFd);
+    if (epollFd >= 0)
+        ::close(epollFd);
+}
+
+bool Server::listen(const std::string& address, uint16_t port)
+{
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        std::fprintf(stderr, "Invalid listen address: %s\n", address.c_str());
+        return false;
+    }
+
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    const int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (listenFd < 0 ||
+        bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listenFd, SOMAXCONN) != 0)
+    {
+        std::perror("listen");
+        return false;
+    }
+
+    epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listenFd;
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev) == 0;
+}
+
+void Server::stopListening()
+{
+    if (listenFd >= 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, listenFd, nullptr);
+        ::close(listenFd);
+        listenFd = -1;
+    }
+}
+
+void Server::watch(int fd, std::function<void()> fn)
+{
+    watched[fd] = std::move(fn);
+
+    epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void Server::every(unsigned ms, std::function<void()> fn)
+{
+    if (timerFd < 0) {
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.fd = timerFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+    }
+
+    itimerspec spec {};
+    spec.it_interval.tv_sec = ms / 1000;
+    spec.it_interval.tv_nsec = (ms % 1000) * 1000000L;
+    spec.it_value = spec.it_interval;
+    timerfd_settime(timerFd, 0, &spec, nullptr);
+    periodic = std::move(fn);
+}
+
+void Server::run()
+{
+    std::array<epoll_event, 512> events;
+    running = true;
+
+    while (running) {
+        const auto n = epoll_wait(epollFd, events.data(), events.size(), 1000);
+        if (n < 0 && errno != EINTR) {
+            std::perror("epoll_wait");
+            break;
+        }
+
+        for (auto i = 0; i < n; ++i) {
+            const auto fd = events[i].data.fd;
+
+            if (fd == listenFd) {
+                accept();
+            } else if (fd == timerFd) {
+                uint64_t expirations;
+                if (read(timerFd, &expirations, sizeof(expirations)) > 0 && periodic)
+                    periodic();
+            } else if (const auto w = watched.find(fd); w != watched.end()) {
+                w->second();
+            } else if (const auto c = connections.find(fd); c != connections.end()) {
+                auto& conn = c->second;
+
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    close(conn);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT)
+                    flush(conn);
+                // flush() may have closed the connection.
+                if ((events[i].events & EPOLLIN) && connections.count(fd) != 0)
+                    readFrom(conn);
+            }
+        }
+
+        if (Clock::now() - lastSweep >= std::chrono::seconds(1))
+            sweep();
+    }
+}
+
+void Server::accept()
+{
+    for (auto i = 0u; i < ACCEPT_BATCH; ++i) {
+        const auto fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE)
+                std::fprintf(stderr, "Out of file descriptors; raise the open file limit.\n");
+            break;
+        }
+
+        // Responses are written whole, so there is nothing to gain from Nagle.
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        epoll_event ev {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            ::close(fd);
+            continue;
+        }
+
+        auto& conn = connections[fd];
+        conn = Connection();
+        conn.fd = fd;
+        conn.generation = nextGeneration++;
+        conn.lastActive = Clock::now();
+
+        ++counters.accepted;
+        ++counters.open;
+        counters.peak = std::max(counters.peak, counters.open);
+    }
+}
+
+void Server::readFrom(Connection& conn)
+{
+    std::array<char, 4096> buffer;
+
+    while (true) {
+        const auto n = recv(conn.fd, buffer.data(), buffer.size(), 0);
+
+        if (n > 0) {
+            conn.in.append(buffer.data(), n);
+            conn.lastActive = Clock::now();
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            // Closed by the device, or failed.
+            close(conn);
+            return;
+        }
+
+        // Bound what a connection may buffer while its request is pending.
+        if (conn.in.size() > HttpParser::MaxHeaderSize + HttpParser::MaxBodySize) {
+            close(conn);
+            return;
+        }
+    }
+
+    process(conn);
+}
+
+void Server::process(Connection& conn)
+{
+    if (conn.busy || conn.closing)
+        return;
+
+    HttpRequest request;
+    int error;
+
+    switch (HttpParser::parse(conn.in, request, error)) {
+    case HttpParser::Status::Incomplete:
+        break;
+    case HttpParser::Status::Error:
+        ++counters.badRequests;
+        conn.busy = true;
+        conn.in.clear();
+        respond(conn.fd, conn.generation, false, HttpResponse::result(error, "error", reasonPhrase(error)));
+        break;
+    case HttpParser::Status::Complete:
+    {
+        ++counters.requests;
+        conn.busy = true;
+
+        // The responder may be called after this connection is gone, or
+        // after its fd was reused, so it refers to the connection by both.
+        const auto keepAlive = request.keepAlive;
+        handler(std::move(request),
+            [this, fd = conn.fd, gen = conn.generation, keepAlive](HttpResponse resp) {
+                respond(fd, gen, keepAlive, std::move(resp));
+            });
+        break;
+    }
+    }
+}
+
+void Server::respond(int fd, uint64_t generation, bool keepAlive, HttpResponse&& resp)
+{
+    const auto c = connections.find(fd);
+    if (c == connections.end() || c->second.generation != generation)
+        return;
+
+    auto& conn = c->second;
+    conn.out += resp.head(keepAlive);
+    if (resp.sharedBody) {
+        conn.outShared = std::move(resp.sharedBody);
+        conn.sharedSent = 0;
+    } else {
+        conn.out += resp.body;
+    }
+    conn.closing = !keepAlive;
+    flush(conn);
+}
+
+void Server::flush(Connection& conn)
+{
+    const auto sendSome = [&](const char *data, std::size_t size) -> long {
+        const auto n = send(conn.fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return 0;
+        return n;
+    };
+
+    while (!conn.out.empty()) {
+        const auto n = sendSome(conn.out.data(), conn.out.size());
+        if (n < 0) {
+            close(conn);
+            return;
+        }
+        if (n == 0)
+            break;
+        conn.out.erase(0, n);
+        conn.lastActive = Clock::now();
+    }
+
+    while (conn.out.empty() && conn.outShared && conn.sharedSent < conn.outShared->size()) {
+        const auto n = sendSome(conn.outShared->data() + conn.sharedSent,
+            conn.outShared->size() - conn.sharedSent);
+        if (n < 0) {
+            close(conn);
+            return;
+        }
+        if (n == 0)
+            break;
+        conn.sharedSent += n;
+        conn.lastActive = Clock::now();
+    }
+
+    const auto done = conn.out.empty() &&
+        (!conn.outShared || conn.sharedSent == conn.outShared->size());
+
+    // Only wait for the socket to take more while there is more to send.
+    if (done == conn.writeWait) {
+        epoll_event ev {};
+        ev.events = EPOLLIN | EPOLLRDHUP | (done ? 0u : static_cast<uint32_t>(EPOLLOUT));
+        ev.data.fd = conn.fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.writeWait = !done;
+    }
+
+    if (done && conn.busy) {
+        conn.outShared.reset();
+        conn.busy = false;
+
+        if (conn.closing)
+            close(conn);
+        else
+            process(conn);
+    }
+}
+
+void Server::close(Connection& conn)
+{
+    ::close(conn.fd);
+    --counters.open;
+    connections.erase(conn.fd);
+}
+
+void Server::sweep()
+{
+    const auto now = Clock::now();
+    lastSweep = now;
+
+    for (auto it = connections.begin(); it != connections.end();) {
+        auto& conn = it->second;
+        ++it;
+
+        // Connections waiting on an upstream request are not idle.
+        if (!conn.busy && now - conn.lastActive >= std::chrono::seconds(IdleTimeoutSec)) {
+            ++counters.timeouts;
+            close(conn);
+        }
+    }
+}
@@ -0,0 +1,175 @@
+/// @file
+/// @brief Event-driven (epoll) HTTP server for many device connections
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "http.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief Serves HTTP/1.1 requests on one thread using epoll.
+ *
+ * Every socket is non-blocking and the loop only sleeps in epoll_wait(), so
+ * thousands of device connections cost little more than their buffers.
+ * Connections are kept alive between requests, and requests on one
+ * connection are handled one at a time, in order.
+ *
+ * A request may be answered later, e.g. once an upstream request finishes:
+ * the handler keeps the Responder it is given and calls it when ready. If
+ * the connection has closed in the meantime, the response is dropped.
+ *
+ * Other descriptors (e.g. an eventfd) and a periodic timer can be added to
+ * the same loop with watch() and every().
+ */
+class Server
+{
+public:
+    /** Clock used for timeouts. */
+    using Clock = std::chrono::steady_clock;
+    /** Sends the response to a request; may be called once. */
+    using Responder = std::function<void(HttpResponse)>;
+    /** Handles a request, calling the responder now or later. */
+    using Handler = std::function<void(HttpRequest&&, Responder)>;
+
+    /** Seconds that an idle connection is kept open. */
+    static constexpr unsigned IdleTimeoutSec = 60;
+
+    /** Connection counters. */
+    struct Stats {
+        /** Number of open connections. */
+        unsigned open = 0;
+        /** Most connections open at once. */
+        unsigned peak = 0;
+        /** Number of connections accepted. */
+        uint64_t accepted = 0;
+        /** Number of requests handled. */
+        uint64_t requests = 0;
+        /** Number of malformed requests. */
+        uint64_t badRequests = 0;
+        /** Number of connections closed for being idle. */
+        uint64_t timeouts = 0;
+    };
+
+    /**
+     * Prepares a server that passes requests to the given handler.
+     */
+    explicit Server(Handler handler_);
+    ~Server();
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    /**
+     * Starts listening for connections.
+     * @param address IPv4 address to listen on, e.g. "0.0.0.0"
+     * @param port Port to listen on
+     * @return True on success
+     */
+    bool listen(const std::string& address, uint16_t port);
+
+    /**
+     * Stops accepting new connections; open ones are still served.
+     */
+    void stopListening();
+
+    /**
+     * Calls fn whenever fd becomes readable.
+     */
+    void watch(int fd, std::function<void()> fn);
+
+    /**
+     * Calls fn about every given number of milliseconds.
+     * Only one periodic callback is supported.
+     */
+    void every(unsigned ms, std::function<void()> fn);
+
+    /**
+     * Handles events until stop() is called.
+     */
+    void run();
+
+    /**
+     * Makes run() return.
+     */
+    void stop() noexcept {
+        running = false;
+    }
+
+    /**
+     * Provides the connection counters.
+     */
+    const Stats& stats() const noexcept {
+        return counters;
+    }
+
+private:
+    /** State of one device connection. */
+    struct Connection {
+        int fd;
+        /** Distinguishes this connection from earlier ones that used the same fd. */
+        uint64_t generation;
+        /** Received bytes that have not been parsed yet. */
+        std::string in;
+        /** Bytes waiting to be sent. */
+        std::string out;
+        /** Shared body to send after out, if any. */
+        std::shared_ptr<const std::string> outShared;
+        /** Bytes of outShared sent so far. */
+        std::size_t sharedSent = 0;
+        /** Set while a request is waiting for its response. */
+        bool busy = false;
+        /** Set once the connection should close after sending. */
+        bool closing = false;
+        /** Set while waiting for the socket to accept more bytes. */
+        bool writeWait = false;
+        /** Last time anything was received or sent. */
+        Clock::time_point lastActive;
+    };
+
+    Handler handler;
+    int epollFd = -1;
+    int listenFd = -1;
+    int timerFd = -1;
+    bool running = false;
+    uint64_t nextGeneration = 1;
+    Clock::time_point lastSweep;
+    std::unordered_map<int, Connection> connections;
+    std::unordered_map<int, std::function<void()>> watched;
+    std::function<void()> periodic;
+    Stats counters;
+
+    void accept();
+    void readFrom(Connection& conn);
+    /** Parses and handles the next buffered request, if not busy. */
+    void process(Connection& conn);
+    void respond(int fd, uint64_t generation, bool keepAlive, HttpResponse&& resp);
+    /** Sends as much pending output as the socket takes. */
+    void flush(Connection& conn);
+    void close(Connection& conn);
+    /** Closes connections that have been idle for too long. */
+    void sweep();
+};
+
+#endif // SERVER_H
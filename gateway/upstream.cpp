@@ -0,0 +1,223 @@
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "upstream.h"
+
+#include <curl/curl.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <strings.h>
+
+/** Seconds allowed for a request, including connecting. */
+static constexpr long REQUEST_TIMEOUT_SEC = 60;
+
+/** A request and its state while the worker runs it. */
+struct Upstream::Job {
+    Request request;
+    Callback callback;
+    Response response;
+    CURL *easy = nullptr;
+    curl_slist *headers = nullptr;
+    char error[CURL_ERROR_SIZE] = {};
+    /** Set when the response outgrew request.maxResponse. */
+    bool tooLarge = false;
+};
+
+std::size_t Upstream::onBody(char *data, std::size_t size, std::size_t count, void *user)
+{
+    auto job = static_cast<Job *>(user);
+    const auto n = size * count;
+
+    if (job->response.body.size() + n > job->request.maxResponse) {
+        job->tooLarge = true;
+        return 0; // Aborts the transfer.
+    }
+
+    job->response.body.append(data, n);
+    return n;
+}
+
+std::size_t Upstream::onHeader(char *data, std::size_t size, std::size_t count, void *user)
+{
+    auto job = static_cast<Job *>(user);
+    const auto n = size * count;
+
+    constexpr char Name[] = "retry-after:";
+    if (n > sizeof(Name) && strncasecmp(data, Name, sizeof(Name) - 1) == 0) {
+        // Only the number-of-seconds form is used by the public API.
+        job->response.retryAfter = std::strtoul(data + sizeof(Name) - 1, nullptr, 10);
+    }
+
+    return n;
+}
+
+Upstream::Upstream(unsigned maxConnections_):
+    maxConnections(maxConnections_),
+    notifyFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    multi(curl_multi_init())
+{
+    auto m = static_cast<CURLM *>(multi);
+    curl_multi_setopt(m, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(maxConnections));
+    curl_multi_setopt(m, CURLMOPT_MAXCONNECTS, static_cast<long>(maxConnections * 2));
+    // Let requests to the same host share connections as they come free.
+    curl_multi_setopt(m, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    worker = std::thread(&Upstream::run, this);
+}
+
+Upstream::~Upstream()
+{
+    running = false;
+    curl_multi_wakeup(static_cast<CURLM *>(multi));
+    worker.join();
+
+    for (auto job : submitted)
+        delete job;
+    for (auto job : finished)
+        delete job;
+
+    curl_multi_cleanup(static_cast<CURLM *>(multi));
+    close(notifyFd);
+}
+
+void Upstream::submit(Request request, Callback callback)
+{
+    auto job = new Job;
+    job->request = std::move(request);
+    job->callback = std::move(callback);
+
+    ++counters.requests;
+    ++counters.pending;
+    counters.bytesSent += job->request.body.size();
+
+    {
+        std::lock_guard lock (mutex);
+        submitted.push_back(job);
+    }
+
+    curl_multi_wakeup(static_cast<CURLM *>(multi));
+}
+
+void Upstream::dispatch()
+{
+    uint64_t count;
+    if (read(notifyFd, &count, sizeof(count)) < 0)
+        return;
+
+    std::deque<Job *> ready;
+    {
+        std::lock_guard lock (mutex);
+        ready.swap(finished);
+    }
+
+    for (auto job : ready) {
+        --counters.pending;
+        if (job->response.status == 0)
+            ++counters.failures;
+
+        job->callback(std::move(job->response));
+        delete job;
+    }
+}
+
+void Upstream::run()
+{
+    auto m = static_cast<CURLM *>(multi);
+
+    while (running) {
+        std::deque<Job *> jobs;
+        {
+            std::lock_guard lock (mutex);
+            jobs.swap(submitted);
+        }
+
+        for (auto job : jobs) {
+            auto easy = curl_easy_init();
+            const auto& req = job->request;
+            job->easy = easy;
+
+            curl_easy_setopt(easy, CURLOPT_URL, req.url.c_str());
+            curl_easy_setopt(easy, CURLOPT_PRIVATE, job);
+            curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, job->error);
+            curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, onBody);
+            curl_easy_setopt(easy, CURLOPT_WRITEDATA, job);
+            curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, onHeader);
+            curl_easy_setopt(easy, CURLOPT_HEADERDATA, job);
+            curl_easy_setopt(easy, CURLOPT_TIMEOUT, REQUEST_TIMEOUT_SEC);
+            curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(easy, CURLOPT_USERAGENT, "noisemeter-gateway");
+            // Waiting for a pooled connection beats opening (and handshaking) another.
+            curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+
+            if (req.method == "POST") {
+                curl_easy_setopt(easy, CURLOPT_POSTFIELDS, req.body.data());
+                curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, static_cast<long>(req.body.size()));
+            }
+
+            if (!req.contentType.empty())
+                job->headers = curl_slist_append(job->headers, ("Content-Type: " + req.contentType).c_str());
+            if (!req.authorization.empty())
+                job->headers = curl_slist_append(job->headers, ("Authorization: " + req.authorization).c_str());
+            // Bodies are small; skip the round trip of "Expect: 100-continue".
+            job->headers = curl_slist_append(job->headers, "Expect:");
+            curl_easy_setopt(easy, CURLOPT_HTTPHEADER, job->headers);
+
+            curl_multi_add_handle(m, easy);
+        }
+
+        int active;
+        curl_multi_perform(m, &active);
+
+        bool notify = false;
+        int left;
+        while (const auto msg = curl_multi_info_read(m, &left)) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            Job *job;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &job);
+
+            if (msg->data.result == CURLE_OK) {
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &job->response.status);
+            } else {
+                job->response.status = 0;
+                job->response.error = job->tooLarge ? "response too large" :
+                    job->error[0] != '\0' ? job->error : curl_easy_strerror(msg->data.result);
+            }
+
+            curl_multi_remove_handle(m, job->easy);
+            curl_easy_cleanup(job->easy);
+            curl_slist_free_all(job->headers);
+            job->easy = nullptr;
+            job->headers = nullptr;
+
+            std::lock_guard lock (mutex);
+            finished.push_back(job);
+            notify = true;
+        }
+
+        if (notify) {
+            const uint64_t one = 1;
+            if (write(notifyFd, &one, sizeof(one)) < 0)
+                std::perror("eventfd");
+        }
+
+        curl_multi_poll(m, nullptr, 0, 1000, nullptr);
+    }
+}
@@ -0,0 +1,147 @@
+/// @file
+/// @brief Requests to the public API, made on a worker thread
+/* noisemeter-gateway - Local collection gateway for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * @brief Makes HTTP(S) requests to the public API without blocking the
+ * event loop.
+ *
+ * Requests are handed to a worker thread that runs them concurrently with
+ * libcurl, over a small pool of kept-alive connections so that TLS
+ * handshakes are rare. Each request's callback is run on the event loop's
+ * thread, from dispatch(), which the loop calls when eventFd() is readable.
+ */
+class Upstream
+{
+public:
+    /** A request to make. */
+    struct Request {
+        /** "GET" or "POST". */
+        std::string method = "POST";
+        /** Absolute URL. */
+        std::string url;
+        /** Content type of the body, for POST. */
+        std::string contentType;
+        /** Authorization header value, or empty. */
+        std::string authorization;
+        /** Request body, for POST. */
+        std::string body;
+        /** Largest response body to accept, in bytes. */
+        std::size_t maxResponse = 65536;
+    };
+
+    /** Outcome of a request. */
+    struct Response {
+        /** HTTP status code, or zero if no response was received. */
+        long status = 0;
+        /** Response body. */
+        std::string body;
+        /** Seconds from a Retry-After header, or zero. */
+        unsigned retryAfter = 0;
+        /** Description of a transport error, if status is zero. */
+        std::string error;
+    };
+
+    /** Called with the outcome of a request. */
+    using Callback = std::function<void(Response&&)>;
+
+    /** Request counters. */
+    struct Stats {
+        /** Number of requests made. */
+        uint64_t requests = 0;
+        /** Number that received no response. */
+        uint64_t failures = 0;
+        /** Total request body bytes sent. */
+        uint64_t bytesSent = 0;
+        /** Number of requests waiting or in progress. */
+        unsigned pending = 0;
+    };
+
+    /**
+     * Starts the worker thread.
+     * @param maxConnections Most connections to keep open to each host
+     */
+    explicit Upstream(unsigned maxConnections);
+    ~Upstream();
+
+    Upstream(const Upstream&) = delete;
+    Upstream& operator=(const Upstream&) = delete;
+
+    /**
+     * Queues a request; call from the event loop's thread.
+     * @param request The request to make
+     * @param callback Called from dispatch() once the request is done
+     */
+    void submit(Request request, Callback callback);
+
+    /**
+     * Descriptor that becomes readable when callbacks are ready to run.
+     */
+    int eventFd() const noexcept {
+        return notifyFd;
+    }
+
+    /**
+     * Runs the callbacks of finished requests.
+     */
+    void dispatch();
+
+    /**
+     * Provides the request counters.
+     */
+    const Stats& stats() const noexcept {
+        return counters;
+    }
+
+private:
+    struct Job;
+
+    unsigned maxConnections;
+    /** eventfd that wakes the event loop when jobs finish. */
+    int notifyFd;
+    /** curl multi handle, used only by the worker. */
+    void *multi;
+    std::thread worker;
+    std::atomic<bool> running {true};
+    std::mutex mutex;
+    /** Jobs waiting for the worker; guarded by mutex. */
+    std::deque<Job *> submitted;
+    /** Jobs waiting for their callbacks; guarded by mutex. */
+    std::deque<Job *> finished;
+    Stats counters;
+
+    void run();
+
+    /** Collects a response body (libcurl write callback). */
+    static std::size_t onBody(char *data, std::size_t size, std::size_t count, void *user);
+    /** Reads a response header (libcurl header callback). */
+    static std::size_t onHeader(char *data, std::size_t size, std::size_t count, void *user);
+};
+
+#endif // UPSTREAM_H
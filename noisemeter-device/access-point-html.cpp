@@ -87,6 +87,12 @@ const char *HTML_BODY_FORM_FOOTER = R"html(
       <input type='password' name='psk' id='psk'/><br>
       <label for='email'>Your Email (also your username for logging into the tRacket portal):</label><br>
       <input type='email' name='email' id='email'/><br>
+      <details><summary>Advanced: report to a local gateway</summary>
+      <label for='server'>Server address (leave empty to report to tRacket):</label><br>
+      <input type='url' name='server' id='server' placeholder='http://192.168.1.10/v1/'/><br>
+      <label for='cert'>Server root certificate (PEM; https:// addresses only, leave empty for a public certificate):</label><br>
+      <textarea name='cert' id='cert' rows='6' cols='40'></textarea><br>
+      </details>
       <p><input type='submit' value='Connect'/></p>
     </form>
 )html";
@@ -100,6 +106,12 @@ const char *HTML_BODY_FORM_MANUAL = R"html(
       <input type='password' name='psk'/>
       <p>Your Email (also your username for logging into the tRacket portal):</p>
       <input type='email' name='email'/>
+      <details><summary>Advanced: report to a local gateway</summary>
+      <p>Server address (leave empty to report to tRacket):</p>
+      <input type='url' name='server' placeholder='http://192.168.1.10/v1/'/>
+      <p>Server root certificate (PEM; https:// addresses only, leave empty for a public certificate):</p>
+      <textarea name='cert' rows='6' cols='40'></textarea>
+      </details>
       <p><input type='submit' value='Connect'/></p>
     </form>
 )html";
@@ -88,7 +88,8 @@ void AccessPoint::taskOnCredentialsReceived(void *param)
     auto ap = reinterpret_cast<AccessPoint *>(param);
 
     if (ap->onCredentialsReceived) {
-        const auto msg = ap->onCredentialsReceived(ap->ssid, ap->psk, ap->email);
+        const auto msg = ap->onCredentialsReceived(ap->ssid, ap->psk, ap->email,
+            ap->serverUrl, ap->serverCert);
 
         if (msg) {
             ap->finishHtml = htmlFromMsg(
@@ -133,6 +134,8 @@ bool AccessPoint::handle(WebServer& server, HTTPMethod method, String uri)
             ssid = server.arg("ssid");
             psk = server.arg("psk");
             email = server.arg("email");
+            serverUrl = server.arg("server");
+            serverCert = server.arg("cert");
             complete = false;
             xTaskCreate(taskOnCredentialsReceived, "credrecv", 10000, this, 1, nullptr);
         } else {
@@ -31,7 +31,8 @@
  * up their device. After the user connects to the network using the fixed SSID
  * and passkey, they will be redirected to a setup form via a captive portal.
  * The form collects the user's WiFi credentials and any other needed
- * information (e.g. email address for first-time setup), then allows the
+ * information (e.g. email address for first-time setup, or a local server to
+ * report to instead of the public API), then allows the
  * firmware to store the submitted response and connect to the internet.
  *
  * At the moment, once the access point is started it cannot be exited. The
@@ -47,10 +48,10 @@ class AccessPoint : public RequestHandler
 
 public:
     /**
-     * Submission handler receives WebServer for input data and returns an
-     * error message on failure.
+     * Submission handler receives the submitted SSID, passkey, email, server
+     * URL and server certificate, and returns an error message on failure.
      */
-    using SubmissionHandler = std::optional<const char *> (*)(String, String, String);
+    using SubmissionHandler = std::optional<const char *> (*)(String, String, String, String, String);
 
     /**
      * Starts the WiFi access point using the fixed credentials.
@@ -74,7 +75,7 @@ private:
     SubmissionHandler onCredentialsReceived;
 
     // There variables are used for handling setup form completion.
-    String ssid, psk, email, finishHtml;
+    String ssid, psk, email, serverUrl, serverCert, finishHtml;
     bool finishGood;
     bool complete;
     bool restarting;
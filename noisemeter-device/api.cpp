@@ -17,49 +17,176 @@
 #include "api.h"
 #include "board.h"
 #include "certs.h"
-#include "url-encode.h"
+#include "packet-codec.h"
 
-#include <HTTPClient.h>
-#include <WiFiClientSecure.h>
+#include <mbedtls/base64.h>
 
+#include <algorithm>
+#include <array>
+#include <cctype>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+
+/**
+ * Reads the body of a response sent with chunked transfer encoding,
+ * skipping over the chunk headers. Usable as an ArduinoJson reader.
+ */
+class ChunkedReader
+{
+public:
+    ChunkedReader(Stream& stream_):
+        stream(stream_) {}
+
+    int read() {
+        char c;
+        return readBytes(&c, 1) == 1 ? static_cast<uint8_t>(c) : -1;
+    }
+
+    size_t readBytes(char *buffer, size_t length) {
+        size_t count = 0;
+
+        while (count < length && nextChunk()) {
+            const auto n = stream.readBytes(buffer + count, std::min<size_t>(length - count, remaining));
+            if (n == 0)
+                break;
+
+            count += n;
+            remaining -= n;
+        }
+
+        return count;
+    }
 
-API::Request::Request(const char endpoint[])
+    /**
+     * Reads and discards the rest of the body, up to and including the
+     * last chunk's trailer, so that a kept-alive connection starts clean.
+     * @return True if the end of the body was reached
+     */
+    bool drain() {
+        std::array<char, 64> buf;
+        while (readBytes(buf.data(), buf.size()) > 0) {}
+        if (!finished)
+            return false;
+
+        // The last chunk is followed by any trailer fields and an empty line.
+        for (;;) {
+            const auto line = stream.readStringUntil('\n');
+            if (line.length() <= 1)
+                return line.length() == 1;
+        }
+    }
+
+private:
+    Stream& stream;
+    /** Bytes left in the current chunk. */
+    size_t remaining = 0;
+    /** Set once the last (empty) chunk is reached. */
+    bool finished = false;
+
+    /** Moves to the next chunk if the current one is used up. */
+    bool nextChunk() {
+        if (remaining > 0)
+            return true;
+        if (finished)
+            return false;
+
+        // Each chunk after the first is preceded by the previous chunk's CRLF.
+        auto line = stream.readStringUntil('\n');
+        if (line.length() <= 1)
+            line = stream.readStringUntil('\n');
+
+        remaining = std::strtoul(line.c_str(), nullptr, 16);
+        finished = remaining == 0;
+        return !finished;
+    }
+};
+
+/**
+ * Reads a response body of known length, so that whatever is left after
+ * parsing can be skipped. Usable as an ArduinoJson reader.
+ */
+class SizedReader
 {
-    url.reserve(128);
-    url.concat(Base);
-    url.concat(endpoint);
-    params.reserve(128);
-}
+public:
+    SizedReader(Stream& stream_, size_t size):
+        stream(stream_), remaining(size) {}
 
-API::Request& API::Request::addParam(const char param[], String value)
+    int read() {
+        char c;
+        return readBytes(&c, 1) == 1 ? static_cast<uint8_t>(c) : -1;
+    }
+
+    size_t readBytes(char *buffer, size_t length) {
+        const auto n = stream.readBytes(buffer, std::min(length, remaining));
+        remaining -= n;
+        return n;
+    }
+
+    /**
+     * Reads and discards the rest of the body.
+     * @return True if the end of the body was reached
+     */
+    bool drain() {
+        std::array<char, 64> buf;
+        while (remaining > 0 && readBytes(buf.data(), buf.size()) > 0) {}
+        return remaining == 0;
+    }
+
+private:
+    Stream& stream;
+    /** Bytes of the body not read yet. */
+    size_t remaining;
+};
+
+/**
+ * Provides the filter that selects the response fields used by the API.
+ * Everything else is skipped while parsing.
+ */
+static const JsonDocument& responseFilter()
 {
-    params.concat('&');
-    params.concat(param);
-    params.concat('=');
-    params.concat(urlEncode(value));
-    return *this;
+    static JsonDocument filter;
+
+    if (filter.isNull()) {
+        filter["result"] = true;
+        filter["message"] = true;
+        filter["results"] = true;
+        filter["acked"] = true;
+        filter["acks"] = true;
+        filter["config"] = true;
+        filter["token"] = true;
+        filter["version"] = true;
+        filter["url"] = true;
+    }
+
+    return filter;
 }
 
-std::optional<JsonDocument> API::sendAuthorizedRequest(const API::Request& req)
+std::optional<JsonDocument> API::sendAuthorizedRequest(const API::Request& req, const char *contentType)
 {
-    WiFiClientSecure client;
-    client.setCACert(rootCertificate());
+    return sendAuthorizedRequest(req.endpoint, req.c_str(), req.length(), contentType);
+}
 
+std::optional<JsonDocument> API::sendAuthorizedRequest(const char *endpoint, const char *payload, std::size_t length, const char *contentType)
+{
 #ifdef API_VERBOSE
     SERIAL.print("[api] Authorized request: ");
-    SERIAL.println(req.url);
-#endif
-
-    HTTPClient https;
-    if (https.begin(client, req.url)) {
-        https.addHeader("Content-Type", "application/x-www-form-urlencoded");
-        https.addHeader("Authorization", String("Token ") + token);
-        return sendHttpPOST(https, req.params.substring(1));
-#ifdef API_VERBOSE
+    SERIAL.println(endpoint);
+    SERIAL.print("[api] payload: ");
+    if (contentType == CborContentType) {
+        SERIAL.print(length);
+        SERIAL.println(" bytes of CBOR");
     } else {
-        SERIAL.println("[api] Failed to https.begin()");
+        SERIAL.println(payload);
+    }
 #endif
+
+    if (beginRequest(endpoint)) {
+        https.addHeader("Content-Type", contentType);
+        https.addHeader("Authorization", authorization);
+        return sendHttpPOST(payload, length);
     }
 
     return {};
@@ -67,90 +194,171 @@ std::optional<JsonDocument> API::sendAuthorizedRequest(const API::Request& req)
 
 std::optional<JsonDocument> API::sendNonauthorizedRequest(const API::Request& req)
 {
-    WiFiClientSecure client;
-    client.setCACert(rootCertificate());
-
 #ifdef API_VERBOSE
     SERIAL.print("[api] Non-authorized request: ");
-    SERIAL.println(req.url);
+    SERIAL.println(req.endpoint);
+    SERIAL.print("[api] payload: ");
+    SERIAL.println(req.c_str());
 #endif
 
-    HTTPClient https;
-    if (https.begin(client, req.url)) {
-        https.addHeader("Content-Type", "application/x-www-form-urlencoded");
-        return sendHttpPOST(https, req.params.substring(1));
-#ifdef API_VERBOSE
-    } else {
-        SERIAL.println("[api] Failed to https.begin()");
-#endif
+    if (beginRequest(req.endpoint)) {
+        https.addHeader("Content-Type", FormContentType);
+        return sendHttpPOST(req.c_str(), req.length());
     }
 
     return {};
 }
 
-std::optional<JsonDocument> API::sendHttpGET(HTTPClient& https)
+bool API::beginRequest(const char *endpoint)
 {
-    const auto code = https.GET();
-    if (code == HTTP_CODE_OK || code == HTTP_CODE_MOVED_PERMANENTLY) {
-        return handleHttpResponse(https);
+    lastStatus = 0;
+    retryAfterSec = 0;
+
+    String url;
+    url.reserve(server.base.length() + std::strlen(endpoint));
+    url.concat(server.base);
+    url.concat(endpoint);
+
+    // HTTPClient keeps the client's connection open when it can be reused.
+    if (https.begin(*connection, url))
+        return true;
+
 #ifdef API_VERBOSE
-    } else {
-        SERIAL.print("[api] HTTP error: ");
-        SERIAL.println(code);
+    SERIAL.println("[api] Failed to https.begin()");
 #endif
+    return false;
+}
+
+/**
+ * Reads a Retry-After header value, given either as a number of seconds or
+ * as an HTTP date (e.g. "Wed, 21 Oct 2015 07:28:00 GMT").
+ * @return Seconds to wait, or zero if the value is missing or invalid
+ */
+static unsigned parseRetryAfter(const String& value)
+{
+    if (value.isEmpty())
+        return 0;
+
+    if (std::isdigit(static_cast<unsigned char>(value[0])))
+        return std::strtoul(value.c_str(), nullptr, 10);
+
+    // System time is kept in UTC, so mktime() reads the date as UTC.
+    std::tm tm {};
+    if (strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S", &tm) == nullptr)
+        return 0;
+
+    const auto when = std::mktime(&tm);
+    const auto now = std::time(nullptr);
+    return when > now ? static_cast<unsigned>(when - now) : 0;
+}
+
+/**
+ * Checks if a request failed because the connection was lost before the
+ * server could respond, as happens when the server closes an idle connection.
+ */
+static bool isConnectionError(int code)
+{
+    return code == HTTPC_ERROR_SEND_HEADER_FAILED ||
+           code == HTTPC_ERROR_SEND_PAYLOAD_FAILED ||
+           code == HTTPC_ERROR_CONNECTION_LOST;
+}
+
+std::optional<JsonDocument> API::sendHttpGET()
+{
+    const auto reused = connection->connected();
+    auto code = https.GET();
+
+    // A reused connection may have been closed by the server: retry once on
+    // a new connection.
+    if (reused && isConnectionError(code))
+        code = https.GET();
+
+    return handleHttpResponse(code);
+}
+
+std::optional<JsonDocument> API::sendHttpPOST(const char *payload, std::size_t length)
+{
+    // HTTPClient does not modify the payload despite taking it as non-const.
+    const auto data = reinterpret_cast<uint8_t *>(const_cast<char *>(payload));
+    const auto reused = connection->connected();
+    auto code = https.POST(data, length);
+    sentBytes += length;
+
+    // A reused connection may have been closed by the server: retry once on
+    // a new connection.
+    if (reused && isConnectionError(code)) {
+        code = https.POST(data, length);
+        sentBytes += length;
     }
 
-    return {};
+    return handleHttpResponse(code);
 }
 
-std::optional<JsonDocument> API::sendHttpPOST(HTTPClient& https, const String& payload)
+std::optional<JsonDocument> API::handleHttpResponse(int code)
 {
-#ifdef API_VERBOSE
-    SERIAL.print("[api] payload: ");
-    SERIAL.println(payload);
-#endif
+    std::optional<JsonDocument> json;
+    lastStatus = code;
 
-    const auto code = https.POST(payload);
     if (code == HTTP_CODE_OK || code == HTTP_CODE_MOVED_PERMANENTLY) {
-        return handleHttpResponse(https);
+        json = responseToJson();
+    } else if (code == HTTP_CODE_TOO_MANY_REQUESTS || code == HTTP_CODE_SERVICE_UNAVAILABLE) {
+        retryAfterSec = parseRetryAfter(https.header("Retry-After"));
 #ifdef API_VERBOSE
+        SERIAL.print("[api] Server busy, retry after ");
+        SERIAL.print(retryAfterSec);
+        SERIAL.println(" s");
     } else {
         SERIAL.print("[api] HTTP error: ");
         SERIAL.println(code);
 #endif
     }
 
-    return {};
-}
+    if (code > 0 && code != HTTP_CODE_OK && code != HTTP_CODE_MOVED_PERMANENTLY)
+        discardBody();
 
-std::optional<JsonDocument> API::handleHttpResponse(HTTPClient& https)
-{
-    const auto response = https.getString();
-    const auto json = responseToJson(response);
+    // Finishes the request, leaving the connection open if the server allows.
     https.end();
 
-    if (json) {
 #ifdef API_VERBOSE
+    if (json) {
         SERIAL.print("[api] ");
         SERIAL.print((String)(*json)["result"]);
         SERIAL.print(": ");
         SERIAL.println((String)(*json)["message"]);
-#endif
-
-        return *json;
-#ifdef API_VERBOSE
-    } else {
+    } else if (code == HTTP_CODE_OK || code == HTTP_CODE_MOVED_PERMANENTLY) {
         SERIAL.print("[api] Invalid JSON!");
-#endif
     }
+#endif
 
-    return {};
+    return json;
 }
 
-std::optional<JsonDocument> API::responseToJson(const String& response)
+std::optional<JsonDocument> API::responseToJson()
 {
     JsonDocument doc;
-    const auto error = deserializeJson(doc, response);
+    const auto filter = DeserializationOption::Filter(responseFilter());
+    DeserializationError error;
+
+    // Parsing stops at the end of the JSON, so the rest of the body (e.g. a
+    // newline and the last chunk) is read too. Left unread, it would be
+    // taken as the start of the next response on a kept-alive connection.
+    bool complete;
+    if (https.header("Transfer-Encoding").equalsIgnoreCase("chunked")) {
+        ChunkedReader reader (https.getStream());
+        error = deserializeJson(doc, reader, filter);
+        complete = reader.drain();
+    } else if (https.getSize() >= 0) {
+        SizedReader reader (https.getStream(), https.getSize());
+        error = deserializeJson(doc, reader, filter);
+        complete = reader.drain();
+    } else {
+        // The body ends when the server closes the connection.
+        error = deserializeJson(doc, https.getStream(), filter);
+        complete = false;
+    }
+
+    if (!complete)
+        connection->stop();
 
     if (error) {
         SERIAL.println(error.f_str());
@@ -160,42 +368,580 @@ std::optional<JsonDocument> API::responseToJson(const String& response)
     }
 }
 
-API::API(UUID id_, String token_):
-    id(id_), token(token_) {}
+void API::discardBody()
+{
+    bool complete;
+    if (https.header("Transfer-Encoding").equalsIgnoreCase("chunked")) {
+        ChunkedReader reader (https.getStream());
+        complete = reader.drain();
+    } else if (https.getSize() >= 0) {
+        SizedReader reader (https.getStream(), https.getSize());
+        complete = reader.drain();
+    } else {
+        complete = false;
+    }
+
+    // A connection left part way through a response cannot be reused.
+    if (!complete)
+        connection->stop();
+}
+
+/**
+ * Converts a UUID string (e.g. "xxxxxxxx-xxxx-...") to its 16-byte binary form.
+ */
+static std::array<uint8_t, 16> uuidToBytes(const char *str)
+{
+    const auto hex = [](char c) {
+        return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    };
+
+    std::array<uint8_t, 16> bytes {};
+    for (auto& b : bytes) {
+        if (*str == '-')
+            ++str;
+        if (str[0] == '\0' || str[1] == '\0')
+            break;
+        b = static_cast<uint8_t>(hex(str[0]) << 4 | hex(str[1]));
+        str += 2;
+    }
+
+    return bytes;
+}
+
+/**
+ * Writes a measurement as a CBOR array: [timestamp, min, max, mean] with the
+ * sequence number as a fifth element if the packet has one.
+ */
+static void writeCborMeasurement(CborWriter& body, const DataPacket& packet)
+{
+    body.startArray(packet.sequence != 0 ? 5 : 4)
+        .putInteger(static_cast<std::time_t>(packet.timestamp))
+        .putUnsigned(encodeDecibels(packet.minimum))
+        .putUnsigned(encodeDecibels(packet.maximum))
+        .putUnsigned(encodeDecibels(packet.average));
+    if (packet.sequence != 0)
+        body.putUnsigned(packet.sequence);
+}
+
+/**
+ * Decodes a PEM certificate to DER.
+ * @return The certificate, or nothing if it is not valid
+ */
+static std::optional<std::vector<uint8_t>> pemToDer(const String& pem)
+{
+    constexpr char Begin[] = "-----BEGIN CERTIFICATE-----";
+    const auto start = pem.indexOf(Begin);
+    const auto end = pem.indexOf("-----END CERTIFICATE-----");
+    if (start < 0 || end < start)
+        return {};
+
+    // Line breaks may be LF or CRLF depending on where the text came from.
+    String base64;
+    base64.reserve(end - start);
+    for (auto i = start + sizeof(Begin) - 1; i < static_cast<unsigned>(end); ++i) {
+        if (!std::isspace(static_cast<unsigned char>(pem[i])))
+            base64 += pem[i];
+    }
+
+    std::vector<uint8_t> der (base64.length() / 4 * 3);
+    std::size_t length = 0;
+    if (mbedtls_base64_decode(der.data(), der.size(), &length,
+            reinterpret_cast<const uint8_t *>(base64.c_str()), base64.length()) != 0)
+        return {};
+    der.resize(length);
+
+    // Check that it parses, as TLSClient will only report a failure later.
+    mbedtls_x509_crt crt;
+    mbedtls_x509_crt_init(&crt);
+    const auto ok = mbedtls_x509_crt_parse_der(&crt, der.data(), der.size()) == 0;
+    mbedtls_x509_crt_free(&crt);
+
+    if (!ok)
+        return {};
+    return der;
+}
+
+std::optional<API::Server> API::parseServer(String baseUrl, const String& certificate)
+{
+    Server srv;
+    unsigned start;
+
+    if (baseUrl.startsWith("https://")) {
+        srv.secure = true;
+        srv.port = 443;
+        start = 8;
+    } else if (baseUrl.startsWith("http://")) {
+        srv.secure = false;
+        srv.port = 80;
+        start = 7;
+    } else {
+        return {};
+    }
+
+    // Endpoints are appended to the base URL.
+    if (!baseUrl.endsWith("/"))
+        baseUrl += '/';
+
+    srv.host = baseUrl.substring(start, baseUrl.indexOf('/', start));
+    if (const auto colon = srv.host.indexOf(':'); colon >= 0) {
+        char *end;
+        const auto port = std::strtoul(srv.host.c_str() + colon + 1, &end, 10);
+        if (*end != '\0' || port == 0 || port > 0xFFFF)
+            return {};
+
+        srv.port = static_cast<uint16_t>(port);
+        srv.host.remove(colon);
+    }
+
+    if (srv.host.isEmpty())
+        return {};
+
+    // Plain HTTP has nothing to verify, so a certificate is ignored.
+    if (srv.secure && !certificate.isEmpty()) {
+        auto der = pemToDer(certificate);
+        if (!der)
+            return {};
+        srv.anchor = std::move(*der);
+    }
+
+    srv.base = std::move(baseUrl);
+    return srv;
+}
+
+bool API::isValidServer(String baseUrl, String certificate)
+{
+    return parseServer(baseUrl, certificate).has_value();
+}
+
+API::API(UUID id_, String token_, String baseUrl, String certificate):
+    id(id_), idBytes(uuidToBytes(id.toCharArray())),
+    authorization(String("Token ") + token_)
+#ifdef API_MQTT
+    , mqtt(mqttNet)
+#endif
+{
+#ifdef API_CBOR
+    useCbor = true;
+#else
+    useCbor = false;
+#endif
+
+    auto srv = baseUrl.isEmpty() ? std::nullopt : parseServer(baseUrl, certificate);
+    if (!srv) {
+        if (!baseUrl.isEmpty()) {
+            SERIAL.print("[api] Unusable server settings, using ");
+            SERIAL.println(DefaultBase);
+        }
+
+        srv = parseServer(DefaultBase, {});
+    }
+
+    server = std::move(*srv);
+    connection = server.secure ? &client : &plainClient;
+
+#if defined(API_MQTT) && !defined(API_MQTT_PLAINTEXT)
+    // The broker is always the public one, even when uploading through a gateway.
+    mqttNet.setCACert(cert_ISRG_Root_X1_der, sizeof(cert_ISRG_Root_X1_der));
+#endif
+
+    if (server.anchor.empty())
+        client.setCACert(cert_ISRG_Root_X1_der, sizeof(cert_ISRG_Root_X1_der));
+    else
+        client.setCACert(server.anchor.data(), server.anchor.size());
+    https.setReuse(true);
+
+    // Needed to parse response bodies as they are received, and to back off
+    // when the server is busy.
+    static const char *headers[] = { "Transfer-Encoding", "Retry-After" };
+    https.collectHeaders(headers, std::size(headers));
+
+#ifdef API_MQTT
+    mqttTopic = String("devices/") + id.toCharArray() + "/measurements";
+#endif
+}
+
+void API::disconnect()
+{
+    https.end();
+    connection->stop();
+}
+
+void API::disconnectAll()
+{
+    disconnect();
+#ifdef API_MQTT
+    mqtt.disconnect();
+#endif
+}
+
+void API::service()
+{
+#ifdef API_MQTT
+    mqtt.service();
+#endif
+}
+
+bool API::prewarm()
+{
+#ifdef API_MQTT
+    return mqttConnect();
+#else
+    if (connection->connected())
+        return true;
+
+    const auto ok = connection->connect(server.host.c_str(), server.port) != 0;
+
+#ifdef API_VERBOSE
+    const auto times = timings().connect;
+    SERIAL.print("[api] Prewarm ");
+    SERIAL.print(ok ? "connected" : "failed");
+    SERIAL.print(": resolve ");
+    SERIAL.print(times.resolveMs);
+    SERIAL.print(" ms, connect ");
+    SERIAL.print(times.tcpMs);
+    SERIAL.print(" ms, handshake ");
+    SERIAL.print(times.handshakeMs);
+    SERIAL.println(" ms");
+#endif
+
+    return ok;
+#endif // API_MQTT
+}
+
+API::Timings API::timings() const noexcept
+{
+    Timings t;
+#ifdef API_MQTT
+#ifndef API_MQTT_PLAINTEXT
+    t.connect = mqttNet.connectTimes();
+#endif
+#else
+    if (server.secure)
+        t.connect = client.connectTimes();
+#endif
+    t.requestMs = requestMs;
+    return t;
+}
 
 bool API::sendMeasurement(const DataPacket& packet)
 {
-    const auto request = Request("measurement")
-        .addParam("device",    id)
-        .addParam("timestamp", packet.timestamp)
-        .addParam("min",       String(std::lround(packet.minimum)))
-        .addParam("max",       String(std::lround(packet.maximum)))
-        .addParam("mean",      String(std::lround(packet.average)));
+#ifndef API_MQTT
+    if (!useCbor)
+        return postMeasurementForm(packet).value_or(false);
+#endif
+
+    const auto results = sendMeasurements(&packet, 1);
+    return !results.empty() && results.front();
+}
+
+bool API::sendMeasurementWithDiagnostics(const DataPacket& packet, const char *version, Timestamp boottime)
+{
+#ifdef API_MQTT
+    return mqttPublishDiagnostics(version, boottime) && sendMeasurement(packet);
+#else
+    Request request ("measurement", buffer);
+    request.addParam("device",    id.toCharArray())
+           .addParam("timestamp", packet.timestamp)
+           .addParam("min",       std::lround(packet.minimum))
+           .addParam("max",       std::lround(packet.maximum))
+           .addParam("mean",      std::lround(packet.average))
+           .addParam("version",   version)
+           .addParam("boottime",  boottime);
+    if (packet.sequence != 0)
+        request.addParam("seq",   static_cast<long>(packet.sequence));
 
     const auto resp = sendAuthorizedRequest(request);
     return resp && (*resp)["result"] == "ok";
+#endif
 }
 
-bool API::sendMeasurementWithDiagnostics(const DataPacket& packet, String version, String boottime)
+std::optional<bool> API::postMeasurementForm(const DataPacket& packet)
 {
-    const auto request = Request("measurement")
-        .addParam("device",    id)
-        .addParam("timestamp", packet.timestamp)
-        .addParam("min",       String(std::lround(packet.minimum)))
-        .addParam("max",       String(std::lround(packet.maximum)))
-        .addParam("mean",      String(std::lround(packet.average)))
-        .addParam("version",   version)
-        .addParam("boottime",  boottime);
+    Request request ("measurement", buffer);
+    request.addParam("device",    id.toCharArray())
+           .addParam("timestamp", packet.timestamp)
+           .addParam("min",       std::lround(packet.minimum))
+           .addParam("max",       std::lround(packet.maximum))
+           .addParam("mean",      std::lround(packet.average));
+    if (packet.sequence != 0)
+        request.addParam("seq",   static_cast<long>(packet.sequence));
 
     const auto resp = sendAuthorizedRequest(request);
-    return resp && (*resp)["result"] == "ok";
+    if (!resp)
+        return {};
+
+    return (*resp)["result"] == "ok";
+}
+
+std::optional<JsonDocument> API::postMeasurementsJson(const DataPacket *packets, std::size_t count, std::size_t& sent)
+{
+    Request request ("measurements", buffer);
+    request.put("{\"device\":\"").put(id.toCharArray()).put("\",\"measurements\":[");
+
+    // Timestamps and numbers need no JSON escaping, so the body is written
+    // directly. Packets that do not fit are left for the next request.
+    for (sent = 0; sent < count; ++sent) {
+        const auto& packet = packets[sent];
+        const auto mark = request.length();
+
+        request.put(sent > 0 ? ",{\"timestamp\":\"" : "{\"timestamp\":\"")
+               .putTimestamp(packet.timestamp)
+               .put("\",\"min\":").putInteger(std::lround(packet.minimum))
+               .put(",\"max\":").putInteger(std::lround(packet.maximum))
+               .put(",\"mean\":").putInteger(std::lround(packet.average));
+        if (packet.sequence != 0)
+            request.put(",\"seq\":").putInteger(static_cast<long>(packet.sequence));
+        request.put('}');
+
+        // Keep room for closing the body.
+        if (!request.ok() || request.length() + 2 >= BufferSize) {
+            request.truncate(mark);
+            break;
+        }
+    }
+
+    request.put("]}");
+    if (sent == 0 || !request.ok())
+        return {};
+
+    return sendAuthorizedRequest(request, JsonContentType);
 }
 
+std::optional<JsonDocument> API::postMeasurementsCbor(const DataPacket *packets, std::size_t count, std::size_t& sent)
+{
+    // Room for the map, its keys and the device ID, and for one measurement:
+    // an array header, a timestamp and three levels of up to 0xFFF.
+    constexpr std::size_t HeaderSize = 64;
+    constexpr std::size_t PacketSize = 1 + CBOR_MAX_HEAD_SIZE + 3 * 3 + 5;
+
+    sent = std::min(count, (BufferSize - HeaderSize) / PacketSize);
+    if (sent == 0)
+        return {};
+
+    CborWriter body (reinterpret_cast<uint8_t *>(buffer.data()), buffer.size());
+    body.startMap(2)
+        .putText("device").putBytes(idBytes.data(), idBytes.size())
+        .putText("measurements").startArray(sent);
+
+    for (auto i = 0u; i < sent; ++i)
+        writeCborMeasurement(body, packets[i]);
+
+    if (!body.ok())
+        return {};
+
+    return sendAuthorizedRequest("measurements", reinterpret_cast<const char *>(body.data()),
+        body.length(), CborContentType);
+}
+
+std::vector<bool> API::sendMeasurements(const DataPacket *packets, std::size_t count)
+{
+    const auto start = millis();
+    ack = {};
+
+#ifdef API_MQTT
+    const auto results = mqttPublishMeasurements(packets, count);
+#else
+    const auto results = postMeasurements(packets, count);
+#endif
+
+    requestMs = millis() - start;
+    ++uploads.requests;
+    uploads.packets += results.size();
+    uploads.ms += requestMs;
+    return results;
+}
+
+std::vector<bool> API::postMeasurements(const DataPacket *packets, std::size_t count)
+{
+    std::size_t sent = 0;
+    std::optional<JsonDocument> resp;
+    serverConfig.clear();
+
+    if (singleUploads > 0) {
+        // One request per packet; stops at the first request that fails.
+        --singleUploads;
+        std::vector<bool> results;
+        for (auto i = 0u; i < count; ++i) {
+            const auto accepted = postMeasurementForm(packets[i]);
+            if (!accepted)
+                break;
+            results.push_back(*accepted);
+        }
+        return results;
+    }
+
+    if (useCbor) {
+        resp = postMeasurementsCbor(packets, count, sent);
+
+        // The server does not understand CBOR: use JSON from now on. Other
+        // errors, e.g. a bad request, do not say anything about the format.
+        if (!resp && lastStatus == HTTP_CODE_UNSUPPORTED_MEDIA_TYPE) {
+#ifdef API_VERBOSE
+            SERIAL.println("[api] CBOR not accepted, falling back to JSON.");
+#endif
+            useCbor = false;
+        }
+    }
+
+    if (!useCbor)
+        resp = postMeasurementsJson(packets, count, sent);
+
+    // The server has no batch endpoint: send packets one at a time for a
+    // while. This may be passing, e.g. a gateway that is still starting up,
+    // so batches are tried again later.
+    if (!resp && (lastStatus == HTTP_CODE_NOT_FOUND || lastStatus == HTTP_CODE_METHOD_NOT_ALLOWED)) {
+#ifdef API_VERBOSE
+        SERIAL.println("[api] Batches not accepted, sending packets one at a time.");
+#endif
+        singleUploads = BatchRetryUploads;
+        return postMeasurements(packets, count);
+    }
+
+    if (!resp || (*resp)["result"] != "ok")
+        return {};
+
+    serverConfig.set((*resp)["config"]);
+
+    ack.cumulative = (*resp)["acked"] | 0u;
+    ack.ranges.clear();
+    for (const auto range : (*resp)["acks"].as<JsonArrayConst>())
+        ack.ranges.emplace_back(range[0] | 0u, range[1] | 0u);
+
+    std::vector<bool> results;
+    const auto list = (*resp)["results"].as<JsonArrayConst>();
+
+    if (list.isNull() && (ack.cumulative != 0 || !ack.ranges.empty())) {
+        // Acknowledged by sequence number: the leading acknowledged packets
+        // are done, the rest need to be sent again.
+        while (results.size() < sent && ack.covers(packets[results.size()].sequence))
+            results.push_back(true);
+    } else if (list.isNull()) {
+        // No per-packet details: the whole batch was accepted.
+        results.assign(sent, true);
+    } else {
+        results.reserve(std::min<std::size_t>(list.size(), sent));
+        for (const auto r : list) {
+            if (results.size() >= sent)
+                break;
+            results.push_back(r == "ok");
+        }
+    }
+
+    return results;
+}
+
+bool API::applyConfig(DeviceConfig& config) const
+{
+    const auto before = config;
+
+    for (const auto setting : serverConfig.as<JsonObjectConst>()) {
+        const auto value = setting.value();
+
+        if (!value.is<long>() || !config.set(setting.key().c_str(), value.as<long>())) {
+            SERIAL.print("[api] Ignored setting from server: ");
+            SERIAL.println(setting.key().c_str());
+        }
+    }
+
+    return config != before;
+}
+
+#ifdef API_MQTT
+bool API::mqttConnect()
+{
+    if (mqtt.connected())
+        return true;
+
+    // The device ID names the persistent session and the user; the API token
+    // (without its "Token " prefix) is the password.
+    const auto ok = mqtt.connect(API_MQTT_HOST, API_MQTT_PORT, id.toCharArray(),
+        id.toCharArray(), authorization.c_str() + 6);
+
+#ifdef API_VERBOSE
+    SERIAL.print("[api] MQTT connect: ");
+    SERIAL.println(ok ? (mqtt.sessionPresent() ? "resumed session" : "new session") : "failed");
+#endif
+
+    return ok;
+}
+
+std::vector<bool> API::mqttPublishMeasurements(const DataPacket *packets, std::size_t count)
+{
+    if (!mqttConnect())
+        return {};
+
+    std::array<uint16_t, MqttWindow> ids;
+    std::size_t sent = 0;
+
+    // Packets stay in the caller's queue until acknowledged, so the queue
+    // itself is the in-flight window.
+    for (; sent < std::min<std::size_t>(count, MqttWindow); ++sent) {
+        const auto& packet = packets[sent];
+        std::array<uint8_t, 32> payload;
+        CborWriter body (payload.data(), payload.size());
+        writeCborMeasurement(body, packet);
+
+        // Numbered packets keep their identifier when resent.
+        const auto packetId = packet.sequence != 0 ?
+            static_cast<uint16_t>(packet.sequence % 0xFFFF + 1) : mqttNextId;
+        if (packet.sequence == 0)
+            mqttNextId = mqttNextId % 0xFFFF + 1;
+
+        const auto end = mqttUnacked.cbegin() + mqttUnackedCount;
+        const auto dup = std::find(mqttUnacked.cbegin(), end, packetId) != end;
+
+        if (!mqtt.publish(mqttTopic.c_str(), body.data(), body.length(), packetId, dup))
+            break;
+
+        ids[sent] = packetId;
+        sentBytes += body.length();
+    }
+
+    const auto acked = mqtt.awaitAcks(ids.data(), sent, MqttAckTimeoutMs);
+
+    // Whatever is left unacknowledged is resent, flagged as a duplicate, over
+    // a new connection.
+    mqttUnackedCount = std::copy(ids.cbegin() + acked, ids.cbegin() + sent,
+        mqttUnacked.begin()) - mqttUnacked.begin();
+    if (acked < sent)
+        mqtt.disconnect();
+
+#ifdef API_VERBOSE
+    SERIAL.print("[api] MQTT published ");
+    SERIAL.print(sent);
+    SERIAL.print(", acknowledged ");
+    SERIAL.println(acked);
+#endif
+
+    return std::vector<bool>(acked, true);
+}
+
+bool API::mqttPublishDiagnostics(const char *version, Timestamp boottime)
+{
+    if (!mqttConnect())
+        return false;
+
+    std::array<uint8_t, 64> payload;
+    CborWriter body (payload.data(), payload.size());
+    body.startMap(2)
+        .putText("version").putText(version)
+        .putText("boottime").putInteger(static_cast<std::time_t>(boottime));
+
+    const auto topic = String("devices/") + id.toCharArray() + "/diagnostics";
+    const uint16_t packetId = mqttNextId;
+    mqttNextId = mqttNextId % 0xFFFF + 1;
+
+    return body.ok() &&
+        mqtt.publish(topic.c_str(), body.data(), body.length(), packetId, false) &&
+        mqtt.awaitAcks(&packetId, 1, MqttAckTimeoutMs) == 1;
+}
+#endif // API_MQTT
+
 std::optional<String> API::sendRegister(String email)
 {
-    const auto request = Request("device/register")
-        .addParam("device", id)
-        .addParam("email", email);
+    Request request ("device/register", buffer);
+    request.addParam("device", id.toCharArray())
+           .addParam("email",  email.c_str());
 
     const auto resp = sendNonauthorizedRequest(request);
     if (resp && (*resp)["result"] == "ok")
@@ -206,21 +952,15 @@ std::optional<String> API::sendRegister(String email)
 
 std::optional<API::LatestSoftware> API::getLatestSoftware()
 {
-    const auto request = Request("software/latest");
-
-    WiFiClientSecure client;
-    client.setCACert(rootCertificate());
-
-    String endpoint = request.url + '?' + request.params.substring(1);
+    const auto endpoint = "software/latest";
 
 #ifdef API_VERBOSE
     SERIAL.print("[api] Non-authorized request: ");
     SERIAL.println(endpoint);
 #endif
 
-    HTTPClient https;
-    if (https.begin(client, endpoint)) {
-        const auto resp = sendHttpGET(https);
+    if (beginRequest(endpoint)) {
+        const auto resp = sendHttpGET();
 
         if (resp && (*resp)["result"] == "ok") {
             LatestSoftware ls = {
@@ -230,10 +970,6 @@ std::optional<API::LatestSoftware> API::getLatestSoftware()
 
             return ls;
         }
-#ifdef API_VERBOSE
-    } else {
-        SERIAL.println("[api] Failed to https.begin()");
-#endif
     }
 
     return {};
@@ -19,44 +19,101 @@
 #ifndef API_H
 #define API_H
 
+#include "cbor-writer.h"
 #include "data-packet.h"
+#include "device-config.h"
+#include "request-writer.h"
+#include "tls-client.h"
 #include "UUID/UUID.h"
 
+#ifdef API_MQTT
+#include "mqtt-client.h"
+
+#ifndef API_MQTT_HOST
+#error "API_MQTT requires the broker's host name in API_MQTT_HOST"
+#endif
+#ifndef API_MQTT_PORT
+#ifdef API_MQTT_PLAINTEXT
+#define API_MQTT_PORT 1883
+#else
+#define API_MQTT_PORT 8883
+#endif
+#endif
+#endif // API_MQTT
+
 #include <ArduinoJson.h>
+#include <HTTPClient.h>
 #include <WString.h>
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <optional>
-
-class HTTPClient;
+#include <utility>
+#include <vector>
 
 /**
  * @brief Provides interface for API calls.
+ *
+ * Requests go to the public API unless another base URL is given, e.g. of a
+ * gateway on the local network that forwards to the public API. An https://
+ * gateway is verified against its own root certificate if one is given; an
+ * http:// gateway is meant for trusted networks only. A base URL or
+ * certificate that cannot be used falls back to the public API.
+ *
+ * A single connection to the server is kept open between requests (HTTP
+ * keep-alive), so a series of calls only pays for one TLS handshake. The
+ * connection is reopened as needed; call disconnect() once finished to free
+ * the memory it holds. New connections resume the previous TLS session when
+ * the server allows it. prewarm() opens the connection ahead of time, so
+ * that a time-critical request only waits for the server's response.
+ *
+ * When built with API_CBOR, measurements are sent as CBOR (see
+ * sendMeasurements()). If the server does not accept CBOR, the API falls
+ * back to JSON and form encoding for the rest of its lifetime.
+ *
+ * When built with API_MQTT, measurements are instead published to the MQTT
+ * broker at API_MQTT_HOST with QoS 1, one CBOR-encoded measurement per
+ * message, over a connection that stays open between uploads. Other calls
+ * still use HTTPS. API_MQTT_PLAINTEXT connects without TLS, for testing
+ * against a local broker.
  */
 class API
 {
-    /** API host / base URL. */
-    constexpr static const char Base[] = "https://api.tracket.info/v1/";
+    /** Base URL of the public API. */
+    constexpr static const char DefaultBase[] = "https://api.tracket.info/v1/";
+    /** Content type of requests made with URL parameters. */
+    constexpr static const char FormContentType[] = "application/x-www-form-urlencoded";
+    /** Content type of requests made with a JSON body. */
+    constexpr static const char JsonContentType[] = "application/json";
+    /** Content type of requests made with a CBOR body. */
+    constexpr static const char CborContentType[] = "application/cbor";
 
-    /** String builder to create URLs for API endpoints and requests. */
-    struct Request {
-        /**
-         * Initializes a new request with zero parameters.
-         * @param endpoint Endpoint for the API request.
-         */
-        Request(const char endpoint[]);
+    /** Size of the buffer that request bodies are built in. */
+    constexpr static std::size_t BufferSize = 4096;
+    /** Number of sendMeasurements() calls that send one packet per request
+     * before the "measurements" endpoint is tried again after it was not found. */
+    constexpr static unsigned BatchRetryUploads = 12;
 
+#ifdef API_MQTT
+    /** Most measurements published before waiting for their acknowledgement. */
+    constexpr static unsigned MqttWindow = 16;
+    /** Milliseconds to wait for published measurements to be acknowledged. */
+    constexpr static uint32_t MqttAckTimeoutMs = 10000;
+#endif
+
+    /** Builds the body of a request to an API endpoint without allocating. */
+    struct Request : public RequestWriter {
         /**
-         * Adds a parameter to the given request.
-         * Resulting URL e.g. "https://host/endpoint?parm1=123&parm2=456&"
-         * @param param Name of parameter to add.
-         * @param value Value of the added parameter.
-         * @return *this
+         * Initializes a new request with zero parameters.
+         * @param endpoint_ Endpoint for the API request.
+         * @param buffer Buffer to build the request body in.
          */
-        Request& addParam(const char param[], String value);
+        Request(const char endpoint_[], std::array<char, BufferSize>& buffer):
+            RequestWriter(buffer.data(), buffer.size()), endpoint(endpoint_) {}
 
-        /** Stores the resulting request URL. */
-        String url;
-        String params;
+        /** Endpoint for the API request, relative to the base URL. */
+        const char *endpoint;
     };
 
 public:
@@ -68,12 +125,87 @@ public:
         String url;
     };
 
+    /** Counters for comparing the cost of measurement uploads. */
+    struct UploadStats {
+        /** Number of sendMeasurements() calls. */
+        unsigned requests = 0;
+        /** Number of packets the server handled. */
+        unsigned packets = 0;
+        /** Total milliseconds spent in sendMeasurements(). */
+        uint32_t ms = 0;
+    };
+
+    /** Milliseconds spent in each phase of uploading measurements. */
+    struct Timings {
+        /** Phases of opening the last connection used for measurements. */
+        TLSClient::ConnectTimes connect;
+        /** The last sendMeasurements() call, including connecting if needed. */
+        uint32_t requestMs = 0;
+    };
+
+    /** Sequence numbers of packets that the server confirmed it has stored. */
+    struct Acknowledgement {
+        /** Every sequence number up to and including this one; zero if none. */
+        uint32_t cumulative = 0;
+        /** Further inclusive ranges of sequence numbers. */
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+        /**
+         * Checks if the given sequence number was acknowledged.
+         * Packets without a sequence number (zero) never are.
+         */
+        bool covers(uint32_t sequence) const noexcept {
+            if (sequence == 0)
+                return false;
+            if (sequence <= cumulative)
+                return true;
+            for (const auto& [first, last] : ranges) {
+                if (sequence >= first && sequence <= last)
+                    return true;
+            }
+            return false;
+        }
+    };
+
     /**
      * Creates a new API interface for the given device (ID).
      * @param id_ Device UUID
      * @param token_ API token (required for authorized API calls)
+     * @param baseUrl Base URL of the API, e.g. of a local gateway; empty for
+     *        the public API
+     * @param certificate PEM root certificate to verify an https:// baseUrl
+     *        against; empty to use the public API's
+     */
+    API(UUID id_, String token_ = {}, String baseUrl = {}, String certificate = {});
+
+    API(const API&) = delete;
+    API& operator=(const API&) = delete;
+
+    /**
+     * Closes the HTTPS connection to the server if one is open.
+     * The next request will open a new connection. A connection to the MQTT
+     * broker is left open.
      */
-    API(UUID id_, String token_ = {});
+    void disconnect();
+
+    /**
+     * Closes all connections, including the one to the MQTT broker.
+     */
+    void disconnectAll();
+
+    /**
+     * Keeps long-lived connections alive between uploads; call regularly.
+     */
+    void service();
+
+    /**
+     * Opens the connection that measurements are sent over, if it is not
+     * open, including the DNS lookup and TLS handshake.
+     * Calling this shortly before sendMeasurements() takes the connection
+     * setup out of the request's time.
+     * @return True if the connection is open
+     */
+    bool prewarm();
 
     /**
      * Sends a DataPacket (dB measurement) to the server.
@@ -91,7 +223,35 @@ public:
      * @param boottime Timestamp of last connection to the internet.
      * @return True on success
      */
-    bool sendMeasurementWithDiagnostics(const DataPacket& packet, String version, String boottime);
+    bool sendMeasurementWithDiagnostics(const DataPacket& packet, const char *version, Timestamp boottime);
+
+    /**
+     * Sends multiple DataPackets to the server within a single request.
+     * The server reports whether it accepted each packet; packets it rejects
+     * (e.g. as malformed or duplicate) would be rejected again if resent.
+     * This request requires authentication.
+     *
+     * In CBOR mode the body is a map of "device" to the 16-byte binary UUID
+     * and "measurements" to an array of [timestamp, min, max, mean] arrays,
+     * where the timestamp is in seconds since the epoch and levels are
+     * unsigned 0.1 dB fixed-point values. Packets with a sequence number add
+     * it as a fifth element.
+     *
+     * The server may acknowledge packets by sequence number instead of, or
+     * as well as, per packet: "acked" confirms every number up to the given
+     * one, and "acks" lists [first, last] ranges. Resent packets are simply
+     * acknowledged again. See acknowledged().
+     *
+     * Servers without the "measurements" endpoint (answering 404 or 405)
+     * are sent each packet to the "measurement" form endpoint instead.
+     * @param packets Array of packets to be sent, oldest first.
+     * @param count Number of packets in the array.
+     * @return Per-packet results (true if accepted) on success, in the order
+     *         sent; the list may be shorter than count if not all packets fit
+     *         in one request or the server stopped early, or if it only
+     *         acknowledged the leading packets. Empty if the request failed.
+     */
+    std::vector<bool> sendMeasurements(const DataPacket *packets, std::size_t count);
 
     /**
      * Attempts to register the device with the given email.
@@ -106,27 +266,194 @@ public:
      */
     std::optional<LatestSoftware> getLatestSoftware();
 
+    /**
+     * Provides the sequence numbers acknowledged by the last successful
+     * sendMeasurements() call. These may include packets that were not part
+     * of the request, e.g. ones whose earlier response was lost.
+     */
+    const Acknowledgement& acknowledged() const noexcept {
+        return ack;
+    }
+
+    /**
+     * Applies the settings that the server sent with the last successful
+     * sendMeasurements() call, if any. Unknown settings and values outside
+     * of their bounds are ignored (see DeviceConfig).
+     * @param config Settings to update
+     * @return True if any setting changed
+     */
+    bool applyConfig(DeviceConfig& config) const;
+
+    /**
+     * Provides the delay that the server asked for before further requests,
+     * given by the Retry-After header of a 429 or 503 response.
+     * @return Seconds to wait, or zero if the last request set no delay
+     */
+    unsigned retryAfter() const noexcept {
+        return retryAfterSec;
+    }
+
+    /**
+     * Provides the measurement upload counters.
+     */
+    const UploadStats& uploadStats() const noexcept {
+        return uploads;
+    }
+
+    /**
+     * Provides the time taken by each phase of the last measurement upload.
+     */
+    Timings timings() const noexcept;
+
+    /**
+     * Gets the total size of request bodies sent so far, including retries.
+     */
+    std::size_t bytesSent() const noexcept {
+        return sentBytes;
+    }
+
+    /**
+     * Provides the base URL that requests are made to.
+     */
+    const String& baseUrl() const noexcept {
+        return server.base;
+    }
+
+    /**
+     * Checks if the given server settings can be used, rather than falling
+     * back to the public API.
+     * @param baseUrl Base URL of the form "http[s]://host[:port]/path/"
+     * @param certificate PEM root certificate for an https:// baseUrl, or empty
+     * @return True if the settings are usable
+     */
+    static bool isValidServer(String baseUrl, String certificate);
+
     /**
      * Provides the server's root certificate for non-API HTTPS requests.
      */
     static const char *rootCertificate();
 
 private:
+    /** Where requests are sent. */
+    struct Server {
+        /** Base URL, ending in '/'. */
+        String base;
+        /** Host name, for connecting ahead of a request. */
+        String host;
+        /** Port number. */
+        uint16_t port;
+        /** True for HTTPS. */
+        bool secure;
+        /** DER root certificate to verify the server against; empty for the public API's. */
+        std::vector<uint8_t> anchor;
+    };
+
+    /**
+     * Reads server settings.
+     * @return The server, or nothing if the settings cannot be used
+     */
+    static std::optional<Server> parseServer(String baseUrl, const String& certificate);
+
     /** Device's UUID. */
     UUID id;
-    /** Device's API token for authorized requests. */
-    String token;
+    /** Device's UUID in binary form. */
+    std::array<uint8_t, 16> idBytes;
+    /** Authorization header value for authorized requests. */
+    String authorization;
+    /** Buffer that request bodies are built in. */
+    std::array<char, BufferSize> buffer;
+    /** Where requests are sent. */
+    Server server;
+    /** Secure connection to the server, kept open between requests. */
+    TLSClient client;
+    /** Plain connection to the server, used for http:// base URLs. */
+    WiFiClient plainClient;
+    /** The connection in use: client or plainClient. */
+    WiFiClient *connection;
+    /** HTTP client that makes requests over the connection. */
+    HTTPClient https;
+    /** HTTP status code (or HTTPClient error) of the last request. */
+    int lastStatus = 0;
+    /** Seconds the server asked to wait after the last request. */
+    unsigned retryAfterSec = 0;
+    /** Total size of request bodies sent. */
+    std::size_t sentBytes = 0;
+    /** Acknowledgement from the last measurements response. */
+    Acknowledgement ack;
+    /** "config" object from the last measurements response, if any. */
+    JsonDocument serverConfig;
+    /** Measurement upload counters. */
+    UploadStats uploads;
+    /** Milliseconds taken by the last sendMeasurements() call. */
+    uint32_t requestMs = 0;
+
+#ifdef API_MQTT
+#ifdef API_MQTT_PLAINTEXT
+    /** Connection to the MQTT broker. */
+    WiFiClient mqttNet;
+#else
+    /** Secure connection to the MQTT broker. */
+    TLSClient mqttNet;
+#endif
+    /** MQTT session with the broker, kept open between uploads. */
+    MqttClient mqtt;
+    /** Topic that measurements are published to. */
+    String mqttTopic;
+    /** Packet identifiers published but not acknowledged, to flag resends. */
+    std::array<uint16_t, MqttWindow> mqttUnacked;
+    /** Number of entries in mqttUnacked. */
+    unsigned mqttUnackedCount = 0;
+    /** Packet identifier for the next packet without a sequence number. */
+    uint16_t mqttNextId = 1;
 
-    /** Converts response string into JSON. */
-    std::optional<JsonDocument> responseToJson(const String& response);
+    /** Connects to the MQTT broker if not connected. */
+    bool mqttConnect();
+    /** Publishes a window of packets and waits for their acknowledgement. */
+    std::vector<bool> mqttPublishMeasurements(const DataPacket *packets, std::size_t count);
+    /** Publishes diagnostics for the current boot. */
+    bool mqttPublishDiagnostics(const char *version, Timestamp boottime);
+#endif
+    /** True while measurements are sent as CBOR. */
+    bool useCbor;
+    /** sendMeasurements() calls left to send one packet per request before
+     * batches are tried again; zero while the server accepts batches. */
+    unsigned singleUploads = 0;
+
+    /** Parses the JSON response body directly from the connection. */
+    std::optional<JsonDocument> responseToJson();
+    /** Reads and discards the response body, e.g. of an error response. */
+    void discardBody();
     /** Attempts the given request and returns the JSON response on success. */
-    std::optional<JsonDocument> sendAuthorizedRequest(const Request& req);
+    std::optional<JsonDocument> sendAuthorizedRequest(const Request& req, const char *contentType = FormContentType);
+    /** Attempts a request with the given body and returns the JSON response on success. */
+    std::optional<JsonDocument> sendAuthorizedRequest(const char *endpoint, const char *payload, std::size_t length, const char *contentType);
     /** Attempts the given request and returns the JSON response on success. */
     std::optional<JsonDocument> sendNonauthorizedRequest(const Request& req);
 
-    std::optional<JsonDocument> sendHttpGET(HTTPClient& https);
-    std::optional<JsonDocument> sendHttpPOST(HTTPClient& https, const String& payload);
-    std::optional<JsonDocument> handleHttpResponse(HTTPClient& https);
+    /**
+     * Sends as many of the given packets as fit in one JSON request.
+     * @param sent Set to the number of packets sent
+     */
+    std::optional<JsonDocument> postMeasurementsJson(const DataPacket *packets, std::size_t count, std::size_t& sent);
+    /**
+     * Sends as many of the given packets as fit in one CBOR request.
+     * @param sent Set to the number of packets sent
+     */
+    std::optional<JsonDocument> postMeasurementsCbor(const DataPacket *packets, std::size_t count, std::size_t& sent);
+    /**
+     * Sends one packet to the "measurement" form endpoint.
+     * @return True if accepted, false if rejected, or nothing if the request failed
+     */
+    std::optional<bool> postMeasurementForm(const DataPacket& packet);
+    /** Sends measurements over HTTPS; see sendMeasurements(). */
+    std::vector<bool> postMeasurements(const DataPacket *packets, std::size_t count);
+
+    /** Prepares a request to the given endpoint, reusing an open connection. */
+    bool beginRequest(const char *endpoint);
+
+    std::optional<JsonDocument> sendHttpGET();
+    std::optional<JsonDocument> sendHttpPOST(const char *payload, std::size_t length);
+    std::optional<JsonDocument> handleHttpResponse(int code);
 };
 
 #endif // API_H
@@ -0,0 +1,161 @@
+/// @file
+/// @brief Allocation-free building of CBOR (RFC 8949) request bodies
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef CBOR_WRITER_H
+#define CBOR_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+
+/** Largest number of bytes a single CBOR integer or item header occupies. */
+constexpr unsigned CBOR_MAX_HEAD_SIZE = 9;
+
+/**
+ * @brief Builds a CBOR-encoded body in a fixed, caller-provided buffer.
+ *
+ * Only the definite-length types needed by the API are supported. As with
+ * RequestWriter, if the buffer runs out of room further writes are dropped
+ * and ok() returns false.
+ */
+class CborWriter
+{
+public:
+    /**
+     * Prepares to write into the given buffer.
+     * @param buffer_ Buffer to write to
+     * @param size_ Size of the buffer in bytes
+     */
+    CborWriter(uint8_t *buffer_, std::size_t size_) noexcept:
+        buffer(buffer_), size(size_) {}
+
+    /**
+     * Discards everything written after the given length, e.g. to undo a
+     * partial write that did not fit.
+     */
+    void truncate(std::size_t length) noexcept {
+        if (length < used)
+            used = length;
+        overflow = false;
+    }
+
+    /**
+     * Checks that everything written so far fit in the buffer.
+     */
+    bool ok() const noexcept {
+        return !overflow;
+    }
+
+    /** Provides the written bytes. */
+    const uint8_t *data() const noexcept {
+        return buffer;
+    }
+
+    /** Gets the number of bytes written. */
+    std::size_t length() const noexcept {
+        return used;
+    }
+
+    /** Writes an unsigned integer (major type 0). */
+    CborWriter& putUnsigned(uint64_t value) noexcept {
+        return putHead(0, value);
+    }
+
+    /** Writes a signed integer (major type 0 or 1). */
+    CborWriter& putInteger(int64_t value) noexcept {
+        // Negative values are stored as -1 - value.
+        return value < 0 ? putHead(1, ~static_cast<uint64_t>(value))
+                         : putHead(0, static_cast<uint64_t>(value));
+    }
+
+    /** Writes a byte string (major type 2). */
+    CborWriter& putBytes(const uint8_t *bytes, std::size_t n) noexcept {
+        return putHead(2, n).putRaw(bytes, n);
+    }
+
+    /** Writes a text string (major type 3). */
+    CborWriter& putText(const char *str) noexcept {
+        std::size_t n = 0;
+        while (str[n] != '\0')
+            ++n;
+        return putHead(3, n).putRaw(reinterpret_cast<const uint8_t *>(str), n);
+    }
+
+    /** Starts an array of the given number of items (major type 4). */
+    CborWriter& startArray(std::size_t count) noexcept {
+        return putHead(4, count);
+    }
+
+    /** Starts a map of the given number of key/value pairs (major type 5). */
+    CborWriter& startMap(std::size_t count) noexcept {
+        return putHead(5, count);
+    }
+
+private:
+    uint8_t *buffer;
+    std::size_t size;
+    /** Number of bytes written. */
+    std::size_t used = 0;
+    /** Set when a write did not fit. */
+    bool overflow = false;
+
+    /** Checks for room for n more bytes. */
+    bool reserve(std::size_t n) noexcept {
+        if (used + n > size)
+            overflow = true;
+        return !overflow;
+    }
+
+    CborWriter& putRaw(const uint8_t *bytes, std::size_t n) noexcept {
+        if (reserve(n)) {
+            for (auto i = 0u; i < n; ++i)
+                buffer[used++] = bytes[i];
+        }
+        return *this;
+    }
+
+    /** Writes an item header: the major type and its shortest-form argument. */
+    CborWriter& putHead(uint8_t major, uint64_t value) noexcept {
+        const uint8_t type = major << 5;
+        unsigned width;
+
+        if (value < 24) {
+            if (reserve(1))
+                buffer[used++] = type | static_cast<uint8_t>(value);
+            return *this;
+        } else if (value <= 0xFF) {
+            width = 1;
+        } else if (value <= 0xFFFF) {
+            width = 2;
+        } else if (value <= 0xFFFFFFFF) {
+            width = 4;
+        } else {
+            width = 8;
+        }
+
+        if (reserve(1 + width)) {
+            // Additional information 24..27 selects a 1, 2, 4 or 8 byte argument.
+            buffer[used++] = type | static_cast<uint8_t>(24 + (width == 1 ? 0 : width == 2 ? 1 : width == 4 ? 2 : 3));
+            for (auto i = width; i > 0; --i)
+                buffer[used++] = static_cast<uint8_t>(value >> (8 * (i - 1)));
+        }
+        return *this;
+    }
+};
+
+#endif // CBOR_WRITER_H
+
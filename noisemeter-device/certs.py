@@ -59,6 +59,12 @@ def printData(data, showPub = True):
         print('const char cert_{} [] PROGMEM = R"CERT('.format(name))
         print(cert + ')CERT";')
 
+        der = xcert.public_bytes(Encoding.DER)
+        print('const unsigned char cert_{}_der [] PROGMEM = {{'.format(name))
+        for i in range(0, len(der), 16):
+            print('    ' + ' '.join('0x{:02x},'.format(b) for b in der[i:i + 16]))
+        print('};')
+
     cas = []
     for ext in xcert.extensions:
         if ext.oid == x509.ObjectIdentifier("1.3.6.1.5.5.7.1.1"):
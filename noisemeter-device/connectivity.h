@@ -0,0 +1,158 @@
+/// @file
+/// @brief Tracks and maintains the device's network connectivity
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef CONNECTIVITY_H
+#define CONNECTIVITY_H
+
+#include "time-sync.h"
+#include "timestamp.h"
+#include "wifi-connection.h"
+
+#include <WString.h>
+
+#include <algorithm>
+#include <cstdint>
+
+/**
+ * @brief Keeps the device connected without ever blocking the caller.
+ *
+ * Combines the WiFi link's state with the clock's into one state that the
+ * upload logic can check. When the link drops, reconnecting is started in
+ * the background after MinRetrySec, and retried with a delay that doubles
+ * after each failed reconnection (up to MaxRetrySec) while the network stays
+ * unreachable.
+ */
+class Connectivity
+{
+public:
+    /** Most seconds to try each reconnection for. */
+    static constexpr unsigned AttemptTimeoutSec = 10;
+    /** Seconds to wait before the first retry after a failed reconnection. */
+    static constexpr unsigned MinRetrySec = 10;
+    /** Longest wait between reconnection attempts. */
+    static constexpr unsigned MaxRetrySec = MIN_TO_SEC(5);
+
+    /** Overall state, from least to most connected. */
+    enum class State {
+        Offline,     /** No WiFi connection */
+        Associating, /** Connecting to WiFi, or waiting for an address */
+        Online,      /** Connected, but the time is not known yet */
+        Synced       /** Connected, and the clock is synchronized */
+    };
+
+    Connectivity(WiFiConnection& wifi_, TimeSync& clock_):
+        wifi(wifi_), clock(clock_) {}
+
+    /**
+     * Sets the network to stay connected to.
+     * @param ssid_ Network name
+     * @param psk_ Network password
+     */
+    void begin(const String& ssid_, const String& psk_) {
+        ssid = ssid_;
+        psk = psk_;
+        retryMs = SEC_TO_MS(MinRetrySec);
+        offlineSince = millis();
+    }
+
+    /**
+     * Handles connectivity changes and reconnects if needed.
+     * Call this often, e.g. every loop(). Never blocks.
+     * @return True if state() changed since the last call
+     */
+    bool service() {
+        wifi.service();
+
+        const auto now = millis();
+        const auto status = wifi.status();
+        if (status == WiFiConnection::Status::Online) {
+            retryMs = SEC_TO_MS(MinRetrySec);
+            retrying = false;
+        } else if (status == WiFiConnection::Status::Offline) {
+            if (retrying || linkStatus != WiFiConnection::Status::Offline) {
+                // The link just went down: wait from now, and longer each
+                // time one of our own reconnections has failed.
+                offlineSince = now;
+                if (retrying)
+                    retryMs = std::min<uint32_t>(retryMs * 2, SEC_TO_MS(MaxRetrySec));
+                retrying = false;
+            } else if (!ssid.isEmpty() && now - offlineSince >= retryMs) {
+                wifi.connectAsync(ssid, psk, SEC_TO_MS(AttemptTimeoutSec));
+                retrying = true;
+            }
+        }
+        linkStatus = status;
+
+        const auto current = state();
+        const auto changed = current != lastState;
+        lastState = current;
+        return changed;
+    }
+
+    /**
+     * Gets the current state.
+     */
+    State state() const noexcept {
+        switch (wifi.status()) {
+        case WiFiConnection::Status::Online:
+            return clock.synced() ? State::Synced : State::Online;
+        case WiFiConnection::Status::Associating:
+            return State::Associating;
+        default:
+            return State::Offline;
+        }
+    }
+
+    /**
+     * Checks if the server can be reached, i.e. if connected with the time known.
+     */
+    bool ready() const noexcept {
+        return state() == State::Synced;
+    }
+
+    /**
+     * Names the given state, e.g. for logging.
+     */
+    static const char *toString(State s) noexcept {
+        switch (s) {
+        case State::Associating: return "associating";
+        case State::Online:      return "online";
+        case State::Synced:      return "online, time synced";
+        default:                 return "offline";
+        }
+    }
+
+private:
+    WiFiConnection& wifi;
+    TimeSync& clock;
+    /** Network to stay connected to. */
+    String ssid;
+    String psk;
+    /** When the link was last found to be down. */
+    uint32_t offlineSince = 0;
+    /** Milliseconds to stay offline before the next reconnection. */
+    uint32_t retryMs = SEC_TO_MS(MinRetrySec);
+    /** Set while a reconnection started by service() is in progress. */
+    bool retrying = false;
+    /** WiFi status as of the last service(). */
+    WiFiConnection::Status linkStatus = WiFiConnection::Status::Offline;
+    /** State as of the last service(). */
+    State lastState = State::Offline;
+};
+
+#endif // CONNECTIVITY_H
@@ -22,6 +22,7 @@
 #include "timestamp.h"
 
 #include <algorithm>
+#include <cstdint>
 
 /**
  * Stores data points included in an uploaded "measurement".
@@ -44,6 +45,28 @@ struct DataPacket
         average += (sample - average) / count;
     }
 
+    /**
+     * Combines another packet's data points into this one, e.g. to store
+     * older data at a coarser time resolution. The average is weighted by
+     * each packet's count and the later of the two timestamps and sequence
+     * numbers is kept.
+     * @param other The packet to merge into this one.
+     */
+    void merge(const DataPacket& other) noexcept {
+        if (other.count <= 0)
+            return;
+
+        const auto total = count + other.count;
+        average = (average * count + other.average * other.count) / total;
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+        count = total;
+        sequence = std::max(sequence, other.sequence);
+
+        if (timestamp.secondsBetween(other.timestamp) > 0)
+            timestamp = other.timestamp;
+    }
+
     /** Number of data points added to this DataPacket. */
     int count = 0;
 
@@ -62,6 +85,13 @@ struct DataPacket
      * uploaded to the server.
      */
     Timestamp timestamp = Timestamp::invalidTimestamp();
+
+    /**
+     * Per-device number that increases with every completed DataPacket,
+     * including across reboots, so that the server can recognize packets it
+     * already has. Numbers may be skipped. Zero if no number was assigned.
+     */
+    uint32_t sequence = 0;
 };
 
 #endif // DATAPACKET_H
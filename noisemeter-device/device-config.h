@@ -0,0 +1,145 @@
+/// @file
+/// @brief Reporting settings that the server can adjust at runtime
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef DEVICE_CONFIG_H
+#define DEVICE_CONFIG_H
+
+#include "timestamp.h"
+
+#include <WString.h>
+
+#include <array>
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * @brief Settings that control how much the device reports and how often.
+ *
+ * The server may include a "config" object in its response to an upload,
+ * e.g. {"upload_interval":900,"batch_size":24}, to shed load during an
+ * incident or to raise the resolution for a study. Only the members given
+ * are changed. Each value is checked against the bounds in Settings, and
+ * values outside of them are ignored, so a mistake on the server cannot
+ * stop a device from reporting.
+ *
+ * The settings are saved to Storage as a short string, so that they
+ * survive reboots.
+ */
+struct DeviceConfig {
+    /** Largest number of packets to send in a single upload request. */
+    static constexpr unsigned MaxBatchSize = 48;
+
+    /** Seconds between regular uploads. */
+    unsigned uploadInterval = MIN_TO_SEC(5);
+    /** Seconds that each data packet collects measurements for. */
+    unsigned packetInterval = MIN_TO_SEC(5);
+    /** Seconds of microphone samples that make up each Leq reading. */
+    unsigned leqPeriod = 1;
+    /** Seconds between checks for OTA updates. */
+    unsigned otaInterval = HR_TO_SEC(24);
+    /** Largest number of packets to send in a single upload request. */
+    unsigned batchSize = MaxBatchSize;
+
+    /** Describes one setting: its name in the server's response and its bounds. */
+    struct Setting {
+        const char *name;
+        unsigned DeviceConfig::*value;
+        unsigned min;
+        unsigned max;
+    };
+
+    /** All settings, in the order that they are saved. */
+    static constexpr std::array<Setting, 5> Settings = {{
+        { "upload_interval", &DeviceConfig::uploadInterval, MIN_TO_SEC(1), HR_TO_SEC(24) },
+        { "packet_interval", &DeviceConfig::packetInterval, MIN_TO_SEC(1), HR_TO_SEC(1) },
+        // The Leq archive holds at most one reading per second.
+        { "leq_period",      &DeviceConfig::leqPeriod,      1,             60 },
+        { "ota_interval",    &DeviceConfig::otaInterval,    HR_TO_SEC(1),  DAY_TO_SEC(7) },
+        { "batch_size",      &DeviceConfig::batchSize,      1,             MaxBatchSize }
+    }};
+
+    /**
+     * Changes a setting if the value is within its bounds.
+     * @param name The setting's name, e.g. "upload_interval"
+     * @param value The new value
+     * @return True if the setting exists and the value is acceptable
+     */
+    bool set(const char *name, long value) noexcept {
+        for (const auto& s : Settings) {
+            if (std::strcmp(name, s.name) == 0) {
+                if (value < static_cast<long>(s.min) || value > static_cast<long>(s.max))
+                    return false;
+
+                this->*s.value = static_cast<unsigned>(value);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Formats the settings for Storage, e.g. "300,300,1,86400,48".
+     */
+    String toString() const {
+        String str;
+        for (const auto& s : Settings) {
+            if (!str.isEmpty())
+                str += ',';
+            str += this->*s.value;
+        }
+        return str;
+    }
+
+    /**
+     * Reads settings saved by toString().
+     * Missing or out-of-bounds values keep their defaults.
+     * @param str The saved settings, or empty for the defaults
+     * @return The settings
+     */
+    static DeviceConfig fromString(const String& str) {
+        DeviceConfig config;
+        const char *p = str.c_str();
+
+        for (const auto& s : Settings) {
+            char *end;
+            const auto value = std::strtol(p, &end, 10);
+            if (end == p)
+                break;
+
+            config.set(s.name, value);
+            p = *end == ',' ? end + 1 : end;
+        }
+
+        return config;
+    }
+
+    bool operator==(const DeviceConfig& other) const noexcept {
+        for (const auto& s : Settings) {
+            if (this->*s.value != other.*s.value)
+                return false;
+        }
+        return true;
+    }
+
+    bool operator!=(const DeviceConfig& other) const noexcept {
+        return !(*this == other);
+    }
+};
+
+#endif // DEVICE_CONFIG_H
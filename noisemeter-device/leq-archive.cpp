@@ -0,0 +1,250 @@
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "leq-archive.h"
+#include "packet-codec.h"
+
+#include <CRC32.h>
+
+#include <algorithm>
+#include <iterator>
+#include <optional>
+
+/** Identifies a block that belongs to the Leq archive ("NMLQ"). */
+static constexpr uint32_t BLOCK_MAGIC = 0x514C4D4E;
+/** Encoded token that introduces a gap of skipped seconds. */
+static constexpr uint64_t TOKEN_GAP = 0;
+/** Clock jumps further back than this (in seconds) start a new block. */
+static constexpr std::time_t MAX_BACKWARD_JUMP = 60;
+
+bool LeqArchive::begin(unsigned offset, unsigned size) noexcept
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+        ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+    if (partition == nullptr || offset % BlockSize != 0 || offset >= partition->size) {
+        partition = nullptr;
+        return false;
+    }
+
+    base = offset;
+    blockCount = std::min<unsigned>(size, partition->size - offset) / BlockSize;
+    if (blockCount < 2) {
+        partition = nullptr;
+        return false;
+    }
+
+    // Read every block header once, looking for the newest block.
+    std::vector<std::optional<Header>> headers (blockCount);
+    std::optional<unsigned> newest;
+
+    for (auto i = 0u; i < blockCount; ++i) {
+        Header hdr;
+        esp_partition_read(partition, base + i * BlockSize, &hdr, sizeof(hdr));
+        if (hdr.magic != BLOCK_MAGIC || hdr.bytes > PayloadSize)
+            continue;
+
+        headers[i] = hdr;
+        if (!newest || static_cast<int32_t>(hdr.sequence - headers[*newest]->sequence) > 0)
+            newest = i;
+    }
+
+    index.clear();
+    header.count = 0;
+    header.bytes = 0;
+    saved = false;
+
+    if (!newest) {
+        nextSector = 0;
+        nextSequence = 0;
+        return true;
+    }
+
+    // Collect the chain of consecutive blocks ending with the newest one.
+    const auto newestSequence = headers[*newest]->sequence;
+    index.reserve(blockCount);
+    for (auto i = 0u; i < blockCount; ++i) {
+        const auto sector = (*newest + blockCount - i) % blockCount;
+        if (!headers[sector] || headers[sector]->sequence != newestSequence - i)
+            break;
+        index.push_back({static_cast<std::time_t>(headers[sector]->start),
+            static_cast<uint16_t>(sector)});
+    }
+    std::reverse(index.begin(), index.end());
+
+    nextSector = (*newest + 1) % blockCount;
+    nextSequence = newestSequence + 1;
+    return true;
+}
+
+void LeqArchive::add(Timestamp when, float leq) noexcept
+{
+    if (partition == nullptr)
+        return;
+
+    const auto t = static_cast<std::time_t>(when);
+
+    if (header.count > 0 && t + MAX_BACKWARD_JUMP < nextTime)
+        writeBlock();
+
+    std::array<uint8_t, 3 * 10> buf;
+    auto n = 0u;
+
+    if (header.count == 0) {
+        header.start = t;
+        nextTime = t;
+        lastValue = 0;
+    } else if (t > nextTime) {
+        n += encodeVarint(buf.data() + n, TOKEN_GAP);
+        n += encodeVarint(buf.data() + n, t - nextTime);
+    }
+
+    const auto value = static_cast<int32_t>(encodeDecibels(leq));
+    const auto delta = value - lastValue;
+    const auto zigzag = (static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31);
+    n += encodeVarint(buf.data() + n, zigzag + 1ull);
+
+    if (header.bytes + n > PayloadSize) {
+        // Block is full: write it out and start the next one with this reading.
+        writeBlock();
+        add(when, leq);
+        return;
+    }
+
+    std::copy(buf.cbegin(), buf.cbegin() + n, payload.begin() + header.bytes);
+    header.bytes += n;
+    header.count++;
+    lastValue = value;
+    nextTime = std::max(t, nextTime) + 1;
+}
+
+void LeqArchive::flush() noexcept
+{
+    if (partition != nullptr)
+        writeBlock(false);
+}
+
+unsigned LeqArchive::read(Timestamp from, Timestamp to, Reader func) const
+{
+    if (partition == nullptr)
+        return 0;
+
+    const auto tfrom = static_cast<std::time_t>(from);
+    const auto tto = static_cast<std::time_t>(to);
+    auto found = 0u;
+
+    // Start with the last block that begins at or before the range.
+    auto it = std::upper_bound(index.cbegin(), index.cend(), tfrom,
+        [](std::time_t t, const IndexEntry& e) { return t < e.start; });
+    if (it != index.cbegin())
+        --it;
+
+    // A saved open block is read from RAM instead, being more up to date.
+    const auto end = saved ? std::prev(index.cend()) : index.cend();
+
+    std::vector<uint8_t> data (PayloadSize);
+    for (; it < end && it->start <= tto; ++it) {
+        const auto addr = base + it->sector * BlockSize;
+        Header hdr;
+
+        esp_partition_read(partition, addr, &hdr, sizeof(hdr));
+        if (hdr.magic != BLOCK_MAGIC || hdr.bytes > PayloadSize)
+            continue;
+
+        esp_partition_read(partition, addr + sizeof(hdr), data.data(), hdr.bytes);
+        if (CRC32::calculate(data.data(), hdr.bytes) != hdr.crc)
+            continue;
+
+        found += decode(hdr, data.data(), tfrom, tto, func);
+    }
+
+    if (header.count > 0 && header.start <= tto)
+        found += decode(header, payload.data(), tfrom, tto, func);
+
+    return found;
+}
+
+bool LeqArchive::writeBlock(bool close) noexcept
+{
+    if (header.count == 0)
+        return true;
+
+    header.magic = BLOCK_MAGIC;
+    header.sequence = nextSequence;
+    header.crc = CRC32::calculate(payload.data(), header.bytes);
+
+    // A block saved by an earlier flush() is rewritten in place.
+    const auto addr = base + nextSector * BlockSize;
+    auto success = esp_partition_erase_range(partition, addr, BlockSize) == ESP_OK &&
+        esp_partition_write(partition, addr + sizeof(header), payload.data(), header.bytes) == ESP_OK &&
+        esp_partition_write(partition, addr, &header, sizeof(header)) == ESP_OK;
+
+    if (!saved) {
+        // The sector being reused held the oldest block.
+        if (!index.empty() && index.front().sector == nextSector)
+            index.erase(index.begin());
+
+        if (success) {
+            index.push_back({static_cast<std::time_t>(header.start),
+                static_cast<uint16_t>(nextSector)});
+            saved = true;
+        }
+    }
+
+    if (close) {
+        nextSector = (nextSector + 1) % blockCount;
+        nextSequence++;
+        header.count = 0;
+        header.bytes = 0;
+        saved = false;
+    }
+
+    return success;
+}
+
+unsigned LeqArchive::decode(const Header& hdr, const uint8_t *data,
+    std::time_t from, std::time_t to, const Reader& func)
+{
+    auto t = static_cast<std::time_t>(hdr.start);
+    auto value = 0l;
+    auto found = 0u;
+    auto pos = 0u;
+
+    for (auto i = 0u; i < hdr.count && pos < hdr.bytes && t <= to;) {
+        uint64_t token;
+        pos += decodeVarint(data + pos, token);
+
+        if (token == TOKEN_GAP) {
+            uint64_t gap;
+            pos += decodeVarint(data + pos, gap);
+            t += gap;
+            continue;
+        }
+
+        const auto zigzag = static_cast<uint32_t>(token - 1);
+        value += static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+
+        if (t >= from && t <= to) {
+            func(t, value / PACKET_CODEC_DB_SCALE);
+            ++found;
+        }
+
+        ++t;
+        ++i;
+    }
+
+    return found;
+}
+
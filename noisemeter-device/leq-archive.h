@@ -0,0 +1,150 @@
+/// @file
+/// @brief Compressed flash archive of one-second Leq readings
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef LEQ_ARCHIVE_H
+#define LEQ_ARCHIVE_H
+
+#include "timestamp.h"
+
+#include <esp_partition.h>
+
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <vector>
+
+/**
+ * @brief Keeps every one-second Leq reading in flash for later retrieval.
+ *
+ * Readings are stored as 0.1 dB fixed-point values, each encoded as a
+ * zigzag varint delta from the reading before it; steady noise levels take
+ * a single byte per second. Readings are collected in RAM and written out in
+ * fixed-size blocks of one flash sector, each holding a little over an hour
+ * of data. Blocks are written in a ring over the archive's region of the
+ * "spiffs" partition, so the oldest hour is erased once the ring is full.
+ * flush() saves the block being filled without closing it: later flushes
+ * rewrite the same sector until the block is full.
+ *
+ * A small index of block start times is kept in RAM to locate the blocks
+ * covering a requested time range without reading the whole archive.
+ */
+class LeqArchive
+{
+public:
+    /** Callback for read(): receives each reading's time and Leq value. */
+    using Reader = std::function<void(std::time_t, float)>;
+
+    /**
+     * Locates the flash partition and builds the block index.
+     * @param offset Start of the archive's region within the partition
+     * @param size Size of the archive's region in bytes
+     * @return True if the archive is ready for use
+     */
+    bool begin(unsigned offset, unsigned size) noexcept;
+
+    /**
+     * Adds a reading to the archive.
+     * Readings must be added in time order; skipped seconds are recorded as
+     * gaps.
+     * @param when Time of the reading, must be valid
+     * @param leq The Leq reading in decibels
+     */
+    void add(Timestamp when, float leq) noexcept;
+
+    /**
+     * Saves the partially filled block in RAM to flash, e.g. periodically
+     * and before a reset. The block stays open for new readings.
+     */
+    void flush() noexcept;
+
+    /**
+     * Reads the archived readings within the given time range.
+     * Readings still in RAM are included.
+     * @param from Start of the time range (inclusive)
+     * @param to End of the time range (inclusive)
+     * @param func Called once for each reading found, in time order
+     * @return Number of readings found
+     */
+    unsigned read(Timestamp from, Timestamp to, Reader func) const;
+
+private:
+    /** Size of one block; equal to the size of one erasable flash sector. */
+    static constexpr unsigned BlockSize = 4096;
+
+    /** Stored at the start of each block. */
+    struct Header {
+        uint32_t magic;
+        /** Increments with each written block. */
+        uint32_t sequence;
+        /** Time of the block's first reading. */
+        int64_t start;
+        /** Number of readings in the block. */
+        uint16_t count;
+        /** Number of payload bytes following the header. */
+        uint16_t bytes;
+        /** CRC32 checksum of the payload. */
+        uint32_t crc;
+    };
+    static_assert(sizeof(Header) == 24);
+
+    /** Largest number of payload bytes in a block. */
+    static constexpr unsigned PayloadSize = BlockSize - sizeof(Header);
+
+    /** Index entry locating the start of a block. */
+    struct IndexEntry {
+        std::time_t start;
+        uint16_t sector;
+    };
+
+    /** Flash partition holding the archive. */
+    const esp_partition_t *partition = nullptr;
+    /** Offset of the archive's region within the partition. */
+    unsigned base = 0;
+    /** Number of blocks within the archive's region. */
+    unsigned blockCount = 0;
+    /** Sequence number for the next block to be written. */
+    uint32_t nextSequence = 0;
+    /** Sector for the next block to be written. */
+    unsigned nextSector = 0;
+    /** Start times of the written blocks, oldest first. */
+    std::vector<IndexEntry> index;
+
+    /** Block being filled with new readings. */
+    std::array<uint8_t, PayloadSize> payload;
+    /** Header for the block being filled. */
+    Header header;
+    /** Set once the block being filled has a sector and index entry. */
+    bool saved = false;
+    /** Time of the next expected reading. */
+    std::time_t nextTime = 0;
+    /** Fixed-point value of the previous reading. */
+    int32_t lastValue = 0;
+
+    /**
+     * Writes the block being filled to flash.
+     * @param close True to start a new block afterwards
+     */
+    bool writeBlock(bool close = true) noexcept;
+    /** Decodes the given block payload, passing readings within range to func. */
+    static unsigned decode(const Header& hdr, const uint8_t *data,
+        std::time_t from, std::time_t to, const Reader& func);
+};
+
+#endif // LEQ_ARCHIVE_H
+
@@ -0,0 +1,255 @@
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "mqtt-client.h"
+
+#include <Arduino.h>
+
+#include <cstring>
+
+/** Bytes reserved at the start of buffer for the fixed header. */
+static constexpr std::size_t HEADER_ROOM = 5;
+/** Milliseconds to wait for the broker to accept a connection. */
+static constexpr uint32_t CONNECT_TIMEOUT_MS = 10000;
+
+bool MqttClient::connect(const char *host, uint16_t port, const char *clientId,
+    const char *username, const char *password)
+{
+    if (!net.connect(host, port))
+        return false;
+
+    // Clean session is left off so that the broker keeps the session.
+    uint8_t flags = 0;
+    if (username != nullptr)
+        flags |= 0x80;
+    if (password != nullptr)
+        flags |= 0x40;
+
+    begin();
+    putString("MQTT");
+    putByte(4); // Protocol level 3.1.1
+    putByte(flags);
+    putWord(KeepAliveSec);
+    putString(clientId);
+    if (username != nullptr)
+        putString(username);
+    if (password != nullptr)
+        putString(password);
+
+    if (!send(Connect)) {
+        net.stop();
+        return false;
+    }
+
+    std::array<uint8_t, 4> body;
+    std::size_t length;
+    const auto type = receive(body, length, CONNECT_TIMEOUT_MS);
+
+    // CONNACK carries the session present flag and a return code.
+    if (type != Connack || length != 2 || body[1] != 0) {
+        net.stop();
+        return false;
+    }
+
+    session = body[0] & 1;
+    return true;
+}
+
+bool MqttClient::connected()
+{
+    return net.connected();
+}
+
+void MqttClient::disconnect()
+{
+    if (net.connected()) {
+        begin();
+        send(Disconnect);
+    }
+
+    net.stop();
+}
+
+bool MqttClient::publish(const char *topic, const uint8_t *payload, std::size_t length,
+    uint16_t packetId, bool dup)
+{
+    begin();
+    putString(topic);
+    putWord(packetId);
+    putBytes(payload, length);
+
+    // QoS 1, not retained.
+    if (!send(Publish | (dup ? 0x08 : 0) | 0x02))
+        return false;
+
+    sentAt[packetId % sentAt.size()] = lastSend;
+    ++counters.published;
+    return true;
+}
+
+unsigned MqttClient::awaitAcks(const uint16_t *ids, unsigned count, uint32_t timeoutMs)
+{
+    const auto start = millis();
+    unsigned acked = 0;
+
+    while (acked < count) {
+        const auto elapsed = millis() - start;
+        if (elapsed >= timeoutMs)
+            break;
+
+        std::array<uint8_t, 4> body;
+        std::size_t length;
+        const auto type = receive(body, length, timeoutMs - elapsed);
+
+        if (type == 0)
+            break;
+        if (type != Puback || length != 2)
+            continue;
+
+        const uint16_t id = body[0] << 8 | body[1];
+        if (id == ids[acked]) {
+            counters.ackMs += millis() - sentAt[id % sentAt.size()];
+            ++counters.acked;
+            ++acked;
+        }
+    }
+
+    return acked;
+}
+
+void MqttClient::service()
+{
+    if (!net.connected())
+        return;
+
+    // Handle anything the broker sent, such as ping responses.
+    while (net.available() > 0) {
+        std::array<uint8_t, 4> body;
+        std::size_t length;
+        if (receive(body, length, 1000) == 0)
+            break;
+    }
+
+    // Ping well before the broker's keep-alive timeout.
+    if (millis() - lastSend >= KeepAliveSec * 1000u / 2) {
+        begin();
+        if (!send(Pingreq))
+            net.stop();
+    }
+}
+
+void MqttClient::begin() noexcept
+{
+    used = HEADER_ROOM;
+}
+
+void MqttClient::putByte(uint8_t b) noexcept
+{
+    if (used < buffer.size())
+        buffer[used] = b;
+    ++used;
+}
+
+void MqttClient::putWord(uint16_t w) noexcept
+{
+    putByte(w >> 8);
+    putByte(w & 0xFF);
+}
+
+void MqttClient::putBytes(const uint8_t *bytes, std::size_t n) noexcept
+{
+    for (auto i = 0u; i < n; ++i)
+        putByte(bytes[i]);
+}
+
+void MqttClient::putString(const char *str) noexcept
+{
+    const auto n = std::strlen(str);
+    putWord(n);
+    putBytes(reinterpret_cast<const uint8_t *>(str), n);
+}
+
+bool MqttClient::send(uint8_t header) noexcept
+{
+    if (used > buffer.size())
+        return false;
+
+    // The remaining length is written right before the body, so the packet
+    // starts somewhere within the reserved header room.
+    std::array<uint8_t, 4> len;
+    auto remaining = used - HEADER_ROOM;
+    std::size_t n = 0;
+    do {
+        len[n] = remaining & 0x7F;
+        remaining >>= 7;
+        if (remaining > 0)
+            len[n] |= 0x80;
+        ++n;
+    } while (remaining > 0);
+
+    const auto start = HEADER_ROOM - n - 1;
+    buffer[start] = header;
+    std::memcpy(buffer.data() + start + 1, len.data(), n);
+
+    const auto size = used - start;
+    const auto written = net.write(buffer.data() + start, size);
+    counters.bytes += written;
+    lastSend = millis();
+    return written == size;
+}
+
+uint8_t MqttClient::receive(std::array<uint8_t, 4>& body, std::size_t& length, uint32_t timeoutMs)
+{
+    const auto deadline = millis() + timeoutMs;
+
+    const auto header = readByte(deadline);
+    if (header < 0)
+        return 0;
+
+    std::size_t remaining = 0;
+    for (auto shift = 0u; shift < 28; shift += 7) {
+        const auto b = readByte(deadline);
+        if (b < 0)
+            return 0;
+
+        remaining |= static_cast<std::size_t>(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+
+    // Anything beyond the body buffer is read and discarded.
+    length = remaining;
+    for (auto i = 0u; i < remaining; ++i) {
+        const auto b = readByte(deadline);
+        if (b < 0)
+            return 0;
+        if (i < body.size())
+            body[i] = b;
+    }
+
+    return static_cast<uint8_t>(header);
+}
+
+int MqttClient::readByte(uint32_t deadline)
+{
+    while (net.available() <= 0) {
+        if (!net.connected() || static_cast<int32_t>(millis() - deadline) >= 0)
+            return -1;
+        delay(1);
+    }
+
+    return net.read();
+}
@@ -0,0 +1,173 @@
+/// @file
+/// @brief Minimal MQTT 3.1.1 client for publishing with QoS 1
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+#include <Client.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Publishes messages to an MQTT broker over an existing Client.
+ *
+ * Only what the device needs is implemented: a persistent session (clean
+ * session off), QoS 1 publishing, and keep-alive pings. Subscriptions are
+ * not supported.
+ *
+ * Several messages may be published before waiting for their PUBACKs; the
+ * broker acknowledges QoS 1 messages in the order it received them, so the
+ * caller's queue can serve as the in-flight window.
+ */
+class MqttClient
+{
+public:
+    /** Seconds of silence after which the broker may drop the connection. */
+    static constexpr uint16_t KeepAliveSec = 900;
+
+    /** Counters for comparing MQTT against other upload paths. */
+    struct Stats {
+        /** Number of messages published. */
+        unsigned published = 0;
+        /** Number of messages acknowledged. */
+        unsigned acked = 0;
+        /** Total milliseconds from publishing to acknowledgement. */
+        uint32_t ackMs = 0;
+        /** Total bytes written to the connection. */
+        uint32_t bytes = 0;
+    };
+
+    /**
+     * Prepares to talk MQTT over the given connection.
+     * @param net_ Connection to use, e.g. a TLSClient
+     */
+    explicit MqttClient(Client& net_) noexcept:
+        net(net_) {}
+
+    /**
+     * Opens the connection and starts (or resumes) the MQTT session.
+     * @param host Broker host name
+     * @param port Broker port
+     * @param clientId Client identifier; identifies the persistent session
+     * @param username User name, or nullptr
+     * @param password Password, or nullptr
+     * @return True once the broker accepts the connection
+     */
+    bool connect(const char *host, uint16_t port, const char *clientId,
+        const char *username, const char *password);
+
+    /**
+     * Checks if the connection to the broker is open.
+     */
+    bool connected();
+
+    /**
+     * Closes the connection, leaving the session for the next connect().
+     */
+    void disconnect();
+
+    /**
+     * Checks if the broker still held a session from a previous connection.
+     */
+    bool sessionPresent() const noexcept {
+        return session;
+    }
+
+    /**
+     * Publishes a message with QoS 1. Call awaitAcks() to confirm delivery.
+     * @param topic Topic to publish to
+     * @param payload Message contents
+     * @param length Size of the message in bytes
+     * @param packetId Nonzero identifier to be acknowledged
+     * @param dup True if the message may have been published before
+     * @return True if the message was written to the connection
+     */
+    bool publish(const char *topic, const uint8_t *payload, std::size_t length,
+        uint16_t packetId, bool dup);
+
+    /**
+     * Waits for the acknowledgement of published messages, in order.
+     * @param ids Packet identifiers, in the order published
+     * @param count Number of identifiers
+     * @param timeoutMs Longest time to wait for all of them
+     * @return Number of leading messages that were acknowledged
+     */
+    unsigned awaitAcks(const uint16_t *ids, unsigned count, uint32_t timeoutMs);
+
+    /**
+     * Keeps the connection alive; call regularly while connected.
+     * Sends a ping when nothing has been sent for a while and handles
+     * anything received from the broker.
+     */
+    void service();
+
+    /**
+     * Provides the publishing counters.
+     */
+    const Stats& stats() const noexcept {
+        return counters;
+    }
+
+private:
+    /** MQTT control packet types, shifted into the fixed header. */
+    enum Type : uint8_t {
+        Connect    = 0x10,
+        Connack    = 0x20,
+        Publish    = 0x30,
+        Puback     = 0x40,
+        Pingreq    = 0xC0,
+        Pingresp   = 0xD0,
+        Disconnect = 0xE0
+    };
+
+    Client& net;
+    /** Buffer that outgoing packets are built in. */
+    std::array<uint8_t, 256> buffer;
+    /** Number of bytes in buffer. */
+    std::size_t used = 0;
+    /** Time of the last packet sent, for keep-alive. */
+    uint32_t lastSend = 0;
+    /** Times that recent messages were published, by packet identifier. */
+    std::array<uint32_t, 64> sentAt;
+    /** Set when the broker resumed an earlier session. */
+    bool session = false;
+    Stats counters;
+
+    /** Starts a new packet with room for the fixed header. */
+    void begin() noexcept;
+    void putByte(uint8_t b) noexcept;
+    void putWord(uint16_t w) noexcept;
+    void putBytes(const uint8_t *bytes, std::size_t n) noexcept;
+    /** Adds a length-prefixed UTF-8 string. */
+    void putString(const char *str) noexcept;
+    /** Fills in the fixed header and writes the packet. */
+    bool send(uint8_t header) noexcept;
+
+    /**
+     * Reads one control packet, keeping at most sizeof(body) bytes of it.
+     * @return Packet type and flags, or zero on timeout or error
+     */
+    uint8_t receive(std::array<uint8_t, 4>& body, std::size_t& length, uint32_t timeoutMs);
+    /** Reads one byte, waiting until the deadline. */
+    int readByte(uint32_t deadline);
+};
+
+#endif // MQTT_CLIENT_H
+
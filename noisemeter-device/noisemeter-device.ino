@@ -24,14 +24,28 @@
 #include "api.h"
 #include "blinker.h"
 #include "board.h"
+#include "connectivity.h"
 #include "data-packet.h"
+#include "device-config.h"
+#include "leq-archive.h"
+#include "packet-buffer.h"
+#include "packet-log.h"
+#include "retained.h"
 #include "spl-meter.h"
 #include "storage.h"
+#include "time-sync.h"
 #include "ota-update.h"
+#include "upload-scheduler.h"
+#include "wifi-connection.h"
 #include "UUID/UUID.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
-#include <list>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <optional>
 
 #ifdef BOARD_ESP32_PCB
@@ -42,26 +56,99 @@ HWCDC USBSerial;
 constexpr auto WIFI_CONNECT_TIMEOUT_SEC = MIN_TO_SEC(2);
 /** Maximum number of seconds to try making new WiFi connection. */
 constexpr auto WIFI_NEW_CONNECT_TIMEOUT_SEC = 20;
-/** Specifies how frequently to upload data points to the server. */
-constexpr auto UPLOAD_INTERVAL_SEC = MIN_TO_SEC(5);
-/** Specifies how frequently to check for OTA updates from our server. */
-constexpr auto OTA_INTERVAL_SEC = HR_TO_SEC(24);
-/** Maximum number of data packets to retain when WiFi is unavailable. */
-constexpr auto MAX_SAVED_PACKETS = DAY_TO_SEC(14) / UPLOAD_INTERVAL_SEC;
+/** Bytes of RAM for unsent packets, about three days' worth if flash is unavailable. */
+constexpr auto PACKET_BUFFER_SIZE = 8192u;
+/** Most time to spend sending older packets in one upload cycle. */
+constexpr auto UPLOAD_BACKFILL_MS = SEC_TO_MS(15);
+/** Most request bytes to spend sending older packets in one upload cycle. */
+constexpr auto UPLOAD_BACKFILL_BYTES = 32768u;
+/** Number of unsent packets to collect in RAM before moving them to flash. */
+constexpr auto PACKET_LOG_BATCH = 6u;
+/** Bytes of the flash data partition used to store unsent packets (about six weeks' worth). */
+constexpr auto PACKET_LOG_SIZE = 0x60000u;
+/** Bytes of the flash data partition used to archive Leq readings (about twelve days' worth). */
+constexpr auto LEQ_ARCHIVE_SIZE = 0x100000u;
+/** Seconds between saving the Leq archive's newest readings, i.e. the most a power loss can lose. */
+constexpr auto LEQ_ARCHIVE_FLUSH_SEC = MIN_TO_SEC(10);
+/** Minutes of Leq readings that the "leq" console command prints by default. */
+constexpr auto LEQ_CONSOLE_MINUTES = 60;
+/** Number of completed packets to hold until the time is known; older ones are merged. */
+constexpr auto UNSYNCED_PACKET_COUNT = 24u;
+/** Number of packet sequence numbers to reserve in storage at a time. */
+constexpr auto SEQUENCE_LEASE_SIZE = 256u;
+/** Identifies the layout of RetainedState; change whenever the layout or packet encoding changes. */
+constexpr uint32_t RETAINED_STATE_LAYOUT = 0x4E4D0004;
 
 /** SPLMeter instance to manage decibel level measurement. */
 static SPLMeter SPL;
 /** Storage instance to manage stored credentials. */
 static Storage Creds;
-/** Linked list of completed data packets.
- * This list should only grow if WiFi is unavailable. */
-static std::list<DataPacket> packets;
-/** Tracks when the last measurement upload occurred. */
-static Timestamp lastUpload = Timestamp::invalidTimestamp();
+/** Reporting settings (upload, packet and OTA intervals, etc.), adjustable by the server. */
+static DeviceConfig Config;
+/** Measurement state that is kept in RAM across software resets. */
+struct RetainedState {
+  /** Set to RETAINED_STATE_LAYOUT. */
+  uint32_t layout = RETAINED_STATE_LAYOUT;
+  /** Data packet currently collecting measurements. */
+  DataPacket currentPacket;
+  /** Completed data packets, oldest first.
+   * This buffer should only grow if WiFi is unavailable. */
+  PacketBuffer<PACKET_BUFFER_SIZE> packets;
+  /** Monotonic time (see TimeSync) when the current data packet started collecting measurements. */
+  int64_t packetStart = 0;
+  /** Packets completed before the time was known, oldest first, stamped with monotonic time. */
+  std::array<DataPacket, UNSYNCED_PACKET_COUNT> unsyncedPackets;
+  /** Number of packets in unsyncedPackets. */
+  unsigned unsyncedCount = 0;
+  /** Decides when to attempt the next measurement upload. */
+  UploadScheduler uploads;
+  /** Tracks when the last OTA update check occurred. */
+  Timestamp lastOTACheck = Timestamp::invalidTimestamp();
+  /** Sequence number to give the next completed packet. */
+  uint32_t nextSequence = 0;
+  /** End of the sequence numbers reserved in storage. */
+  uint32_t sequenceLeaseEnd = 0;
+  /** Access point and DHCP lease of the last WiFi connection. */
+  WiFiConnection::Cache wifiCache;
+  /** Monotonic time and NTP state carried across resets. */
+  TimeSync::Base clock;
+};
+/** Holds the RetainedState, kept intact by ESP.restart(). */
+static __NOINIT_ATTR Retained<RetainedState> State;
+/** Data packet currently collecting measurements. */
+static DataPacket& currentPacket = State->currentPacket;
+/** Completed data packets, oldest first. */
+static PacketBuffer<PACKET_BUFFER_SIZE>& packets = State->packets;
+/** Monotonic time when the current data packet started collecting measurements. */
+static int64_t& packetStart = State->packetStart;
+/** Decides when to attempt the next measurement upload. */
+static UploadScheduler& uploads = State->uploads;
 /** Tracks when the last OTA update check occurred. */
-static Timestamp lastOTACheck = Timestamp::invalidTimestamp();
+static Timestamp& lastOTACheck = State->lastOTACheck;
+/** Connects to WiFi, reusing the last connection's settings. */
+static WiFiConnection WiFiLink (State->wifiCache);
+/** Keeps the system clock synchronized and provides monotonic time. */
+static TimeSync Clock (State->clock);
+/** Tracks the network connection and reconnects in the background. */
+static Connectivity Network (WiFiLink, Clock);
+/** Flash-backed storage for unsent packets that survives resets. */
+static PacketLog Backlog;
+/** Flash archive of every Leq reading. */
+static LeqArchive Archive;
+/** Tracks when the time was first known after booting, for diagnostics. */
+static Timestamp bootTime = Timestamp::invalidTimestamp();
+/** Server API connection, created once credentials are confirmed. */
+static std::optional<API> Api;
 /** Track first measurement upload so diagnostics can be sent/included. */
 static bool firstSend;
+/** Set while a background task connects to the server; Api must not be used meanwhile. */
+static std::atomic<bool> prewarming;
+/** Set once connecting for the next upload has been started. */
+static bool prewarmed;
+/** Set once the clock's first synchronization has been handled. */
+static bool clockSynced;
+/** Monotonic time when the Leq archive was last saved to flash. */
+static int64_t archiveSaved;
 
 /**
  * Outputs the given decibel reading over serial.
@@ -69,14 +156,95 @@ static bool firstSend;
  */
 void printReadingToConsole(double reading);
 
+/**
+ * Handles commands typed on the serial console.
+ * "leq [minutes]" or "leq <from> <to>" (Unix times) prints archived Leq
+ * readings as CSV. Measuring pauses while long ranges are printed.
+ */
+void serviceConsole();
+
 /**
  * Callback for AccessPoint that verifies credentials and attempts registration.
  * @param ssid The name of the network to connect to
  * @param psk The named network's password
  * @param email The user's email for registration, or leave empty
+ * @param server Base URL of a local server to report to, or empty for the public API
+ * @param cert PEM root certificate for an https:// server, or empty
  * @return An error message if not successful
  */
-std::optional<const char *> saveNetworkCreds(String ssid, String psk, String email);
+std::optional<const char *> saveNetworkCreds(String ssid, String psk, String email, String server, String cert);
+
+/**
+ * Queues a completed packet for upload, making room for it if necessary.
+ * @param packet The packet to store
+ */
+void storePacket(const DataPacket& packet);
+
+/**
+ * Holds a packet completed before the time is known, merging the oldest
+ * held packets if there is no room.
+ * @param packet The packet to hold, stamped with monotonic time
+ */
+void holdUnsyncedPacket(const DataPacket& packet);
+
+/**
+ * Finishes what had to wait for the time: stamps and queues the held
+ * packets and plans the upload schedule.
+ * @param now The current time
+ */
+void clockSyncedNow(Timestamp now);
+
+/**
+ * Uploads a batch of packets in a single request.
+ * @param api API instance to upload with
+ * @param batch Array of packets to upload, oldest first
+ * @param count Number of packets in the array
+ * @return Number of packets from the front of the batch that the server
+ *         handled and can be removed from the queue; zero on failure
+ */
+unsigned uploadBatch(API& api, const DataPacket *batch, unsigned count);
+
+/**
+ * Uploads the newest packet, then as many older packets (oldest first) as
+ * the backfill time and byte budgets allow. The rest wait for later cycles.
+ * @param api API instance to upload with
+ * @return True unless a request failed
+ */
+bool uploadPackets(API& api);
+
+/**
+ * Applies and saves any settings that the server sent with the last upload.
+ * @param api API instance that made the upload
+ * @param now The current time
+ */
+void applyServerConfig(API& api, Timestamp now);
+
+/**
+ * Background task that connects to the server ahead of an upload.
+ * Clears prewarming once finished.
+ * @param param Unused
+ */
+void prewarmTask(void *param);
+
+/**
+ * Provides the next packet sequence number.
+ * Numbers are reserved in storage in blocks, so that they keep increasing
+ * across reboots without writing to storage for every packet.
+ * @return A sequence number greater than any given out before
+ */
+uint32_t takeSequence();
+
+/**
+ * Removes queued packets that the server has acknowledged, oldest first.
+ * @param ack Acknowledgement from the server
+ */
+void dropAcknowledged(const API::Acknowledgement& ack);
+
+/**
+ * Moves completed packets from RAM into the flash-backed backlog.
+ * @param keep Number of the newest packets to leave in RAM
+ */
+void savePacketsToFlash(unsigned keep = 0);
 
 /**
  * Generates a UUID that is unique to the hardware running this firmware.
@@ -84,6 +252,12 @@ std::optional<const char *> saveNetworkCreds(String ssid, String psk, String ema
  */
 UUID buildDeviceId();
 
+/**
+ * Saves the connected access point, so that connecting after a power cycle
+ * can skip the scan too. Storage is only written if it changed.
+ */
+void saveAccessPoint();
+
 /**
  * Attempt to establish a WiFi connected using the stored credentials.
  * @param mode WiFi mode to run in (e.g. WIFI_STA or WIFI_AP_STA)
@@ -117,8 +291,48 @@ void setup() {
   SERIAL.println(Creds);
 #endif
 
+  if (Creds.valid())
+    Config = DeviceConfig::fromString(Creds.get(Storage::Entry::Config));
+  SPL.setLeqPeriod(Config.leqPeriod);
+
+  auto warmStart = State.begin();
+  esp_register_shutdown_handler([] {
+    Clock.prepareForReset();
+    // The archive's newest readings are only in RAM.
+    Archive.flush();
+    State.seal();
+  });
+
+  // State left by firmware with a different layout cannot be used.
+  if (warmStart && State->layout != RETAINED_STATE_LAYOUT) {
+    *State = RetainedState();
+    warmStart = false;
+  }
+
+  if (warmStart) {
+    SERIAL.print("Resumed after reset with ");
+    SERIAL.print(packets.size() + State->unsyncedCount);
+    SERIAL.println(" packets in RAM.");
+  } else {
+    packetStart = Clock.monotonic();
+  }
+
+  // After a power cycle only the access point is known, not the lease.
+  WiFiLink.begin();
+  if (!WiFiLink.cached().valid() && Creds.valid())
+    State->wifiCache.fromString(Creds.get(Storage::Entry::WiFiCache));
+
+  if (Backlog.begin(0, PACKET_LOG_SIZE)) {
+    SERIAL.print(Backlog.size());
+    SERIAL.println(" saved packets found in flash.");
+  } else {
+    SERIAL.println("Failed to open packet storage!");
+  }
+
+  if (!Archive.begin(PACKET_LOG_SIZE, LEQ_ARCHIVE_SIZE))
+    SERIAL.println("Failed to open Leq archive!");
+
   SPL.initMicrophone();
-  packets.emplace_front();
 
 #ifndef UPLOAD_DISABLED
   bool isAPNeeded = false;
@@ -133,8 +347,6 @@ void setup() {
     isAPNeeded = true;
   } else if (tryWifiConnection(WIFI_STA) < 0) {
     isAPNeeded = true;
-  } else if (Timestamp::synchronize() < 0) {
-    isAPNeeded = true;
   }
 
   // Run the access point if it is requested or if there are no valid credentials.
@@ -151,16 +363,21 @@ void setup() {
     esp_deep_sleep_start();
   }
 
-  Timestamp now;
-  lastUpload = now;
-  lastOTACheck = now;
+  Api.emplace(buildDeviceId(), Creds.get(Storage::Entry::Token),
+    Creds.get(Storage::Entry::ServerUrl), Creds.get(Storage::Entry::ServerCert));
+
   firstSend = true;
 
+  // Measuring starts right away; packets are stamped and uploads are planned
+  // once the time arrives (see clockSyncedNow()).
+  Clock.begin();
+  Network.begin(Creds.get(Storage::Entry::SSID), Creds.get(Storage::Entry::Passkey));
+
   SERIAL.println("Connected to the WiFi network.");
   SERIAL.print("Local ESP32 IP: ");
   SERIAL.println(WiFi.localIP());
-  SERIAL.print("Current time: ");
-  SERIAL.println(now);
+  SERIAL.print("Reporting to: ");
+  SERIAL.println(Api->baseUrl());
 #endif // !UPLOAD_DISABLED
 
   digitalWrite(PIN_LED1, HIGH);
@@ -172,116 +389,426 @@ void setup() {
  */
 void loop() {
   if (auto db = SPL.readMicrophoneData(); db) {
-    packets.front().add(*db);
+    currentPacket.add(*db);
+
+    if (Clock.synced())
+      Archive.add(Timestamp(), *db);
+
     printReadingToConsole(*db);
   }
 
+  if (Clock.monotonic() - archiveSaved >= LEQ_ARCHIVE_FLUSH_SEC) {
+    archiveSaved = Clock.monotonic();
+    Archive.flush();
+  }
+
+  serviceConsole();
+
 #ifndef UPLOAD_DISABLED
   const auto now = Timestamp();
+  const auto uptime = Clock.monotonic();
 
-  if (lastUpload.secondsBetween(now) >= UPLOAD_INTERVAL_SEC) {
-    packets.front().timestamp = now;
+  if (Api && !prewarming)
+    Api->service();
 
-    if (WiFi.status() != WL_CONNECTED) {
-      SERIAL.println("Attempting WiFi reconnect...");
-      WiFi.reconnect();
-      delay(5000);
-    }
+  if (Network.service()) {
+    const auto state = Network.state();
+    SERIAL.print("Network: ");
+    SERIAL.println(Connectivity::toString(state));
 
-    if (WiFi.status() == WL_CONNECTED) {
-      API api (buildDeviceId(), Creds.get(Storage::Entry::Token));
+    if (state >= Connectivity::State::Online)
+      saveAccessPoint();
+  }
 
-      if (firstSend) {
-        if (api.sendMeasurementWithDiagnostics(packets.back(), NOISEMETER_VERSION, lastUpload)) {
-            packets.pop_back();
-            firstSend = false;
-        }
+  if (!clockSynced && Clock.synced()) {
+    clockSynced = true;
+    clockSyncedNow(now);
+  }
+
+  // Packets are timed with the monotonic clock so that setting the clock
+  // does not cut them short or stretch them.
+  if (uptime - packetStart >= Config.packetInterval) {
+    if (currentPacket.count > 0) {
+      currentPacket.sequence = takeSequence();
+      if (clockSynced) {
+        currentPacket.timestamp = now;
+        storePacket(currentPacket);
       } else {
-        std::optional<Blinker> bl;
+        currentPacket.timestamp = Timestamp(uptime);
+        holdUnsyncedPacket(currentPacket);
+      }
+    }
 
-        // Only blink if there's multiple packets to send
-        if (++packets.cbegin() != packets.cend())
-          bl.emplace(200);
+    // Create new packet for next measurements
+    currentPacket = DataPacket();
+    packetStart = uptime;
 
-        packets.remove_if([&api](const auto& pkt) {
-          return pkt.count <= 0 || api.sendMeasurement(pkt);
-        });
+    // Keep unsent packets safe while uploads are failing. The newest stays
+    // in RAM so that it can be sent first once the server is reachable.
+    if (packets.size() >= PACKET_LOG_BATCH)
+      savePacketsToFlash(1);
+
+#if defined(BOARD_ESP32_PCB)
+    // A downloaded update takes over once the finished packet is stored.
+    if (otaUpdateState() == OTAState::Ready) {
+      SERIAL.println("Restarting for the update...");
+      savePacketsToFlash();
+      delay(1000);
+      ESP.restart();
+    }
+#endif // BOARD_ESP32_PCB
+  }
+
+  // The update download has the network to itself while it runs.
+  const auto updating = otaUpdateState() == OTAState::Downloading;
+
+  // Connect in the background shortly before the upload is due, so that the
+  // upload itself only waits for the server's response.
+  if (clockSynced && !updating && !prewarmed && uploads.warmupDue(now) && Network.ready()) {
+    prewarmed = true;
+    prewarming = true;
+    // TLS handshakes need about as much stack as loop() has.
+    if (xTaskCreate(prewarmTask, "prewarm", 8192, nullptr, 1, nullptr) != pdPASS)
+      prewarming = false;
+  }
+
+  // While the network is down or the time is unknown, a due upload stays
+  // pending and goes out as soon as the connection is back; only the
+  // server's errors back off.
+  if (clockSynced && !updating && uploads.due(now) && !prewarming && Network.ready()) {
+    bool uploaded = false;
+    prewarmed = false;
+    unsigned retryAfter = 0;
+
+    auto& api = *Api;
+
+    // Diagnostics go with the first packet completed since booting.
+    if (firstSend && !packets.empty()) {
+      if (api.sendMeasurementWithDiagnostics(packets.back(), NOISEMETER_VERSION, bootTime)) {
+        packets.pop_back();
+        firstSend = false;
+        uploaded = true;
       }
+    } else {
+      uploaded = uploadPackets(api);
+      applyServerConfig(api, now);
+    }
+
+    retryAfter = api.retryAfter();
 
 #if defined(BOARD_ESP32_PCB)
-      // We have WiFi: also check for software updates
-      if (lastOTACheck.secondsBetween(now) >= OTA_INTERVAL_SEC) {
-        lastOTACheck = now;
-        SERIAL.println("Checking for updates...");
-
-        const auto ota = api.getLatestSoftware();
-        if (ota) {
-          if (ota->version.compareTo(NOISEMETER_VERSION) > 0) {
-            SERIAL.print(ota->version);
-            SERIAL.println(" available!");
-
-            if (downloadOTAUpdate(ota->url, api.rootCertificate())) {
-              SERIAL.println("Download success! Restarting...");
-              delay(1000);
-              ESP.restart();
-            } else {
-              SERIAL.println("Update download failed.");
-            }
-          } else {
-            SERIAL.println("No new updates.");
-          }
+    // We have WiFi: also check for software updates, unless the server is
+    // struggling.
+    if (uploaded && lastOTACheck.secondsBetween(now) >= Config.otaInterval) {
+      lastOTACheck = now;
+      SERIAL.println("Checking for updates...");
+
+      const auto ota = api.getLatestSoftware();
+      if (ota) {
+        if (ota->version.compareTo(NOISEMETER_VERSION) > 0) {
+          SERIAL.print(ota->version);
+          SERIAL.println(" available!");
+
+          // Free the API connections' memory for the download.
+          api.disconnectAll();
+
+          // Measuring carries on during the download; the restart waits
+          // for the current packet to finish.
+          if (startOTAUpdate(ota->url, api.rootCertificate()))
+            SERIAL.println("Downloading the update...");
+          else
+            SERIAL.println("Update download failed.");
         } else {
-          SERIAL.println("Failed to reach update server!");
+          SERIAL.println("No new updates.");
         }
+      } else {
+        SERIAL.println("Failed to reach update server!");
       }
-#endif // BOARD_ESP32_PCB
     }
+#endif // BOARD_ESP32_PCB
 
-    if (!packets.empty()) {
-      const auto count = std::distance(packets.cbegin(), packets.cend());
-      SERIAL.print(count);
-      SERIAL.println(" packets still need to be sent!");
+    // Requests within this cycle shared one connection; close it until the next.
+    api.disconnect();
+    // The upload went out on a reused lease, if any; now let DHCP confirm
+    // it, unless that would interrupt an update download.
+    if (otaUpdateState() != OTAState::Downloading)
+      WiFiLink.renewLease();
+
+#ifdef API_VERBOSE
+    const auto& tls = TLSClient::stats();
+    SERIAL.print("TLS handshakes: ");
+    SERIAL.print(tls.full);
+    SERIAL.print(" full (avg ");
+    SERIAL.print(tls.full > 0 ? tls.fullMs / tls.full : 0);
+    SERIAL.print(" ms), ");
+    SERIAL.print(tls.resumed);
+    SERIAL.print(" resumed (avg ");
+    SERIAL.print(tls.resumed > 0 ? tls.resumedMs / tls.resumed : 0);
+    SERIAL.print(" ms), ");
+    SERIAL.print(tls.failed);
+    SERIAL.print(" failed, peak heap ");
+    SERIAL.print(tls.peakHeap);
+    SERIAL.println(" bytes");
+
+    const auto& up = api.uploadStats();
+    SERIAL.print("Uploads: ");
+    SERIAL.print(up.packets);
+    SERIAL.print(" packets in ");
+    SERIAL.print(up.requests);
+    SERIAL.print(" requests (avg ");
+    SERIAL.print(up.requests > 0 ? up.ms / up.requests : 0);
+    SERIAL.print(" ms), ");
+    SERIAL.print(api.bytesSent());
+    SERIAL.println(" bytes sent");
+
+    const auto times = api.timings();
+    SERIAL.print("Upload phases: resolve ");
+    SERIAL.print(times.connect.resolveMs);
+    SERIAL.print(" ms, connect ");
+    SERIAL.print(times.connect.tcpMs);
+    SERIAL.print(" ms, handshake ");
+    SERIAL.print(times.connect.handshakeMs);
+    SERIAL.print(" ms, last request ");
+    SERIAL.print(times.requestMs);
+    SERIAL.println(" ms");
+
+    const auto clock = Clock.stats();
+    SERIAL.print("Clock: ");
+    SERIAL.print(clock.syncs);
+    SERIAL.print(" NTP syncs, last offset ");
+    SERIAL.print(clock.offsetMs);
+    SERIAL.print(" ms, drift ");
+    SERIAL.print(clock.driftPpm);
+    SERIAL.println(" ppm");
+#endif
 
-      if (count >= MAX_SAVED_PACKETS) {
-        SERIAL.println("Discarded a packet!");
-        packets.pop_back();
-      }
+    if (uploaded) {
+      uploads.succeeded(now);
+    } else {
+      uploads.failed(now, retryAfter);
+      SERIAL.print("Upload failed, next attempt at ");
+      SERIAL.println(uploads.nextAttempt());
     }
 
-    // Create new packet for next measurements
-    packets.emplace_front();
-    lastUpload = now;
+    if (!packets.empty() || !Backlog.empty()) {
+      SERIAL.print(packets.size() + Backlog.size());
+      SERIAL.println(" packets still need to be sent!");
+    }
   }
 #endif // !UPLOAD_DISABLED
 }
 
+bool uploadPackets(API& api) {
+  std::optional<Blinker> bl;
+
+  // Only blink if there's multiple packets to send
+  if (!Backlog.empty() || packets.size() > 1)
+    bl.emplace(200);
+
+  // Send the current noise level first so that it is not held up behind a
+  // long backlog. It is removed right away so that it is never sent twice.
+  if (!packets.empty()) {
+    const auto newest = packets.back();
+    if (uploadBatch(api, &newest, 1) == 0)
+      return false;
+    packets.pop_back();
+    dropAcknowledged(api.acknowledged());
+  }
+
+  const auto start = millis();
+  const auto startBytes = api.bytesSent();
+  const auto withinBudget = [&] {
+    return millis() - start < UPLOAD_BACKFILL_MS &&
+      api.bytesSent() - startBytes < UPLOAD_BACKFILL_BYTES;
+  };
+
+  static std::array<DataPacket, DeviceConfig::MaxBatchSize> batch;
+  const auto batchSize = std::min<unsigned>(Config.batchSize, batch.size());
+
+  // Backfill oldest first; packets in flash are older than those in RAM.
+  // Each batch is removed once sent, so progress survives resets.
+  while (!Backlog.empty() && withinBudget()) {
+    const auto sent = uploadBatch(api, batch.data(), Backlog.read(batch.data(), batchSize));
+    if (sent == 0)
+      return false;
+    for (auto i = 0u; i < sent; ++i)
+      Backlog.pop_front();
+    dropAcknowledged(api.acknowledged());
+  }
+
+  while (Backlog.empty() && !packets.empty() && withinBudget()) {
+    const auto sent = uploadBatch(api, batch.data(), packets.read(batch.data(), batchSize));
+    if (sent == 0)
+      return false;
+    for (auto i = 0u; i < sent; ++i)
+      packets.pop_front();
+    dropAcknowledged(api.acknowledged());
+  }
+
+  return true;
+}
+
+void holdUnsyncedPacket(const DataPacket& packet) {
+  auto& held = State->unsyncedPackets;
+  auto& count = State->unsyncedCount;
+
+  // Without the time for a long while, older data is kept at a coarser resolution.
+  if (count == held.size()) {
+    held[1].merge(held[0]);
+    std::copy(held.begin() + 1, held.end(), held.begin());
+    --count;
+  }
+
+  held[count++] = packet;
+}
+
+void clockSyncedNow(Timestamp now) {
+  SERIAL.print("Current time: ");
+  SERIAL.println(now);
+
+  const auto& held = State->unsyncedPackets;
+  auto& count = State->unsyncedCount;
+  for (auto i = 0u; i < count; ++i) {
+    auto packet = held[i];
+    packet.timestamp = Clock.toWallClock(static_cast<std::time_t>(packet.timestamp));
+    storePacket(packet);
+  }
+  count = 0;
+
+  bootTime = now;
+  lastOTACheck = now;
+  uploads.begin(buildDeviceId().toCharArray(), Config.uploadInterval, now);
+
+  SERIAL.print("Next upload: ");
+  SERIAL.println(uploads.nextAttempt());
+}
+
+unsigned uploadBatch(API& api, const DataPacket *batch, unsigned count) {
+  if (count == 0)
+    return 0;
+
+  const auto results = api.sendMeasurements(batch, count);
+  const auto rejected = std::count(results.cbegin(), results.cend(), false);
+
+  if (rejected > 0) {
+    // Resending these would only be rejected again, so they are dropped.
+    SERIAL.print(rejected);
+    SERIAL.println(" packets were rejected by the server!");
+  }
+
+  return results.size();
+}
+
+void applyServerConfig(API& api, Timestamp now) {
+  if (!api.applyConfig(Config))
+    return;
+
+  SERIAL.print("New settings from server: ");
+  SERIAL.println(Config.toString());
+
+  Creds.set(Storage::Entry::Config, Config.toString());
+  Creds.commit();
+
+  SPL.setLeqPeriod(Config.leqPeriod);
+  // A new upload interval moves this device's slot within it.
+  uploads.begin(buildDeviceId().toCharArray(), Config.uploadInterval, now);
+}
+
+void prewarmTask(void *) {
+  Api->prewarm();
+  prewarming = false;
+  vTaskDelete(nullptr);
+}
+
 void printReadingToConsole(double reading) {
   String output = "";
   output += std::lround(reading);
   output += "dB";
 
-  const auto currentCount = packets.front().count;
+  const auto currentCount = currentPacket.count;
   if (currentCount > 1) {
     output += " [+" + String(currentCount - 1) + " more]";
   }
   SERIAL.println(output);
 }
 
-std::optional<const char *> saveNetworkCreds(String ssid, String psk, String email)
+void serviceConsole() {
+  static String line;
+
+  while (SERIAL.available() > 0) {
+    const auto c = static_cast<char>(SERIAL.read());
+    if (c != '\r' && c != '\n') {
+      if (line.length() < 64)
+        line += c;
+      continue;
+    }
+
+    line.trim();
+    if (line.startsWith("leq")) {
+      const char *args = line.c_str() + 3;
+      char *end;
+      const auto first = std::strtoll(args, &end, 10);
+      const auto hasFirst = end != args;
+      const char *rest = end;
+      const auto second = std::strtoll(rest, &end, 10);
+
+      std::time_t from, to;
+      if (hasFirst && end != rest) {
+        from = first;
+        to = second;
+      } else {
+        to = std::time(nullptr);
+        from = to - MIN_TO_SEC(hasFirst ? first : LEQ_CONSOLE_MINUTES);
+      }
+
+      SERIAL.println("time,leq");
+      const auto count = Archive.read(Timestamp(from), Timestamp(to), [](std::time_t t, float leq) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%lld,%.1f", static_cast<long long>(t), leq);
+        SERIAL.println(buf);
+      });
+      SERIAL.print(count);
+      SERIAL.println(" readings.");
+    } else if (!line.isEmpty()) {
+      SERIAL.println("Unknown command. Try: leq [minutes] | leq <from> <to>");
+    }
+
+    line = "";
+  }
+}
+
+std::optional<const char *> saveNetworkCreds(String ssid, String psk, String email, String server, String cert)
 {
+  server.trim();
+  cert.trim();
+
+  // Settings that would fall back to the public API are refused, so that
+  // the user knows about the mistake.
+  if (!server.isEmpty() && (!Creds.canStore(Storage::Entry::ServerUrl, server) ||
+      !Creds.canStore(Storage::Entry::ServerCert, cert) || !API::isValidServer(server, cert)))
+  {
+    return "The server address or certificate is not valid.";
+  }
+
   // Confirm that the given credentials will fit in the allocated EEPROM space.
   if (!ssid.isEmpty() && Creds.canStore(ssid) && Creds.canStore(psk)) {
     Creds.set(Storage::Entry::SSID, ssid);
     Creds.set(Storage::Entry::Passkey, psk);
-    Creds.set(Storage::Entry::Unused, {});
+    Creds.set(Storage::Entry::ServerUrl, server);
+    Creds.set(Storage::Entry::ServerCert, server.isEmpty() ? String() : cert);
+    Creds.set(Storage::Entry::WiFiCache, "");
     Creds.commit();
+    WiFiLink.forget();
 
     if (tryWifiConnection(WIFI_AP_STA, WIFI_NEW_CONNECT_TIMEOUT_SEC) == 0) {
-      if (Timestamp::synchronize() == 0) {
+      // Registering needs the time to check the server's certificate.
+      Clock.begin();
+      if (Clock.waitForSync(NTP_CONNECT_TIMEOUT_MS)) {
         if (email.length() > 0) {
-          API api (buildDeviceId());
+          // Kept off the stack; replaced with an authorized one once set up.
+          Api.emplace(buildDeviceId(), String(), server, cert);
 
-          if (const auto reg = api.sendRegister(email); reg) {
+          if (const auto reg = Api->sendRegister(email); reg) {
             SERIAL.println("Registered!");
             Creds.set(Storage::Entry::Token, *reg);
             Creds.commit();
@@ -306,6 +833,81 @@ std::optional<const char *> saveNetworkCreds(String ssid, String psk, String ema
   }
 }
 
+void storePacket(const DataPacket& packet)
+{
+  if (packets.push_back(packet))
+    return;
+
+  // Out of RAM: move packets to flash. If that is not possible, merge the
+  // oldest packets to a coarser resolution, dropping them only as a last resort.
+  savePacketsToFlash();
+  while (!packets.push_back(packet)) {
+    if (!packets.compact()) {
+      SERIAL.println("Discarded a packet!");
+      packets.pop_front();
+    }
+  }
+}
+
+uint32_t takeSequence()
+{
+  auto& next = State->nextSequence;
+  auto& leaseEnd = State->sequenceLeaseEnd;
+
+  if (next >= leaseEnd) {
+    // Continue from the end of the last lease; numbers left over from before
+    // a reboot are skipped. Zero is reserved for packets without a number.
+    const auto stored = Creds.get(Storage::Entry::Sequence);
+    char *end;
+    const auto value = std::strtoul(stored.c_str(), &end, 10);
+    if (!stored.isEmpty() && *end == '\0')
+      next = std::max<uint32_t>(next, value);
+    next = std::max<uint32_t>(next, 1);
+
+    leaseEnd = next + SEQUENCE_LEASE_SIZE;
+    Creds.set(Storage::Entry::Sequence, String(leaseEnd));
+    Creds.commit();
+  }
+
+  return next++;
+}
+
+void dropAcknowledged(const API::Acknowledgement& ack)
+{
+  for (auto p = Backlog.front(); p && ack.covers(p->sequence); p = Backlog.front())
+    Backlog.pop_front();
+
+  while (!packets.empty() && ack.covers(packets.front().sequence))
+    packets.pop_front();
+}
+
+void savePacketsToFlash(unsigned keep)
+{
+  if (!Backlog.ready())
+    return;
+
+  // Packets leave RAM only once they are in flash, so that they survive a
+  // reset if writing fails. Whatever a failed attempt left staged is still
+  // in RAM (or has been uploaded since), so it is staged afresh.
+  std::array<DataPacket, PacketLog::BatchSize> batch;
+  Backlog.discardStaged();
+
+  while (packets.size() > keep) {
+    const auto n = packets.read(batch.data(), std::min<unsigned>(batch.size(), packets.size() - keep));
+    for (auto i = 0u; i < n; ++i)
+      Backlog.append(batch[i]);
+
+    const auto success = Backlog.flush();
+    for (auto i = Backlog.unflushed(); i < n; ++i)
+      packets.pop_front();
+
+    if (!success) {
+      SERIAL.println("Failed to save packets to flash!");
+      break;
+    }
+  }
+}
+
 UUID buildDeviceId()
 {
   std::array<uint8_t, 6> mac;
@@ -316,24 +918,26 @@ UUID buildDeviceId()
 int tryWifiConnection(wifi_mode_t mode, int timeout)
 {
   WiFi.mode(mode);
-  const auto stat = WiFi.begin(
-    Creds.get(Storage::Entry::SSID).c_str(),
-    Creds.get(Storage::Entry::Passkey).c_str());
-  if (stat == WL_CONNECT_FAILED)
-    return -1;
 
-  // wait for WiFi connection
-  SERIAL.print("Waiting for WiFi to connect...");
-  const auto start = millis();
-  bool connected;
+  SERIAL.print("Waiting for WiFi to connect... ");
+  if (!WiFiLink.connect(Creds.get(Storage::Entry::SSID), Creds.get(Storage::Entry::Passkey), SEC_TO_MS(timeout))) {
+    SERIAL.println("failed.");
+    return -1;
+  }
 
-  timeout = SEC_TO_MS(timeout);
-  do {
-    connected = WiFi.status() == WL_CONNECTED;
-    SERIAL.print(".");
-    delay(500);
-  } while (!connected && millis() - start < timeout);
+  SERIAL.print("connected in ");
+  SERIAL.print(WiFiLink.connectMs());
+  SERIAL.println(" ms.");
 
-  return connected ? 0 : -1;
+  saveAccessPoint();
+  return 0;
 }
 
+void saveAccessPoint()
+{
+  const auto ap = WiFiLink.cached().toString();
+  if (ap != Creds.get(Storage::Entry::WiFiCache)) {
+    Creds.set(Storage::Entry::WiFiCache, ap);
+    Creds.commit();
+  }
+}
@@ -16,12 +16,21 @@
  */
 #include "ota-update.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <new>
 #include <ArduinoJson.h>
 #include <HTTPClient.h>
 #include <Update.h>
 #include <WiFiClientSecure.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
 #include <mbedtls/pk.h>
 #include <mbedtls/md.h>
 #include <mbedtls/md_internal.h>
@@ -46,22 +55,181 @@ STejf1pUQ7jnm6WdvwSBupkCAwEAAQ==
 -----END PUBLIC KEY-----
 )CERT";
 
-static bool applyUpdate(WiFiClientSecure& client, int totalSize);
+/** Bytes in each block passed from the download to the flash writer: one flash sector. */
+static constexpr auto OTA_BLOCK_SIZE = 4096u;
+/** Milliseconds without data after which a download is given up. */
+static constexpr auto OTA_STALL_TIMEOUT_MS = 30000u;
+
+/** Arguments for the download task. */
+struct OTARequest {
+    String url;
+    String rootCA;
+};
+
+/** A block of the image on its way to flash. */
+struct OTABlock {
+    std::array<uint8_t, OTA_BLOCK_SIZE> data;
+    unsigned size;
+};
+
+/**
+ * Passes blocks from the download to a task that hashes and writes them,
+ * so that flash erases and writes do not hold up the download. Two blocks
+ * take turns: one fills from the network while the other is written.
+ */
+struct OTAPipeline {
+    std::array<OTABlock, 2> blocks;
+    /** Blocks ready to be filled. */
+    QueueHandle_t empty = nullptr;
+    /** Blocks ready to be written, in order; an empty block ends the image. */
+    QueueHandle_t full = nullptr;
+    /** Given by the writer task once it has finished. */
+    SemaphoreHandle_t done = nullptr;
+    /** Hash of the image for the signature check. */
+    mbedtls_md_context_t *md = nullptr;
+    /** Set if the download or a write failed. */
+    std::atomic<bool> failed {false};
+
+    /**
+     * Starts the writer task.
+     * @return False if out of memory
+     */
+    bool begin(mbedtls_md_context_t *md_);
+    ~OTAPipeline();
+
+    static void writerTask(void *param);
+};
+
+/** The signature check's mbedTLS contexts, freed however applyUpdate() returns. */
+struct OTAVerifier {
+    mbedtls_pk_context pk;
+    mbedtls_md_context_t md;
+
+    OTAVerifier() {
+        mbedtls_pk_init(&pk);
+        mbedtls_md_init(&md);
+    }
+
+    ~OTAVerifier() {
+        mbedtls_md_free(&md);
+        mbedtls_pk_free(&pk);
+    }
+
+    OTAVerifier(const OTAVerifier&) = delete;
+    OTAVerifier& operator=(const OTAVerifier&) = delete;
+};
+
+/** A TLS client that provides its socket, for waiting on it. */
+class OTASecureClient : public WiFiClientSecure
+{
+public:
+    int socket() const noexcept {
+        return sslclient != nullptr ? sslclient->socket : -1;
+    }
+};
+
+/** Progress of the background update. */
+static std::atomic<OTAState> Progress {OTAState::Idle};
+
+/** Counters for the current or last update; see OTAStats. */
+static struct {
+    std::atomic<uint32_t> total {0};
+    std::atomic<uint32_t> received {0};
+    std::atomic<uint32_t> written {0};
+    std::atomic<uint32_t> flashMs {0};
+    uint32_t startMs = 0;
+    std::atomic<uint32_t> endMs {0};
+} Stats;
+
+static void otaTask(void *param);
+static bool downloadOTAUpdate(String url, String rootCA);
+static bool applyUpdate(WiFiClient& client, int fd, int totalSize);
+
+/**
+ * Reads the given number of bytes, sleeping on the socket until they arrive.
+ * @param fd The client's socket
+ * @return False if the connection closed or stalled first
+ */
+static bool readFully(WiFiClient& client, int fd, uint8_t *buffer, unsigned size);
+
+bool startOTAUpdate(String url, String rootCA)
+{
+    if (url.isEmpty() || Progress == OTAState::Downloading || Progress == OTAState::Ready)
+        return false;
+
+    auto req = new OTARequest {url, rootCA};
+    Progress = OTAState::Downloading;
+    Stats.total = 0;
+    Stats.received = 0;
+    Stats.written = 0;
+    Stats.flashMs = 0;
+    Stats.startMs = millis();
+    Stats.endMs = 0;
+
+    // Below loop()'s priority, so that this only runs while loop() waits for
+    // microphone data. TLS and the signature check need about 8 kB of stack.
+    if (xTaskCreate(otaTask, "ota", 8192, req, tskIDLE_PRIORITY, nullptr) != pdPASS) {
+        delete req;
+        Progress = OTAState::Failed;
+        return false;
+    }
+
+    return true;
+}
+
+OTAState otaUpdateState()
+{
+    return Progress;
+}
+
+OTAStats otaUpdateStats()
+{
+    const uint32_t end = Stats.endMs != 0 ? Stats.endMs.load() : millis();
+    return { Stats.total, Stats.received, Stats.written, end - Stats.startMs, Stats.flashMs };
+}
+
+void otaTask(void *param)
+{
+    auto req = static_cast<OTARequest *>(param);
+    const auto ok = downloadOTAUpdate(req->url, req->rootCA);
+    delete req;
+    Stats.endMs = millis();
+
+    const auto stats = otaUpdateStats();
+    SERIAL.println(ok ? "Update installed." : "Update download failed.");
+    SERIAL.print(stats.received);
+    SERIAL.print(" bytes in ");
+    SERIAL.print(stats.elapsedMs);
+    SERIAL.print(" ms (");
+    SERIAL.print(stats.elapsedMs > 0 ? stats.received / stats.elapsedMs : 0);
+    SERIAL.print(" kB/s), flash busy ");
+    SERIAL.print(stats.flashMs);
+    SERIAL.println(" ms");
+    Progress = ok ? OTAState::Ready : OTAState::Failed;
+    vTaskDelete(nullptr);
+}
 
 bool downloadOTAUpdate(String url, String rootCA)
 {
     if (url.isEmpty())
         return false;
 
-    WiFiClientSecure client;
-    client.setCACert(rootCA.c_str());
+    OTASecureClient secureClient;
+    WiFiClient plainClient;
+    secureClient.setCACert(rootCA.c_str());
+
+    // A local gateway serves its cached image over plain HTTP. This is safe
+    // since the image's signature is checked before it can be booted.
+    const auto plain = url.startsWith("http://");
+    WiFiClient& client = plain ? plainClient : secureClient;
 
     HTTPClient https;
     if (https.begin(client, url)) {
         const auto code = https.GET();
 
         if (code == HTTP_CODE_OK || code == HTTP_CODE_MOVED_PERMANENTLY) {
-            return applyUpdate(client, https.getSize());
+            const auto fd = plain ? plainClient.fd() : secureClient.socket();
+            return applyUpdate(client, fd, https.getSize());
         } else {
             SERIAL.print("Bad HTTP response: ");
             SERIAL.println(code);
@@ -73,13 +241,12 @@ bool downloadOTAUpdate(String url, String rootCA)
     return false;
 }
 
-bool applyUpdate(WiFiClientSecure& client, int totalSize)
+bool applyUpdate(WiFiClient& client, int fd, int totalSize)
 {
-    static std::array<uint8_t, 512> buffer;
     static std::array<uint8_t, 512> signature;
-    mbedtls_pk_context pk;
-    mbedtls_md_context_t rsa;
-    mbedtls_pk_init( &pk );
+    OTAVerifier verifier;
+    auto& pk = verifier.pk;
+    auto& rsa = verifier.md;
 
     if (mbedtls_pk_parse_public_key(&pk, cert_ota, sizeof(cert_ota)) != 0) {
         SERIAL.println("Parsing public key failed!");
@@ -92,74 +259,171 @@ bool applyUpdate(WiFiClientSecure& client, int totalSize)
     }
 
     auto mdinfo = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
-    mbedtls_md_init(&rsa);
-    mbedtls_md_setup(&rsa, mdinfo, 0);
-    mbedtls_md_starts(&rsa);
-
+    if (mbedtls_md_setup(&rsa, mdinfo, 0) != 0 || mbedtls_md_starts(&rsa) != 0) {
+        SERIAL.println("Not enough memory for the hash.");
+        return false;
+    }
 
-    if (totalSize <= 0) {
-        //SERIAL.println("Warning: Unable to determine update size.");
-        //totalSize = UPDATE_SIZE_UNKNOWN;
+    if (totalSize <= static_cast<int>(signature.size())) {
         SERIAL.println("Unknown update size, stop.");
         return false;
     }
 
-    if (!Update.begin(totalSize)) {
+    Stats.total = totalSize;
+    if (!readFully(client, fd, signature.data(), signature.size())) {
+        SERIAL.println("Failed to read signature!");
+        return false;
+    }
+
+    const unsigned imageSize = totalSize - signature.size();
+    if (!Update.begin(imageSize)) {
         SERIAL.println("Failed to begin Update.");
         return false;
     }
 
-    bool first = true;
-    while (client.connected() && (totalSize > 0 || totalSize == UPDATE_SIZE_UNKNOWN)) {
-        const auto size = client.available();
+    std::unique_ptr<OTAPipeline> pipe (new (std::nothrow) OTAPipeline);
+    if (!pipe || !pipe->begin(&rsa)) {
+        SERIAL.println("Not enough memory for Update.");
+        Update.abort();
+        return false;
+    }
 
-        if (size > 0) {
-            const auto bytesToRead = std::min(static_cast<int>(buffer.size()), size);
-            const auto bytesRead = client.read(buffer.data(), bytesToRead);
+    // Each block is read while the one before it is hashed and written.
+    auto remaining = imageSize;
+    unsigned size;
+    do {
+        OTABlock *block;
+        xQueueReceive(pipe->empty, &block, portMAX_DELAY);
 
-            if (first) {
-                if (bytesRead != signature.size()) {
-                    SERIAL.println("Failed to read signature!");
-                    return false;
-                }
-                std::copy(buffer.cbegin(), buffer.cend(), signature.begin());
-                first = false;
-            } else {
-                if (!Update.write(buffer.data(), bytesRead)) {
-                    SERIAL.println("Failed to write Update.");
-                    return false;
-                }
+        size = pipe->failed ? 0 : std::min(remaining, OTA_BLOCK_SIZE);
+        if (size > 0 && !readFully(client, fd, block->data.data(), size)) {
+            SERIAL.println("Download interrupted.");
+            pipe->failed = true;
+            size = 0;
+        }
 
-                mbedtls_md_update(&rsa, buffer.data(), bytesRead);
-            }
+        // An empty block tells the writer that the image is done.
+        block->size = size;
+        remaining -= size;
+        xQueueSend(pipe->full, &block, portMAX_DELAY);
+    } while (size > 0);
 
-            if (totalSize > 0)
-                totalSize -= bytesRead;
-        } else {
-            delay(1);
-        }
+    xSemaphoreTake(pipe->done, portMAX_DELAY);
+
+    if (pipe->failed || remaining > 0) {
+        Update.abort();
+        return false;
     }
 
-    if (totalSize == 0) {
-        unsigned char hash[mdinfo->size];
-        mbedtls_md_finish(&rsa, hash);
+    unsigned char hash[mdinfo->size];
+    mbedtls_md_finish(&rsa, hash);
 
-        auto ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, hash, mdinfo->size,
-            signature.data(), signature.size());
-        mbedtls_md_free(&rsa);
-        mbedtls_pk_free(&pk);
+    auto ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, hash, mdinfo->size,
+        signature.data(), signature.size());
 
-        if (ret == 0) {
-            Update.end(true);
-            return true;
-        } else {
-            // validation failed, overwrite the first few bytes so this partition won't boot!
-            SERIAL.println("Signature validation failed!");
-            //ESP.partitionEraseRange( partition, 0, ENCRYPTED_BLOCK_SIZE);
-            Update.abort();
-        }
+    if (ret == 0) {
+        Update.end(true);
+        return true;
+    } else {
+        // validation failed, overwrite the first few bytes so this partition won't boot!
+        SERIAL.println("Signature validation failed!");
+        //ESP.partitionEraseRange( partition, 0, ENCRYPTED_BLOCK_SIZE);
+        Update.abort();
     }
 
     return false;
 }
 
+bool readFully(WiFiClient& client, int fd, uint8_t *buffer, unsigned size)
+{
+    auto lastData = millis();
+
+    while (size > 0) {
+        const auto n = client.available() > 0 ? client.read(buffer, size) : 0;
+
+        if (n > 0) {
+            buffer += n;
+            size -= n;
+            lastData = millis();
+            Stats.received += n;
+
+            // Hold the download to OTA_MAX_RATE.
+            const auto dueMs = static_cast<uint32_t>(uint64_t(Stats.received) * 1000 / OTA_MAX_RATE);
+            const auto elapsedMs = millis() - Stats.startMs;
+            if (dueMs > elapsedMs)
+                vTaskDelay(pdMS_TO_TICKS(dueMs - elapsedMs));
+            continue;
+        }
+
+        const auto idleMs = millis() - lastData;
+        if (fd < 0 || !client.connected() || idleMs >= OTA_STALL_TIMEOUT_MS)
+            return false;
+
+        // Wait for data on the socket rather than polling for it.
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(fd, &readable);
+
+        const auto waitMs = OTA_STALL_TIMEOUT_MS - idleMs;
+        timeval tv;
+        tv.tv_sec = waitMs / 1000;
+        tv.tv_usec = (waitMs % 1000) * 1000;
+        select(fd + 1, &readable, nullptr, nullptr, &tv);
+    }
+
+    return true;
+}
+
+bool OTAPipeline::begin(mbedtls_md_context_t *md_)
+{
+    md = md_;
+    empty = xQueueCreate(blocks.size(), sizeof(OTABlock *));
+    full = xQueueCreate(blocks.size(), sizeof(OTABlock *));
+    done = xSemaphoreCreateBinary();
+    if (empty == nullptr || full == nullptr || done == nullptr)
+        return false;
+
+    for (auto& b : blocks) {
+        auto block = &b;
+        xQueueSend(empty, &block, 0);
+    }
+
+    // At the download's priority: the two take turns while the other waits.
+    return xTaskCreate(writerTask, "ota-write", 4096, this, tskIDLE_PRIORITY, nullptr) == pdPASS;
+}
+
+OTAPipeline::~OTAPipeline()
+{
+    if (empty != nullptr)
+        vQueueDelete(empty);
+    if (full != nullptr)
+        vQueueDelete(full);
+    if (done != nullptr)
+        vSemaphoreDelete(done);
+}
+
+void OTAPipeline::writerTask(void *param)
+{
+    auto& pipe = *static_cast<OTAPipeline *>(param);
+    OTABlock *block;
+
+    while (xQueueReceive(pipe.full, &block, portMAX_DELAY) == pdTRUE && block->size > 0) {
+        const auto start = millis();
+
+        if (!pipe.failed) {
+            mbedtls_md_update(pipe.md, block->data.data(), block->size);
+            if (Update.write(block->data.data(), block->size) == block->size) {
+                Stats.written += block->size;
+            } else {
+                SERIAL.println("Failed to write Update.");
+                pipe.failed = true;
+            }
+        }
+
+        Stats.flashMs += millis() - start;
+        xQueueSend(pipe.empty, &block, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(pipe.done);
+    vTaskDelete(nullptr);
+}
@@ -21,11 +21,56 @@
 
 #include <WString.h>
 
+#include <cstdint>
+
+/** Bytes per second that an update is downloaded at, at most. */
+constexpr auto OTA_MAX_RATE = 65536u;
+
+/**
+ * Progress of an update started by startOTAUpdate().
+ */
+enum class OTAState {
+    Idle,        /** No update was started */
+    Downloading, /** Downloading and installing in the background */
+    Ready,       /** Installed; takes effect after a restart */
+    Failed       /** Download or signature check failed */
+};
+
+/**
+ * Progress and throughput of the current or last update.
+ */
+struct OTAStats {
+    /** Bytes in the update, or zero if not known yet. */
+    uint32_t total;
+    /** Bytes downloaded so far. */
+    uint32_t received;
+    /** Bytes written to flash so far. */
+    uint32_t written;
+    /** Milliseconds since the update started, or that it took once finished. */
+    uint32_t elapsedMs;
+    /** Milliseconds spent hashing and writing to flash, overlapping the download. */
+    uint32_t flashMs;
+};
+
+/**
+ * Starts downloading and installing an OTA update in a background task.
+ * The task runs below loop()'s priority and at most OTA_MAX_RATE, so that
+ * measuring carries on meanwhile. Returns right away.
+ * @param url Address of the signed update image
+ * @param rootCA PEM root certificate for an https:// address
+ * @return True if the download was started
+ */
+bool startOTAUpdate(String url, String rootCA);
+
+/**
+ * Gets the progress of the update started by startOTAUpdate().
+ */
+OTAState otaUpdateState();
+
 /**
- * Downloads and applies the latest OTA update.
- * @return True if update is successfully downloaded and installed.
+ * Gets the progress and throughput of the current or last update.
  */
-bool downloadOTAUpdate(String url, String rootCA);
+OTAStats otaUpdateStats();
 
 #endif // OTA_UPDATE_H
 
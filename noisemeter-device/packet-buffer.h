@@ -0,0 +1,333 @@
+/// @file
+/// @brief Fixed-size RAM storage of compactly encoded data packets
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PACKET_BUFFER_H
+#define PACKET_BUFFER_H
+
+#include "data-packet.h"
+#include "packet-codec.h"
+
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+
+/**
+ * @brief First-in first-out queue of DataPackets stored in a byte ring.
+ *
+ * Packets are kept in the compact encoding from packet-codec.h, with each
+ * timestamp stored relative to the one before it. Memory use is fixed at
+ * compile time: at roughly nine bytes per packet, a day of five-minute
+ * packets needs about 2.6 kB.
+ *
+ * When the buffer fills up, compact() can merge older packets together so
+ * that long outages are kept at a coarser resolution rather than dropped.
+ *
+ * @tparam N Size of the ring in bytes
+ */
+template<unsigned N>
+class PacketBuffer
+{
+public:
+    /**
+     * Checks if there are no packets stored.
+     */
+    bool empty() const noexcept {
+        return count == 0;
+    }
+
+    /**
+     * Gets the number of packets stored.
+     */
+    unsigned size() const noexcept {
+        return count;
+    }
+
+    /**
+     * Gets the number of bytes used by stored packets.
+     */
+    unsigned bytesUsed() const noexcept {
+        return used;
+    }
+
+    /**
+     * Adds a packet to the back (newest end) of the queue.
+     * @param packet The packet to store
+     * @return False if there was not enough room to store the packet
+     */
+    bool push_back(const DataPacket& packet) noexcept {
+        std::array<uint8_t, PACKET_CODEC_MAX_SIZE> buf;
+        const auto prev = count > 0 ? last : Reference::of(packet);
+        const auto n = encode(buf.data(), packet, prev);
+
+        if (used + n > N)
+            return false;
+
+        if (count == 0)
+            base = prev;
+
+        writeAt(used, buf.data(), n);
+        used += n;
+        ++count;
+        last = Reference::of(packet);
+        return true;
+    }
+
+    /**
+     * Decodes the oldest packet in the queue.
+     * @return The oldest packet; undefined if the queue is empty
+     */
+    DataPacket front() const noexcept {
+        DataPacket packet;
+        peek(packet);
+        return packet;
+    }
+
+    /**
+     * Decodes the newest packet in the queue.
+     * @return The newest packet; undefined if the queue is empty
+     */
+    DataPacket back() const noexcept {
+        DataPacket packet;
+        Reference previous;
+        findBack(packet, previous);
+        return packet;
+    }
+
+    /**
+     * Decodes the oldest packets without removing them.
+     * @param out Array to store the packets in
+     * @param max Maximum number of packets to decode
+     * @return Number of packets decoded
+     */
+    unsigned read(DataPacket *out, unsigned max) const noexcept {
+        auto prev = base;
+        unsigned offset = 0;
+        unsigned n = 0;
+
+        for (; n < count && n < max; ++n) {
+            offset += decodeAt(offset, out[n], prev);
+            prev = Reference::of(out[n]);
+        }
+
+        return n;
+    }
+
+    /**
+     * Removes the oldest packet from the queue.
+     */
+    void pop_front() noexcept {
+        if (count == 0)
+            return;
+
+        DataPacket packet;
+        const auto n = peek(packet);
+
+        head = (head + n) % N;
+        used -= n;
+        --count;
+        base = Reference::of(packet);
+    }
+
+    /**
+     * Removes the newest packet from the queue, e.g. once it has been sent
+     * ahead of older packets.
+     */
+    void pop_back() noexcept {
+        if (count == 0)
+            return;
+
+        DataPacket packet;
+        Reference previous;
+        used = findBack(packet, previous);
+        --count;
+        last = previous;
+    }
+
+    /**
+     * Frees space by merging the oldest run of consecutive packets that fall
+     * within the same time window into a single packet. One-hour windows are
+     * tried first, then six-hour and one-day windows. Only one run is merged
+     * per call so that the work done is bounded.
+     * @return True if any packets were merged
+     */
+    bool compact() noexcept {
+        for (std::time_t span : {HR_TO_SEC(1), HR_TO_SEC(6), DAY_TO_SEC(1)}) {
+            if (compact(span))
+                return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Removes all stored packets.
+     */
+    void clear() noexcept {
+        head = 0;
+        used = 0;
+        count = 0;
+    }
+
+private:
+    /** Values that a packet's encoding is relative to. */
+    struct Reference {
+        std::time_t timestamp = 0;
+        uint32_t sequence = 0;
+
+        static Reference of(const DataPacket& packet) noexcept {
+            return { static_cast<std::time_t>(packet.timestamp), packet.sequence };
+        }
+    };
+
+    /** Ring storage for encoded packets. */
+    std::array<uint8_t, N> data;
+    /** Offset of the oldest packet's encoding. */
+    unsigned head = 0;
+    /** Number of bytes in use. */
+    unsigned used = 0;
+    /** Number of packets stored. */
+    unsigned count = 0;
+    /** Values that the oldest packet is encoded relative to. */
+    Reference base;
+    /** Values of the newest packet. */
+    Reference last;
+
+    static unsigned encode(uint8_t *out, const DataPacket& packet, Reference previous) noexcept {
+        return encodePacket(out, packet, previous.timestamp, previous.sequence);
+    }
+
+    /**
+     * Decodes the oldest packet.
+     * @param packet The decoded packet
+     * @return Size of the packet's encoding in bytes
+     */
+    unsigned peek(DataPacket& packet) const noexcept {
+        return decodeAt(0, packet, base);
+    }
+
+    /**
+     * Decodes the packet at the given offset from the oldest packet.
+     * @param offset Offset of the packet's encoding
+     * @param packet The decoded packet
+     * @param previous Values of the packet before this one
+     * @return Size of the packet's encoding in bytes
+     */
+    unsigned decodeAt(unsigned offset, DataPacket& packet, Reference previous) const noexcept {
+        std::array<uint8_t, PACKET_CODEC_MAX_SIZE> buf;
+        const auto n = std::min<unsigned>(used - offset, buf.size());
+        for (auto i = 0u; i < n; ++i)
+            buf[i] = data[(head + offset + i) % N];
+
+        return decodePacket(buf.data(), packet, previous.timestamp, previous.sequence);
+    }
+
+    /**
+     * Finds the newest packet by walking the queue from the oldest.
+     * @param packet The decoded newest packet
+     * @param previous Values that the newest packet is encoded relative to
+     * @return Offset of the newest packet's encoding
+     */
+    unsigned findBack(DataPacket& packet, Reference& previous) const noexcept {
+        auto prev = base;
+        unsigned offset = 0;
+        unsigned lastOffset = 0;
+
+        for (auto i = 0u; i < count; ++i) {
+            previous = prev;
+            lastOffset = offset;
+            offset += decodeAt(offset, packet, prev);
+            prev = Reference::of(packet);
+        }
+
+        return lastOffset;
+    }
+
+    /**
+     * Copies bytes into the ring at the given offset from the oldest packet.
+     */
+    void writeAt(unsigned offset, const uint8_t *bytes, unsigned n) noexcept {
+        for (auto i = 0u; i < n; ++i)
+            data[(head + offset + i) % N] = bytes[i];
+    }
+
+    /**
+     * Merges the oldest run of two or more packets whose timestamps fall
+     * within the same window of the given length.
+     * @param span Window length in seconds
+     * @return True if a run was merged
+     */
+    bool compact(std::time_t span) noexcept {
+        auto prev = base;
+        auto runPrev = base;
+        std::time_t window = 0;
+        unsigned offset = 0;
+        unsigned runStart = 0;
+        unsigned runLength = 0;
+        DataPacket merged;
+
+        for (auto i = 0u; i < count; ++i) {
+            DataPacket packet;
+            const auto n = decodeAt(offset, packet, prev);
+            const auto ts = static_cast<std::time_t>(packet.timestamp);
+
+            if (runLength > 0 && ts / span == window) {
+                merged.merge(packet);
+                ++runLength;
+            } else if (runLength > 1) {
+                break;
+            } else {
+                runStart = offset;
+                runPrev = prev;
+                runLength = 1;
+                merged = packet;
+                window = ts / span;
+            }
+
+            offset += n;
+            prev = Reference::of(packet);
+        }
+
+        // The packet after the run is encoded relative to the run's last
+        // packet, so the merged packet takes on that packet's values. These
+        // are already the newest in the run since packets are stored in order.
+        const auto runLast = prev;
+        merged.timestamp = runLast.timestamp;
+        merged.sequence = runLast.sequence;
+
+        std::array<uint8_t, PACKET_CODEC_MAX_SIZE> buf;
+        const auto runEnd = offset;
+        const auto n = encode(buf.data(), merged, runPrev);
+        if (runLength < 2 || n >= runEnd - runStart)
+            return false;
+
+        // Store the merged packet at the end of the run, then slide the
+        // packets before the run forward to close the gap.
+        const auto freed = runEnd - runStart - n;
+        writeAt(runEnd - n, buf.data(), n);
+        for (auto i = runStart; i > 0; --i)
+            data[(head + i - 1 + freed) % N] = data[(head + i - 1) % N];
+
+        head = (head + freed) % N;
+        used -= freed;
+        count -= runLength - 1;
+        return true;
+    }
+};
+
+#endif // PACKET_BUFFER_H
+
@@ -0,0 +1,156 @@
+/// @file
+/// @brief Compact binary encoding of DataPackets for storage
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PACKET_CODEC_H
+#define PACKET_CODEC_H
+
+#include "data-packet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+/*
+ * Encoded packet layout:
+ *   varint   Timestamp delta from the previous packet (zigzag, in seconds)
+ *   varint   Sample count
+ *   5 bytes  Minimum, maximum and average as 12-bit 0.1 dB fixed-point values
+ *   varint   Sequence number delta from the previous packet (zigzag)
+ *
+ * A typical five-minute packet encodes to ten bytes.
+ */
+
+/** Largest number of bytes a single encoded packet can occupy. */
+constexpr unsigned PACKET_CODEC_MAX_SIZE = 10 + 5 + 5 + 5;
+
+/** Resolution of stored decibel values, in steps per dB. */
+constexpr float PACKET_CODEC_DB_SCALE = 10.f;
+
+/**
+ * Writes a variable-length unsigned integer, seven bits per byte.
+ * @param out Buffer to write to
+ * @param value Value to encode
+ * @return Number of bytes written
+ */
+inline unsigned encodeVarint(uint8_t *out, uint64_t value) noexcept
+{
+    unsigned n = 0;
+    while (value >= 0x80) {
+        out[n++] = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = static_cast<uint8_t>(value);
+    return n;
+}
+
+/**
+ * Reads a variable-length unsigned integer written by encodeVarint().
+ * @param in Buffer to read from
+ * @param value Decoded value
+ * @return Number of bytes read
+ */
+inline unsigned decodeVarint(const uint8_t *in, uint64_t& value) noexcept
+{
+    unsigned n = 0;
+    value = 0;
+    do {
+        value |= static_cast<uint64_t>(in[n] & 0x7F) << (7 * n);
+    } while (in[n++] & 0x80);
+    return n;
+}
+
+/** Maps a signed difference onto an unsigned value for encodeVarint(). */
+inline uint64_t zigzagEncode(int64_t value) noexcept
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+/** Reverses zigzagEncode(). */
+inline int64_t zigzagDecode(uint64_t value) noexcept
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+/**
+ * Converts a decibel value to 12-bit fixed-point (0 to 409.5 dB).
+ */
+inline uint32_t encodeDecibels(float db) noexcept
+{
+    const auto fixed = std::lround(db * PACKET_CODEC_DB_SCALE);
+    return static_cast<uint32_t>(std::clamp(fixed, 0L, 0xFFFL));
+}
+
+/**
+ * Encodes a DataPacket into its compact binary form.
+ * @param out Buffer to write to; must hold at least PACKET_CODEC_MAX_SIZE bytes
+ * @param packet The packet to encode
+ * @param previous Timestamp of the previously encoded packet
+ * @param previousSequence Sequence number of the previously encoded packet
+ * @return Number of bytes written
+ */
+inline unsigned encodePacket(uint8_t *out, const DataPacket& packet, std::time_t previous,
+    uint32_t previousSequence) noexcept
+{
+    const auto delta = static_cast<int64_t>(static_cast<std::time_t>(packet.timestamp)) - previous;
+
+    auto n = encodeVarint(out, zigzagEncode(delta));
+    n += encodeVarint(out + n, static_cast<uint32_t>(std::max(packet.count, 0)));
+
+    const uint64_t levels = encodeDecibels(packet.minimum) |
+        (encodeDecibels(packet.maximum) << 12) |
+        (static_cast<uint64_t>(encodeDecibels(packet.average)) << 24);
+    for (auto i = 0u; i < 5; ++i)
+        out[n++] = static_cast<uint8_t>(levels >> (8 * i));
+
+    n += encodeVarint(out + n, zigzagEncode(static_cast<int64_t>(packet.sequence) - previousSequence));
+    return n;
+}
+
+/**
+ * Decodes a DataPacket written by encodePacket().
+ * @param in Buffer to read from
+ * @param packet The decoded packet
+ * @param previous Timestamp of the previously decoded packet
+ * @param previousSequence Sequence number of the previously decoded packet
+ * @return Number of bytes read
+ */
+inline unsigned decodePacket(const uint8_t *in, DataPacket& packet, std::time_t previous,
+    uint32_t previousSequence) noexcept
+{
+    uint64_t zigzag, count, sequence;
+    auto n = decodeVarint(in, zigzag);
+    n += decodeVarint(in + n, count);
+
+    uint64_t levels = 0;
+    for (auto i = 0u; i < 5; ++i)
+        levels |= static_cast<uint64_t>(in[n++]) << (8 * i);
+
+    n += decodeVarint(in + n, sequence);
+
+    packet.timestamp = static_cast<std::time_t>(previous + zigzagDecode(zigzag));
+    packet.sequence = static_cast<uint32_t>(previousSequence + zigzagDecode(sequence));
+    packet.count = static_cast<int>(count);
+    packet.minimum = (levels & 0xFFF) / PACKET_CODEC_DB_SCALE;
+    packet.maximum = ((levels >> 12) & 0xFFF) / PACKET_CODEC_DB_SCALE;
+    packet.average = ((levels >> 24) & 0xFFF) / PACKET_CODEC_DB_SCALE;
+
+    return n;
+}
+
+#endif // PACKET_CODEC_H
+
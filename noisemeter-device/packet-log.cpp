@@ -0,0 +1,505 @@
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "packet-log.h"
+
+#include <CRC32.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <vector>
+
+/** Identifies a sector that belongs to the packet log ("NMPL"). */
+static constexpr uint32_t SECTOR_MAGIC = 0x4C504D4E;
+/** Identifies a scratch copy of merged packets ("NMPS"). */
+static constexpr uint32_t SCRATCH_MAGIC = 0x53504D4E;
+/** State of a record that has been written but not uploaded. */
+static constexpr uint32_t RECORD_PENDING = 0xFFFFFFFF;
+/** State of a record that has been uploaded. */
+static constexpr uint32_t RECORD_SENT = 0;
+
+template<typename T>
+static uint32_t checksumFrom(const T& obj, std::size_t offset)
+{
+    const auto addr = reinterpret_cast<const uint8_t *>(&obj) + offset;
+    return CRC32::calculate(addr, sizeof(T) - offset);
+}
+
+/**
+ * Merges packets that share increasingly long time windows until no more
+ * than the given number of packets remain.
+ */
+static void compactPackets(std::vector<DataPacket>& packets, std::size_t limit)
+{
+    for (std::time_t span : {HR_TO_SEC(1), HR_TO_SEC(6), DAY_TO_SEC(1), DAY_TO_SEC(7)}) {
+        if (packets.size() <= limit)
+            return;
+
+        std::vector<DataPacket> merged;
+        for (const auto& pkt : packets) {
+            const auto window = static_cast<std::time_t>(pkt.timestamp) / span;
+
+            if (!merged.empty() && static_cast<std::time_t>(merged.back().timestamp) / span == window)
+                merged.back().merge(pkt);
+            else
+                merged.push_back(pkt);
+        }
+
+        packets.swap(merged);
+    }
+
+    if (packets.size() > limit)
+        packets.erase(packets.begin(), packets.end() - limit);
+}
+
+bool PacketLog::begin(unsigned offset, unsigned size) noexcept
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+        ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+    if (partition == nullptr || offset % SectorSize != 0 || offset >= partition->size) {
+        partition = nullptr;
+        return false;
+    }
+
+    base = offset;
+    sectorCount = std::min<unsigned>(size, partition->size - offset) / SectorSize;
+    if (sectorCount < 3) {
+        partition = nullptr;
+        return false;
+    }
+
+    // Finish a merge that was interrupted by a reset.
+    for (auto i = 0u; i < sectorCount; ++i) {
+        if (readScratch(i) && commitScratch(i))
+            esp_partition_erase_range(partition, offsetOf(i, 0), SectorSize);
+    }
+
+    if (!locate()) {
+        partition = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool PacketLog::locate() noexcept
+{
+    // Read every sector header once, looking for the newest sector.
+    std::vector<std::optional<uint32_t>> sequences (sectorCount);
+    std::optional<unsigned> newest;
+
+    for (auto i = 0u; i < sectorCount; ++i) {
+        sequences[i] = readSequence(i);
+
+        if (sequences[i] && (!newest ||
+            static_cast<int32_t>(*sequences[i] - *sequences[*newest]) > 0))
+        {
+            newest = i;
+        }
+    }
+
+    if (!newest) {
+        // Empty or foreign partition contents: start a fresh log.
+        pending = 0;
+        if (!openSector(0, 0))
+            return false;
+
+        readSector = headSector;
+        readSlot = headSlot;
+        return true;
+    }
+
+    headSector = *newest;
+    headSequence = *sequences[headSector];
+    headSlot = SlotsPerSector;
+    while (headSlot > 1 && isErased(headSector, headSlot - 1))
+        --headSlot;
+
+    // Walk backwards through the chain of consecutive sequence numbers to
+    // collect the log's sectors, oldest first.
+    std::vector<unsigned> chain;
+    chain.reserve(sectorCount);
+    chain.push_back(headSector);
+    for (auto i = 1u; i < sectorCount; ++i) {
+        const auto sector = (headSector + sectorCount - i) % sectorCount;
+        if (!sequences[sector] || *sequences[sector] != headSequence - i)
+            break;
+        chain.push_back(sector);
+    }
+    std::reverse(chain.begin(), chain.end());
+
+    // Packets are uploaded oldest first, so the sent records form a prefix of
+    // the log. Binary search for the first sector whose last record is not
+    // yet sent.
+    const auto lastSlot = [this](unsigned sector) {
+        return sector == headSector ? headSlot - 1 : SlotsPerSector - 1;
+    };
+    // An empty head is not sent, or the sectors before it could be skipped.
+    const auto isSent = [&](unsigned sector) {
+        return lastSlot(sector) > 0 && readState(sector, lastSlot(sector)) == RECORD_SENT;
+    };
+    const auto first = std::partition_point(chain.cbegin(), chain.cend(), isSent);
+
+    if (first == chain.cend()) {
+        readSector = headSector;
+        readSlot = headSlot;
+        pending = 0;
+        return true;
+    }
+
+    // Merged sectors start with unused slots.
+    readSector = *first;
+    readSlot = 1;
+    while (readSlot < lastSlot(readSector) &&
+        (readState(readSector, readSlot) == RECORD_SENT || isErased(readSector, readSlot)))
+    {
+        ++readSlot;
+    }
+
+    // Count records only: merged sectors start with unused slots.
+    pending = lastSlot(readSector) + 1 - readSlot;
+    for (auto sector = std::next(first); sector != chain.cend(); ++sector)
+        pending += lastSlot(*sector) + 1 - firstRecord(*sector);
+
+    return true;
+}
+
+unsigned PacketLog::capacity() const noexcept
+{
+    // One sector is spare, and merging starts once the others are full.
+    return sectorCount > 2 ? (sectorCount - 2) * (SlotsPerSector - 1) : 0;
+}
+
+bool PacketLog::append(const DataPacket& packet) noexcept
+{
+    if (!ready() || stagedCount >= staged.size())
+        return false;
+
+    staged[stagedCount++] = toRecord(packet);
+    return true;
+}
+
+bool PacketLog::flush() noexcept
+{
+    if (!ready())
+        return false;
+
+    auto i = 0u;
+    while (i < stagedCount) {
+        if (headSlot >= SlotsPerSector) {
+            if (!openSector((headSector + 1) % sectorCount, headSequence + 1))
+                break;
+        }
+
+        // Write as many records as fit within the current sector at once.
+        const auto n = std::min(stagedCount - i, SlotsPerSector - headSlot);
+        const auto err = esp_partition_write(partition, offsetOf(headSector, headSlot),
+            &staged[i], n * sizeof(Record));
+        if (err != ESP_OK)
+            break;
+
+        if (pending == 0) {
+            readSector = headSector;
+            readSlot = headSlot;
+        }
+
+        headSlot += n;
+        pending += n;
+        i += n;
+    }
+
+    // Keep what could not be written for the next attempt.
+    std::copy(staged.cbegin() + i, staged.cbegin() + stagedCount, staged.begin());
+    stagedCount -= i;
+    return stagedCount == 0;
+}
+
+std::optional<DataPacket> PacketLog::front() noexcept
+{
+    while (pending > 0) {
+        Record rec;
+        esp_partition_read(partition, offsetOf(readSector, readSlot), &rec, sizeof(rec));
+
+        if (isPending(rec))
+            return fromRecord(rec);
+
+        // Skip over records that were torn by a power loss or otherwise damaged.
+        advanceRead();
+        --pending;
+    }
+
+    return {};
+}
+
+unsigned PacketLog::read(DataPacket *out, unsigned max) noexcept
+{
+    // Position the read cursor on a valid record first.
+    if (!front())
+        return 0;
+
+    auto sector = readSector;
+    auto slot = readSlot;
+    auto n = 0u;
+
+    for (auto i = 0u; i < pending && n < max; ++i) {
+        Record rec;
+        esp_partition_read(partition, offsetOf(sector, slot), &rec, sizeof(rec));
+
+        if (isPending(rec))
+            out[n++] = fromRecord(rec);
+
+        // Stop at the head: skipped unused slots are not counted in pending.
+        if (sector == headSector && slot + 1 >= headSlot)
+            break;
+
+        if (++slot >= SlotsPerSector) {
+            sector = (sector + 1) % sectorCount;
+            slot = firstRecord(sector);
+        }
+    }
+
+    return n;
+}
+
+void PacketLog::pop_front() noexcept
+{
+    // Skip over any damaged records to reach the oldest valid one.
+    if (!front())
+        return;
+
+    const auto state = RECORD_SENT;
+    esp_partition_write(partition, offsetOf(readSector, readSlot), &state, sizeof(state));
+    advanceRead();
+    --pending;
+}
+
+std::optional<uint32_t> PacketLog::readSequence(unsigned sector) const noexcept
+{
+    Header hdr;
+    if (esp_partition_read(partition, offsetOf(sector, 0), &hdr, sizeof(hdr)) != ESP_OK)
+        return {};
+
+    if (hdr.magic != SECTOR_MAGIC || hdr.crc != makeHeader(hdr.magic, hdr.sequence, hdr.target).crc)
+        return {};
+
+    return hdr.sequence;
+}
+
+std::optional<PacketLog::Header> PacketLog::readScratch(unsigned sector) const noexcept
+{
+    Header hdr;
+    if (esp_partition_read(partition, offsetOf(sector, 0), &hdr, sizeof(hdr)) != ESP_OK)
+        return {};
+
+    if (hdr.magic != SCRATCH_MAGIC || hdr.crc != makeHeader(hdr.magic, hdr.sequence, hdr.target).crc ||
+        hdr.target >= sectorCount || hdr.target == sector)
+    {
+        return {};
+    }
+
+    return hdr;
+}
+
+uint32_t PacketLog::readState(unsigned sector, unsigned slot) const noexcept
+{
+    uint32_t state = RECORD_PENDING;
+    esp_partition_read(partition, offsetOf(sector, slot), &state, sizeof(state));
+    return state;
+}
+
+bool PacketLog::isErased(unsigned sector, unsigned slot) const noexcept
+{
+    std::array<uint32_t, SlotSize / sizeof(uint32_t)> words;
+    esp_partition_read(partition, offsetOf(sector, slot), words.data(), sizeof(words));
+    return std::all_of(words.cbegin(), words.cend(), [](auto w) { return w == 0xFFFFFFFF; });
+}
+
+unsigned PacketLog::firstRecord(unsigned sector) const noexcept
+{
+    const auto end = sector == headSector ? headSlot : SlotsPerSector;
+    auto slot = 1u;
+    while (slot < end && isErased(sector, slot))
+        ++slot;
+    return slot;
+}
+
+bool PacketLog::openSector(unsigned sector, uint32_t sequence) noexcept
+{
+    // Keep a spare sector: once the sector after this one holds the oldest
+    // packets, merge them to make room. This sector itself only holds
+    // packets in logs written before a spare was kept.
+    const auto full = pending > 0 &&
+        (readSector == sector || readSector == (sector + 1) % sectorCount);
+
+    if (full || readScratch(sector)) {
+        if (!mergeOldest(sector))
+            return false;
+    }
+
+    if (esp_partition_erase_range(partition, offsetOf(sector, 0), SectorSize) != ESP_OK)
+        return false;
+
+    const auto hdr = makeHeader(SECTOR_MAGIC, sequence, 0xFFFFFFFF);
+    if (esp_partition_write(partition, offsetOf(sector, 0), &hdr, sizeof(hdr)) != ESP_OK)
+        return false;
+
+    headSector = sector;
+    headSequence = sequence;
+    headSlot = 1;
+
+    if (pending == 0) {
+        readSector = headSector;
+        readSlot = headSlot;
+    }
+
+    return true;
+}
+
+bool PacketLog::mergeOldest(unsigned scratch) noexcept
+{
+    // A scratch copy left by a failed attempt already holds the merge.
+    if (!readScratch(scratch)) {
+        const auto oldest = readSector;
+        const auto target = (oldest + 1) % sectorCount;
+        const auto sequence = readSequence(target);
+        if (!sequence)
+            return false;
+
+        std::vector<DataPacket> merged;
+        merged.reserve(2 * (SlotsPerSector - 1));
+        for (auto sector : {oldest, target}) {
+            const auto first = sector == oldest ? readSlot : 1;
+            const auto last = sector == headSector ? headSlot : SlotsPerSector;
+
+            for (auto slot = first; slot < last; ++slot) {
+                Record rec;
+                esp_partition_read(partition, offsetOf(sector, slot), &rec, sizeof(rec));
+                if (isPending(rec))
+                    merged.push_back(fromRecord(rec));
+            }
+        }
+        compactPackets(merged, SlotsPerSector - 1);
+
+        // Records go at the end of the sector so that they are followed
+        // directly by the next sector's.
+        std::vector<Record> recs (merged.size());
+        std::transform(merged.cbegin(), merged.cend(), recs.begin(), toRecord);
+        const auto first = SlotsPerSector - static_cast<unsigned>(recs.size());
+        const auto hdr = makeHeader(SCRATCH_MAGIC, *sequence, target);
+
+        // The header goes last, so that only a complete copy is ever used.
+        if (esp_partition_erase_range(partition, offsetOf(scratch, 0), SectorSize) != ESP_OK ||
+            (!recs.empty() && esp_partition_write(partition, offsetOf(scratch, first),
+                recs.data(), recs.size() * sizeof(Record)) != ESP_OK) ||
+            esp_partition_write(partition, offsetOf(scratch, 0), &hdr, sizeof(hdr)) != ESP_OK)
+        {
+            return false;
+        }
+    }
+
+    return commitScratch(scratch) && locate();
+}
+
+bool PacketLog::commitScratch(unsigned scratch) noexcept
+{
+    const auto copy = readScratch(scratch);
+    if (!copy)
+        return false;
+
+    if (esp_partition_erase_range(partition, offsetOf(copy->target, 0), SectorSize) != ESP_OK)
+        return false;
+
+    std::array<Record, BatchSize> recs;
+    for (auto slot = 1u; slot < SlotsPerSector; slot += recs.size()) {
+        const auto n = std::min<unsigned>(recs.size(), SlotsPerSector - slot);
+        const auto bytes = n * sizeof(Record);
+
+        if (esp_partition_read(partition, offsetOf(scratch, slot), recs.data(), bytes) != ESP_OK ||
+            esp_partition_write(partition, offsetOf(copy->target, slot), recs.data(), bytes) != ESP_OK)
+        {
+            return false;
+        }
+    }
+
+    const auto hdr = makeHeader(SECTOR_MAGIC, copy->sequence, 0xFFFFFFFF);
+    if (esp_partition_write(partition, offsetOf(copy->target, 0), &hdr, sizeof(hdr)) != ESP_OK)
+        return false;
+
+    // The sector between the copy and its target was merged into the target.
+    for (auto sector = (scratch + 1) % sectorCount; sector != copy->target; sector = (sector + 1) % sectorCount) {
+        if (esp_partition_erase_range(partition, offsetOf(sector, 0), SectorSize) != ESP_OK)
+            return false;
+    }
+
+    return true;
+}
+
+PacketLog::Header PacketLog::makeHeader(uint32_t magic, uint32_t sequence, uint32_t target) noexcept
+{
+    Header hdr;
+    std::fill(std::begin(hdr.reserved), std::end(hdr.reserved), 0xFF);
+    hdr.magic = magic;
+    hdr.sequence = sequence;
+    hdr.target = target;
+
+    // Plain sectors' checksums cover just the magic and sequence number, as
+    // they did before scratch copies existed.
+    const uint32_t words[] = {magic, sequence, target};
+    const auto size = magic == SCRATCH_MAGIC ? sizeof(words) : 2 * sizeof(uint32_t);
+    hdr.crc = CRC32::calculate(reinterpret_cast<const uint8_t *>(words), size);
+    return hdr;
+}
+
+bool PacketLog::isPending(const Record& rec) noexcept
+{
+    return rec.state == RECORD_PENDING && rec.crc == checksumFrom(rec, offsetof(Record, timestamp));
+}
+
+PacketLog::Record PacketLog::toRecord(const DataPacket& packet) noexcept
+{
+    Record rec;
+    rec.state = RECORD_PENDING;
+    rec.timestamp = static_cast<uint32_t>(static_cast<std::time_t>(packet.timestamp));
+    rec.sequence = packet.sequence;
+    rec.count = packet.count;
+    rec.minimum = packet.minimum;
+    rec.maximum = packet.maximum;
+    rec.average = packet.average;
+    rec.crc = checksumFrom(rec, offsetof(Record, timestamp));
+    return rec;
+}
+
+DataPacket PacketLog::fromRecord(const Record& rec) noexcept
+{
+    DataPacket packet;
+    packet.count = rec.count;
+    packet.minimum = rec.minimum;
+    packet.maximum = rec.maximum;
+    packet.average = rec.average;
+    packet.timestamp = static_cast<std::time_t>(rec.timestamp);
+    packet.sequence = rec.sequence;
+    return packet;
+}
+
+void PacketLog::advanceRead() noexcept
+{
+    if (++readSlot >= SlotsPerSector) {
+        readSector = (readSector + 1) % sectorCount;
+        readSlot = firstRecord(readSector);
+    }
+}
+
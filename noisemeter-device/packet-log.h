@@ -0,0 +1,245 @@
+/// @file
+/// @brief Persistent flash storage for data packets awaiting upload
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PACKET_LOG_H
+#define PACKET_LOG_H
+
+#include "data-packet.h"
+
+#include <esp_partition.h>
+
+#include <array>
+#include <cstdint>
+#include <optional>
+
+/**
+ * @brief Append-only log of DataPackets kept in the "spiffs" flash partition.
+ *
+ * The log's region of the partition is used as a ring of flash sectors. Each sector starts with a
+ * header carrying an increasing sequence number, followed by fixed-size
+ * CRC-protected records. Records are only ever appended; once a record has
+ * been uploaded its state word is cleared in place, which moves the read
+ * cursor forward without needing an erase. A sector is erased only when the
+ * write position wraps around onto it, so each sector sees one erase cycle
+ * per trip around the partition.
+ *
+ * One sector is kept spare. Once the log fills up, the unsent packets in
+ * the two oldest sectors are merged into coarser packets (e.g. hourly) that
+ * replace the second of them, so that a long outage is kept at a lower
+ * resolution rather than lost, and packets still come out oldest first.
+ * The merged packets are first written to the spare sector as a scratch
+ * copy, so a failed write or a reset part way through loses nothing.
+ */
+class PacketLog
+{
+public:
+    /** Number of packets that can be staged before they must be written out. */
+    static constexpr unsigned BatchSize = 16;
+
+    /**
+     * Locates the flash partition and recovers the log's read and write
+     * positions from the data already stored there, finishing a merge that
+     * was interrupted.
+     * @param offset Start of the log's region within the partition
+     * @param size Size of the log's region in bytes
+     * @return True if the log is ready for use
+     */
+    bool begin(unsigned offset, unsigned size) noexcept;
+
+    /**
+     * Checks if the log's flash partition was found and initialized.
+     * @return True if the log can be used
+     */
+    bool ready() const noexcept {
+        return partition != nullptr;
+    }
+
+    /**
+     * Checks if there are any packets waiting to be uploaded.
+     * Packets staged by append() are not counted until they are flushed.
+     * @return True if there are no stored packets
+     */
+    bool empty() const noexcept {
+        return pending == 0;
+    }
+
+    /**
+     * Gets the number of stored packets that have not been uploaded.
+     * @return Number of pending packets
+     */
+    unsigned size() const noexcept {
+        return pending;
+    }
+
+    /**
+     * Gets the number of packets the log is guaranteed to hold before the
+     * oldest packets start being discarded.
+     * @return Capacity of the log in packets
+     */
+    unsigned capacity() const noexcept;
+
+    /**
+     * Gets the number of staged packets that are not in flash yet.
+     */
+    unsigned unflushed() const noexcept {
+        return stagedCount;
+    }
+
+    /**
+     * Drops the staged packets that are not in flash yet, e.g. when the
+     * caller still holds them and will stage them again.
+     */
+    void discardStaged() noexcept {
+        stagedCount = 0;
+    }
+
+    /**
+     * Stages a packet to be written to the log by flush().
+     * @param packet The packet to store
+     * @return False if BatchSize packets are already staged
+     */
+    bool append(const DataPacket& packet) noexcept;
+
+    /**
+     * Writes all staged packets to flash, oldest first.
+     * Packets that could not be written stay staged for the next attempt.
+     * @return True if every staged packet was written
+     */
+    bool flush() noexcept;
+
+    /**
+     * Reads the oldest packet that has not been uploaded.
+     * Corrupted records are skipped over.
+     * @return The oldest pending packet, if any
+     */
+    std::optional<DataPacket> front() noexcept;
+
+    /**
+     * Reads the oldest pending packets without removing them.
+     * @param out Array to store the packets in
+     * @param max Maximum number of packets to read
+     * @return Number of packets read
+     */
+    unsigned read(DataPacket *out, unsigned max) noexcept;
+
+    /**
+     * Marks the oldest pending packet as uploaded, advancing the read cursor.
+     */
+    void pop_front() noexcept;
+
+private:
+    /** Size of one erasable flash sector. */
+    static constexpr unsigned SectorSize = 4096;
+    /** Size of a record or sector header within a sector. */
+    static constexpr unsigned SlotSize = 32;
+    /** Number of slots in a sector. Slot zero holds the sector header. */
+    static constexpr unsigned SlotsPerSector = SectorSize / SlotSize;
+
+    /** Stored form of a DataPacket. */
+    struct Record {
+        /** Cleared to zero once the packet has been uploaded. */
+        uint32_t state;
+        /** CRC32 checksum of the fields below. */
+        uint32_t crc;
+        uint32_t timestamp;
+        /** Zero in records written before sequence numbers were added,
+         * which stored a 64-bit timestamp in its place. */
+        uint32_t sequence;
+        int32_t count;
+        float minimum;
+        float maximum;
+        float average;
+    };
+    static_assert(sizeof(Record) == SlotSize);
+
+    /** Stored at the beginning of each sector in use. */
+    struct Header {
+        uint32_t magic;
+        /** Increments with each newly opened sector. */
+        uint32_t sequence;
+        /** CRC32 checksum of the magic and sequence fields, and of the
+         * target field in a scratch copy. */
+        uint32_t crc;
+        /** In a scratch copy, the sector it replaces; otherwise unused. */
+        uint32_t target;
+        uint8_t reserved[SlotSize - 4 * sizeof(uint32_t)];
+    };
+    static_assert(sizeof(Header) == SlotSize);
+
+    /** Flash partition holding the log. */
+    const esp_partition_t *partition = nullptr;
+    /** Offset of the log's region within the partition. */
+    unsigned base = 0;
+    /** Number of sectors within the log's region. */
+    unsigned sectorCount = 0;
+
+    /** Sequence number of the sector being written to. */
+    uint32_t headSequence = 0;
+    /** Sector being written to. */
+    unsigned headSector = 0;
+    /** Next free slot within headSector. */
+    unsigned headSlot = SlotsPerSector;
+    /** Sector containing the oldest pending packet. */
+    unsigned readSector = 0;
+    /** Slot of the oldest pending packet within readSector. */
+    unsigned readSlot = SlotsPerSector;
+    /** Number of packets written but not yet uploaded. */
+    unsigned pending = 0;
+
+    /** Packets waiting to be written to flash. */
+    std::array<Record, BatchSize> staged;
+    /** Number of records in staged. */
+    unsigned stagedCount = 0;
+
+    /** Calculates the partition offset of the given sector and slot. */
+    constexpr unsigned offsetOf(unsigned sector, unsigned slot) const noexcept {
+        return base + sector * SectorSize + slot * SlotSize;
+    }
+
+    /** Finds the read and write positions from the sectors in flash. */
+    bool locate() noexcept;
+    /** Reads and validates the header of the given sector. */
+    std::optional<uint32_t> readSequence(unsigned sector) const noexcept;
+    /** Reads the header of the given sector if it holds a valid scratch copy. */
+    std::optional<Header> readScratch(unsigned sector) const noexcept;
+    /** Reads the state word of the given record. */
+    uint32_t readState(unsigned sector, unsigned slot) const noexcept;
+    /** Checks if the given record slot has not been written since erase. */
+    bool isErased(unsigned sector, unsigned slot) const noexcept;
+    /** Finds the first written record slot of a sector, skipping a merged sector's unused slots. */
+    unsigned firstRecord(unsigned sector) const noexcept;
+    /** Erases the given sector and makes it the new head of the log. */
+    bool openSector(unsigned sector, uint32_t sequence) noexcept;
+    /** Merges the two oldest sectors into the second, using the given sector for the scratch copy. */
+    bool mergeOldest(unsigned scratch) noexcept;
+    /** Copies a scratch copy over its target and erases the merged sector before it. */
+    bool commitScratch(unsigned scratch) noexcept;
+    /** Fills in a sector header, including its checksum. */
+    static Header makeHeader(uint32_t magic, uint32_t sequence, uint32_t target) noexcept;
+    /** Checks if a record holds a packet that has not been uploaded. */
+    static bool isPending(const Record& rec) noexcept;
+    /** Converts a packet to its stored form. */
+    static Record toRecord(const DataPacket& packet) noexcept;
+    /** Converts a stored record back to a packet. */
+    static DataPacket fromRecord(const Record& rec) noexcept;
+    /** Moves the read cursor to the next record slot. */
+    void advanceRead() noexcept;
+};
+
+#endif // PACKET_LOG_H
+
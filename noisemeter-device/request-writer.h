@@ -0,0 +1,294 @@
+/// @file
+/// @brief Allocation-free building of API request bodies
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef REQUEST_WRITER_H
+#define REQUEST_WRITER_H
+
+#include "timestamp.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+/** Length of a timestamp written by formatTimestamp(). */
+constexpr unsigned TIMESTAMP_FORMAT_LENGTH = 25;
+
+/**
+ * Writes an integer in decimal.
+ * @param out Buffer to write to; must hold at least 20 characters
+ * @param value Value to write
+ * @return Number of characters written
+ */
+inline unsigned formatInteger(char *out, long value) noexcept
+{
+    char digits[20];
+    unsigned n = 0;
+    auto u = value < 0 ? 0ul - static_cast<unsigned long>(value) : static_cast<unsigned long>(value);
+
+    do {
+        digits[n++] = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+
+    unsigned len = 0;
+    if (value < 0)
+        out[len++] = '-';
+    while (n > 0)
+        out[len++] = digits[--n];
+
+    return len;
+}
+
+/**
+ * Writes a time in ISO-8601 format as UTC, e.g. "2024-05-01T12:34:56+00:00".
+ * Matches the format of Timestamp's String conversion without using gmtime()
+ * or strftime().
+ * @param out Buffer to write to; must hold TIMESTAMP_FORMAT_LENGTH characters
+ * @param t Time to write
+ * @return Number of characters written
+ */
+inline unsigned formatTimestamp(char *out, std::time_t t) noexcept
+{
+    // Split into days and seconds, rounding days toward negative infinity.
+    auto days = static_cast<long>(t / DAY_TO_SEC(1));
+    auto secs = static_cast<long>(t % DAY_TO_SEC(1));
+    if (secs < 0) {
+        secs += DAY_TO_SEC(1);
+        --days;
+    }
+
+    // Converts days since 1970-01-01 to a civil date; see
+    // https://howardhinnant.github.io/date_algorithms.html#civil_from_days
+    const long z = days + 719468;
+    const long era = (z >= 0 ? z : z - 146096) / 146097;
+    const long doe = z - era * 146097;
+    const long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const long mp = (5 * doy + 2) / 153;
+    const long day = doy - (153 * mp + 2) / 5 + 1;
+    const long month = mp < 10 ? mp + 3 : mp - 9;
+    const long year = yoe + era * 400 + (month <= 2);
+
+    const auto two = [](char *p, long v) {
+        p[0] = static_cast<char>('0' + v / 10);
+        p[1] = static_cast<char>('0' + v % 10);
+    };
+
+    two(out, year / 100);
+    two(out + 2, year % 100);
+    out[4] = '-';
+    two(out + 5, month);
+    out[7] = '-';
+    two(out + 8, day);
+    out[10] = 'T';
+    two(out + 11, secs / 3600);
+    out[13] = ':';
+    two(out + 14, secs / 60 % 60);
+    out[16] = ':';
+    two(out + 17, secs % 60);
+    out[19] = '+';
+    out[20] = '0';
+    out[21] = '0';
+    out[22] = ':';
+    out[23] = '0';
+    out[24] = '0';
+
+    return TIMESTAMP_FORMAT_LENGTH;
+}
+
+/**
+ * @brief Builds a request body in a fixed, caller-provided buffer.
+ *
+ * Nothing is allocated. If the buffer runs out of room, the text written so
+ * far is kept, further writes are dropped, and ok() returns false.
+ */
+class RequestWriter
+{
+public:
+    /**
+     * Prepares to write into the given buffer.
+     * @param buffer_ Buffer to write to
+     * @param size_ Size of the buffer, including room for a null terminator
+     */
+    RequestWriter(char *buffer_, std::size_t size_) noexcept:
+        buffer(buffer_), size(size_)
+    {
+        clear();
+    }
+
+    /**
+     * Discards everything written.
+     */
+    void clear() noexcept {
+        truncate(0);
+    }
+
+    /**
+     * Discards everything written after the given length, e.g. to undo a
+     * partial write that did not fit.
+     */
+    void truncate(std::size_t length) noexcept {
+        if (length < used)
+            used = length;
+        buffer[used] = '\0';
+        overflow = false;
+    }
+
+    /**
+     * Checks that everything written so far fit in the buffer.
+     */
+    bool ok() const noexcept {
+        return !overflow;
+    }
+
+    /** Provides the written text as a null-terminated string. */
+    const char *c_str() const noexcept {
+        return buffer;
+    }
+
+    /** Gets the number of characters written. */
+    std::size_t length() const noexcept {
+        return used;
+    }
+
+    /** Writes a single character. */
+    RequestWriter& put(char c) noexcept {
+        if (reserve(1))
+            buffer[used++] = c;
+        return terminate();
+    }
+
+    /** Writes a string as is. */
+    RequestWriter& put(const char *str) noexcept {
+        while (*str != '\0' && reserve(1))
+            buffer[used++] = *str++;
+        return terminate();
+    }
+
+    /** Writes a string with URL (percent) encoding. */
+    RequestWriter& putEncoded(const char *str) noexcept {
+        static constexpr char Hex[] = "0123456789ABCDEF";
+
+        for (; *str != '\0'; ++str) {
+            const auto c = static_cast<uint8_t>(*str);
+
+            if (Unreserved[c]) {
+                if (!reserve(1))
+                    break;
+                buffer[used++] = *str;
+            } else {
+                if (!reserve(3))
+                    break;
+                buffer[used++] = '%';
+                buffer[used++] = Hex[c >> 4];
+                buffer[used++] = Hex[c & 0xF];
+            }
+        }
+
+        return terminate();
+    }
+
+    /** Writes an integer in decimal. */
+    RequestWriter& putInteger(long value) noexcept {
+        char digits[20];
+        const auto n = formatInteger(digits, value);
+        return putChars(digits, n);
+    }
+
+    /** Writes a timestamp in ISO-8601 format. */
+    RequestWriter& putTimestamp(Timestamp ts) noexcept {
+        char text[TIMESTAMP_FORMAT_LENGTH];
+        const auto n = formatTimestamp(text, static_cast<std::time_t>(ts));
+        return putChars(text, n);
+    }
+
+    /**
+     * Adds a URL-encoded form parameter, e.g. "&name=value".
+     * The separator is left out for the first parameter.
+     * @param name Name of the parameter; must not need encoding
+     * @param value Value of the parameter
+     * @return *this
+     */
+    RequestWriter& addParam(const char *name, const char *value) noexcept {
+        return startParam(name).putEncoded(value);
+    }
+
+    /** Adds an integer form parameter. */
+    RequestWriter& addParam(const char *name, long value) noexcept {
+        return startParam(name).putInteger(value);
+    }
+
+    /** Adds an ISO-8601 timestamp form parameter. */
+    RequestWriter& addParam(const char *name, Timestamp value) noexcept {
+        // Encoded since '+' would otherwise be read as a space.
+        char text[TIMESTAMP_FORMAT_LENGTH + 1];
+        text[formatTimestamp(text, static_cast<std::time_t>(value))] = '\0';
+        return addParam(name, text);
+    }
+
+private:
+    /** Characters that are left as is by URL encoding (RFC 3986 unreserved). */
+    static constexpr auto Unreserved = [] {
+        std::array<bool, 256> table {};
+        for (auto c = '0'; c <= '9'; ++c)
+            table[c] = true;
+        for (auto c = 'A'; c <= 'Z'; ++c)
+            table[c] = true;
+        for (auto c = 'a'; c <= 'z'; ++c)
+            table[c] = true;
+        table['-'] = table['_'] = table['.'] = table['~'] = true;
+        return table;
+    }();
+
+    char *buffer;
+    std::size_t size;
+    /** Number of characters written, not including the null terminator. */
+    std::size_t used = 0;
+    /** Set when a write did not fit. */
+    bool overflow = false;
+
+    /** Checks for room for n more characters and the null terminator. */
+    bool reserve(std::size_t n) noexcept {
+        if (used + n >= size)
+            overflow = true;
+        return !overflow;
+    }
+
+    RequestWriter& terminate() noexcept {
+        buffer[used] = '\0';
+        return *this;
+    }
+
+    RequestWriter& putChars(const char *chars, unsigned n) noexcept {
+        if (reserve(n)) {
+            for (auto i = 0u; i < n; ++i)
+                buffer[used++] = chars[i];
+        }
+        return terminate();
+    }
+
+    RequestWriter& startParam(const char *name) noexcept {
+        if (used > 0)
+            put('&');
+        return put(name).put('=');
+    }
+};
+
+#endif // REQUEST_WRITER_H
+
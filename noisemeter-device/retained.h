@@ -0,0 +1,96 @@
+/// @file
+/// @brief Storage for data that should survive software resets
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef RETAINED_H
+#define RETAINED_H
+
+#include <CRC32.h>
+#include <esp_attr.h>
+#include <esp_system.h>
+
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+/**
+ * @brief Holds an object in RAM that is kept across software resets.
+ *
+ * Instances must be declared with __NOINIT_ATTR so that startup code leaves
+ * their memory untouched. Right before a software reset, seal() stores a
+ * magic value and a checksum of the object; at the next boot, begin() keeps
+ * the object if both are intact and otherwise default-constructs it.
+ *
+ * @tparam T Type of the held object; must be trivially copyable
+ */
+template<typename T>
+struct Retained
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    /** Identifies a sealed object ("NMRT"). */
+    static constexpr uint32_t Magic = 0x54524D4E;
+
+    /** Set to Magic when the object is sealed. */
+    uint32_t magic;
+    /** CRC32 checksum of the sealed object. */
+    uint32_t crc;
+    /** Memory for the held object. */
+    alignas(T) uint8_t storage[sizeof(T)];
+
+    /**
+     * Prepares the held object for use.
+     * Must be called before the object is accessed.
+     * @return True if the object's contents survived a software reset
+     */
+    bool begin() noexcept {
+        const auto kept = esp_reset_reason() == ESP_RST_SW &&
+            magic == Magic && crc == checksum();
+
+        if (!kept)
+            new (storage) T();
+
+        // Only a fresh seal() may validate the contents again.
+        magic = 0;
+        return kept;
+    }
+
+    /**
+     * Marks the object's current contents as valid.
+     * Call this right before a software reset, e.g. from a shutdown handler.
+     */
+    void seal() noexcept {
+        crc = checksum();
+        magic = Magic;
+    }
+
+    T& operator*() noexcept {
+        return *reinterpret_cast<T *>(storage);
+    }
+
+    T *operator->() noexcept {
+        return reinterpret_cast<T *>(storage);
+    }
+
+private:
+    uint32_t checksum() const noexcept {
+        return CRC32::calculate(storage, sizeof(storage));
+    }
+};
+
+#endif // RETAINED_H
+
@@ -18,12 +18,9 @@
 #include "sos-iir-filter.h"
 #include "spl-meter.h"
 
+#include <algorithm>
 #include <cmath>
 
-/** Sample size time duration to use for Leq calculation (seconds). */
-static constexpr auto LEQ_PERIOD = 1.f;
-/** Number of samples to use for a Leq decibel calculation. */
-static constexpr auto SAMPLES_LEQ = SPLMeter::SAMPLE_RATE * LEQ_PERIOD;
 /** Specifies the type of weighting to use for decibel calculation: dBA, dBC, or None/Z. */
 static constexpr auto& WEIGHTING = A_weighting;
 /** Specifies the microphone's equalization filter. See pre-defined filters or set to 'None'. */
@@ -117,7 +114,7 @@ std::optional<float> SPLMeter::readMicrophoneData() noexcept
   Leq_samples += samples.size();
 
   // When we gather enough samples, calculate new Leq value
-  if (Leq_samples >= SAMPLE_RATE * LEQ_PERIOD) {
+  if (Leq_samples >= SAMPLE_RATE * leqPeriod) {
     const auto Leq_RMS = std::sqrt(Leq_sum_sqr / Leq_samples);
     Leq_sum_sqr = 0;
     Leq_samples = 0;
@@ -128,6 +125,12 @@ std::optional<float> SPLMeter::readMicrophoneData() noexcept
   }
 }
 
+void SPLMeter::setLeqPeriod(unsigned seconds) noexcept
+{
+  // The reading in progress carries on to the new period.
+  leqPeriod = std::max(seconds, 1u);
+}
+
 void SPLMeter::i2sRead() noexcept
 {
   // Block and wait for microphone values from I2S
@@ -36,6 +36,12 @@ public:
     /** Prepares I2S Driver and microphone hardware. */
     void initMicrophone() noexcept;
 
+    /**
+     * Sets how many seconds of samples make up each Leq reading.
+     * @param seconds Leq period; at least one second
+     */
+    void setLeqPeriod(unsigned seconds) noexcept;
+
     /**
      * Samples data from the microphone, potentially returning a new dB reading.
      * @return Latest calculated decibel reading, if ready
@@ -70,6 +76,8 @@ private:
     alignas(4)
     std::array<sample_t, SAMPLES_SHORT> samples;
 
+    /** Sample size time duration to use for Leq calculation (seconds). */
+    unsigned leqPeriod = 1;
     /** Number of samples included in Leq_sum_sqr accumulation. */
     unsigned Leq_samples = 0;
     /** Accumulation of sums of squares for decibel calculation. */
@@ -19,7 +19,8 @@
 #include <Arduino.h>
 #include <CRC32.h>
 
-#include <array>
+#include <algorithm>
+#include <vector>
 
 void Storage::begin(UUID key)
 {
@@ -27,6 +28,26 @@ void Storage::begin(UUID key)
 
     EEPROMClass::begin(addrOf(Entry::TotalSize));
     delay(2000);  // Ensure the eeprom peripheral has enough time to initialize.
+
+    // Storage grows when it is opened with a larger size. Settings from
+    // older firmware are checksummed without the entries added since.
+    const auto stored = *reinterpret_cast<uint32_t *>(_data + addrOf(Entry::Checksum));
+    if (!valid()) {
+        if (stored == calculateChecksum(Entry::ServerUrl)) {
+            set(Entry::ServerUrl, "");
+            set(Entry::ServerCert, "");
+            set(Entry::Config, "");
+            set(Entry::WiFiCache, "");
+            commit();
+        } else if (stored == calculateChecksum(Entry::Config)) {
+            set(Entry::Config, "");
+            set(Entry::WiFiCache, "");
+            commit();
+        } else if (stored == calculateChecksum(Entry::WiFiCache)) {
+            set(Entry::WiFiCache, "");
+            commit();
+        }
+    }
 }
 
 bool Storage::valid() const noexcept
@@ -42,20 +63,35 @@ bool Storage::canStore(String str) const noexcept
     return str.length() < StringSize;
 }
 
+bool Storage::canStore(Entry entry, String str) const noexcept
+{
+    return entry != Entry::Checksum && entry != Entry::TotalSize &&
+        str.length() < sizeOf(entry);
+}
+
 void Storage::clear() noexcept
 {
+    const auto sequence = valid() ? get(Entry::Sequence) : String();
+
     for (auto i = 0u; i < addrOf(Entry::TotalSize); ++i)
         writeByte(i, 0xFF);
 
     set(Entry::Token, "\0");
-    EEPROMClass::commit();
+    set(Entry::Sequence, sequence);
+    set(Entry::ServerUrl, "");
+    set(Entry::ServerCert, "");
+    set(Entry::Config, "");
+    set(Entry::WiFiCache, "");
+
+    // Checksummed so that the kept lease survives an unfinished setup.
+    commit();
 }
 
 String Storage::get(Entry entry) const noexcept
 {
-    if (entry != Entry::Checksum) {
-        std::array<char, StringSize> buf;
-        secret.decrypt(_data + addrOf(entry), buf.data(), StringSize);
+    if (entry != Entry::Checksum && entry != Entry::TotalSize) {
+        std::vector<char> buf (sizeOf(entry) + 1, '\0');
+        secret.decrypt(_data + addrOf(entry), buf.data(), sizeOf(entry));
         return buf.data();
     } else {
         return {};
@@ -64,8 +100,11 @@ String Storage::get(Entry entry) const noexcept
 
 void Storage::set(Entry entry, String str) noexcept
 {
-    if (entry != Entry::Checksum && canStore(str)) {
-        secret.encrypt(str.c_str(), _data + addrOf(entry), StringSize);
+    if (canStore(entry, str)) {
+        // Padded so that encryption does not read past the end of str.
+        std::vector<char> buf (sizeOf(entry), '\0');
+        std::copy(str.c_str(), str.c_str() + str.length(), buf.begin());
+        secret.encrypt(buf.data(), _data + addrOf(entry), sizeOf(entry));
     }
 }
 
@@ -82,14 +121,15 @@ Storage::operator String() const noexcept
     return String() +
            "SSID \"" + get(Entry::SSID) +
            "\" Passkey \"" + get(Entry::Passkey) +
+           "\" Server \"" + get(Entry::ServerUrl) +
            '\"';
 }
 #endif
 
-uint32_t Storage::calculateChecksum() const noexcept
+uint32_t Storage::calculateChecksum(Entry end) const noexcept
 {
     const auto addr = _data + sizeof(uint32_t);
-    const auto size = addrOf(Entry::TotalSize) - sizeof(uint32_t);
+    const auto size = addrOf(end) - sizeof(uint32_t);
     return CRC32::calculate(addr, size);
 }
 
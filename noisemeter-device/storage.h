@@ -27,12 +27,18 @@
 
 /**
  * Manages the storage of persistent settings.
- * At the moment, this is only used to store WiFi credentials.
+ * This holds the WiFi credentials, the API token, the packet sequence
+ * number lease, the optional server to report to instead of the public
+ * API (e.g. a gateway on the local network), the reporting settings
+ * last sent by the server (see DeviceConfig), and the last WiFi access
+ * point used (see WiFiConnection).
  */
 class Storage : protected EEPROMClass
 {
     /** Maximum length of a stored String. */
     static constexpr unsigned StringSize = 64;
+    /** Maximum length of a stored certificate, enough for PEM of a 4096-bit RSA root. */
+    static constexpr unsigned CertSize = 2048;
 
 public:
     /** Tags to identify the stored settings. */
@@ -41,12 +47,18 @@ public:
         SSID      = Checksum + sizeof(uint32_t), /** User's WiFi SSID */
         Passkey   = SSID     + StringSize,       /** User's WiFi passkey */
         Token     = Passkey  + StringSize,       /** Device API token */
-        Unused    = Token    + StringSize,       /** Unused (used to be email) */
-        TotalSize = Unused   + StringSize        /** Marks storage end address */
+        Sequence  = Token    + StringSize,       /** End of leased packet sequence numbers (used to be email) */
+        ServerUrl = Sequence + StringSize,       /** API base URL, or empty for the public API */
+        ServerCert = ServerUrl + StringSize,     /** PEM root certificate for ServerUrl, or empty */
+        Config    = ServerCert + CertSize,       /** Reporting settings from the server, or empty for defaults */
+        WiFiCache = Config   + StringSize,       /** Last WiFi access point and channel, or empty */
+        TotalSize = WiFiCache + StringSize       /** Marks storage end address */
     };
 
     /**
      * Initializes the instance and prepares flash memory for access.
+     * Settings saved by older firmware are kept, with the entries added
+     * since left empty.
      * @param key Key (i.e. seed) to use for encryption
      */
     void begin(UUID key);
@@ -64,8 +76,18 @@ public:
      */
     bool canStore(String str) const noexcept;
 
+    /**
+     * Checks if the given string can be stored in the given entry.
+     * @param entry The entry to store to
+     * @param str The string to check
+     * @return True if the string can be stored
+     */
+    bool canStore(Entry entry, String str) const noexcept;
+
     /**
      * Clears/wipes all stored settings.
+     * The sequence number lease is kept if the settings were valid, so that
+     * packet sequence numbers never go backwards.
      */
     void clear() noexcept;
 
@@ -101,9 +123,10 @@ private:
 
     /**
      * Calculates a CRC32 checksum of all stored settings.
+     * @param end Entry to stop before; settings from older firmware end at ServerUrl, Config or WiFiCache
      * @return The checksum for the stored settings
      */
-    uint32_t calculateChecksum() const noexcept;
+    uint32_t calculateChecksum(Entry end = Entry::TotalSize) const noexcept;
 
     /**
      * Gets the memory address/offset of the given entry.
@@ -113,6 +136,15 @@ private:
     constexpr unsigned addrOf(Entry entry) const noexcept {
         return static_cast<unsigned>(entry);
     }
+
+    /**
+     * Gets the size of the given entry in bytes.
+     * @param entry The entry to measure
+     * @return The space the entry takes within storage
+     */
+    constexpr unsigned sizeOf(Entry entry) const noexcept {
+        return entry == Entry::ServerCert ? CertSize : StringSize;
+    }
 };
 
 #endif // STORAGE_H
@@ -0,0 +1,122 @@
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "time-sync.h"
+
+#include <esp_sntp.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <sys/time.h>
+
+/** Event bit set once the clock has been synchronized. */
+static constexpr EventBits_t SYNCED_BIT = BIT0;
+
+/** The instance that SNTP reports to; its callback takes no context. */
+static TimeSync *Instance = nullptr;
+/** Signals the first synchronization to waiting tasks. */
+static EventGroupHandle_t Events = nullptr;
+/** Guards state shared with the SNTP callback. */
+static portMUX_TYPE Lock = portMUX_INITIALIZER_UNLOCKED;
+
+void TimeSync::begin(const char *server)
+{
+    if (Instance != nullptr)
+        return;
+
+    Instance = this;
+    Events = xEventGroupCreate();
+    if (synced())
+        xEventGroupSetBits(Events, SYNCED_BIT);
+
+    sntp_set_time_sync_notification_cb(onSync);
+    sntp_set_sync_interval(SEC_TO_MS(ResyncIntervalSec));
+    configTime(0, 0, server);
+}
+
+bool TimeSync::synced() const noexcept
+{
+    portENTER_CRITICAL(&Lock);
+    const auto s = base.synced;
+    portEXIT_CRITICAL(&Lock);
+    return s;
+}
+
+bool TimeSync::waitForSync(unsigned timeoutMs) const
+{
+    if (Events == nullptr)
+        return false;
+
+    const auto bits = xEventGroupWaitBits(Events, SYNCED_BIT, pdFALSE, pdFALSE,
+        pdMS_TO_TICKS(timeoutMs));
+    return bits & SYNCED_BIT;
+}
+
+int64_t TimeSync::monotonic() const noexcept
+{
+    return monotonicUs() / 1000000;
+}
+
+Timestamp TimeSync::toWallClock(int64_t monotonicSec) const noexcept
+{
+    const auto now = static_cast<std::time_t>(Timestamp());
+    return Timestamp(now - static_cast<std::time_t>(monotonic() - monotonicSec));
+}
+
+TimeSync::Stats TimeSync::stats() const noexcept
+{
+    portENTER_CRITICAL(&Lock);
+    const auto s = syncStats;
+    portEXIT_CRITICAL(&Lock);
+    return s;
+}
+
+void TimeSync::prepareForReset() noexcept
+{
+    base.monotonicUs = monotonicUs();
+}
+
+int64_t TimeSync::monotonicUs() const noexcept
+{
+    return base.monotonicUs + esp_timer_get_time();
+}
+
+void TimeSync::onSync(struct timeval *tv)
+{
+    auto& self = *Instance;
+    const auto mono = self.monotonicUs();
+    const auto wall = static_cast<int64_t>(tv->tv_sec) * 1000000 + tv->tv_usec;
+
+    portENTER_CRITICAL(&Lock);
+    auto& s = self.syncStats;
+    if (s.syncs > 0) {
+        // Where the local clock would be now, had it not been corrected.
+        const auto elapsed = mono - self.lastSyncMonoUs;
+        const auto error = wall - (self.lastSyncWallUs + elapsed);
+
+        s.offsetMs = static_cast<int32_t>(error / 1000);
+        if (elapsed > 0)
+            s.driftPpm = static_cast<float>(error) * 1e6f / static_cast<float>(elapsed);
+    }
+
+    ++s.syncs;
+    self.lastSyncMonoUs = mono;
+    self.lastSyncWallUs = wall;
+    self.base.synced = true;
+    portEXIT_CRITICAL(&Lock);
+
+    xEventGroupSetBits(Events, SYNCED_BIT);
+}
@@ -0,0 +1,142 @@
+/// @file
+/// @brief Background NTP synchronization and monotonic timebase
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#include "timestamp.h"
+
+#include <cstdint>
+#include <ctime>
+
+/** Maximum number of milliseconds to wait for NTP sync when waiting is needed. */
+constexpr auto NTP_CONNECT_TIMEOUT_MS = SEC_TO_MS(20);
+
+struct timeval;
+
+/**
+ * @brief Keeps the system clock synchronized with NTP in the background.
+ *
+ * Nothing waits for the time: SNTP runs in the network stack, retries on
+ * its own while the server cannot be reached, and re-synchronizes every
+ * ResyncIntervalSec once it has succeeded. Until the first success,
+ * synced() is false and the wall clock must not be trusted.
+ *
+ * Meanwhile, events can be stamped with monotonic() time, which counts
+ * seconds from the first boot and is not changed by NTP. toWallClock()
+ * converts these stamps once the time is known. The monotonic count is
+ * carried across software resets through Base, which should be kept in
+ * Retained memory.
+ *
+ * Each synchronization is compared with the monotonic clock to track how
+ * far the local clock had drifted since the one before.
+ */
+class TimeSync
+{
+public:
+    /** Seconds between NTP requests once synchronized. */
+    static constexpr unsigned ResyncIntervalSec = HR_TO_SEC(1);
+
+    /**
+     * State that must survive software resets.
+     * This is plain data so that it can be kept in Retained memory.
+     */
+    struct Base {
+        /** Monotonic microseconds counted before the last reset. */
+        int64_t monotonicUs = 0;
+        /** Set once the system clock has been synchronized. */
+        bool synced = false;
+    };
+
+    /** Results of the synchronizations since booting. */
+    struct Stats {
+        /** Number of successful synchronizations. */
+        unsigned syncs = 0;
+        /** Milliseconds that the last synchronization moved the clock by. */
+        int32_t offsetMs = 0;
+        /** Drift of the local clock in parts per million, from the last two synchronizations. */
+        float driftPpm = 0.f;
+    };
+
+    /**
+     * Prepares an instance that keeps its state in the given base.
+     */
+    explicit TimeSync(Base& base_):
+        base(base_) {}
+
+    /**
+     * Starts synchronizing in the background. Returns right away.
+     * Calling this again has no effect.
+     * @param server NTP server's host name
+     */
+    void begin(const char *server = "pool.ntp.org");
+
+    /**
+     * Checks if the system clock has been synchronized, i.e. if Timestamp()
+     * is the actual time.
+     */
+    bool synced() const noexcept;
+
+    /**
+     * Waits for the first synchronization, e.g. when the time is needed
+     * to check a server's certificate.
+     * @param timeoutMs Most milliseconds to wait
+     * @return True if synchronized
+     */
+    bool waitForSync(unsigned timeoutMs) const;
+
+    /**
+     * Gets the monotonic time: seconds since the first boot, including
+     * time before software resets.
+     */
+    int64_t monotonic() const noexcept;
+
+    /**
+     * Converts a monotonic time to the wall-clock time.
+     * Only meaningful once synced() is true.
+     * @param monotonicSec A time given by monotonic()
+     * @return The corresponding timestamp
+     */
+    Timestamp toWallClock(int64_t monotonicSec) const noexcept;
+
+    /**
+     * Gets the results of the synchronizations since booting.
+     */
+    Stats stats() const noexcept;
+
+    /**
+     * Carries the monotonic time over to the next boot.
+     * Call this right before a software reset.
+     */
+    void prepareForReset() noexcept;
+
+private:
+    Base& base;
+    Stats syncStats;
+    /** Monotonic and wall-clock microseconds at the last synchronization. */
+    int64_t lastSyncMonoUs = 0;
+    int64_t lastSyncWallUs = 0;
+
+    /** Monotonic microseconds since the first boot. */
+    int64_t monotonicUs() const noexcept;
+
+    /** Called by SNTP after it sets the system clock. */
+    static void onSync(struct timeval *tv);
+};
+
+#endif // TIME_SYNC_H
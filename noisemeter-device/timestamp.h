@@ -1,5 +1,5 @@
 /// @file
-/// @brief Management of timestamping and NTP synchronization
+/// @brief Wall-clock timestamps
 /* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
  * Copyright (C) 2024  Clyne Sullivan, Nick Barnard
  *
@@ -27,11 +27,9 @@
 #define HR_TO_SEC(h)  (h * MIN_TO_SEC(60))
 #define DAY_TO_SEC(d) (d * HR_TO_SEC(24))
 
-/** Maximum number of milliseconds to wait for NTP sync to succeed. */
-constexpr auto NTP_CONNECT_TIMEOUT_MS = SEC_TO_MS(20);
-
 /**
- * Timestamping facility that uses NTP to provide accurate date and time.
+ * Timestamping facility for wall-clock date and time.
+ * The system clock is set by TimeSync.
  */
 class Timestamp
 {
@@ -63,6 +61,13 @@ public:
         return success ? tsbuf : "(error)";
     }
 
+    /**
+     * Provides the underlying time_t value, e.g. for binary storage.
+     */
+    explicit operator std::time_t() const noexcept {
+        return tm;
+    }
+
     /**
      * Determines the number of seconds between this and the given timestamp.
      * @param ts Timestamp to compare against
@@ -72,27 +77,6 @@ public:
         return std::difftime(ts.tm, tm);
     }
 
-    /**
-     * Synchronizes system time with an NTP time server.
-     * Requires the device to be connected to the general internet.
-     * Will eventually timeout if synchronization does not succeed.
-     * @see NTP_CONNECT_TIMEOUT_MS
-     * @return Zero on success or a negative number on failure
-     */
-    static int synchronize() {
-        configTime(0, 0, "pool.ntp.org");
-
-        const auto start = millis();
-        bool connected;
-
-        do {
-            delay(1000);
-            connected = Timestamp().valid();
-        } while (!connected && millis() - start < NTP_CONNECT_TIMEOUT_MS);
-
-        return connected ? 0 : -1;
-    }
-
     /**
      * Provides a timestamp that is guaranteed to be invalid.
      * @return The invalid timestamp
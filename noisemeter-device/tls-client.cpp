@@ -0,0 +1,544 @@
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "tls-client.h"
+#include "board.h"
+#include "retained.h"
+
+#include <WiFi.h>
+#include <esp_system.h>
+#include <mbedtls/net_sockets.h>
+#include <lwip/sockets.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+/** Largest serialized session that can be saved, including the server's certificate. */
+static constexpr unsigned SESSION_MAX_SIZE = 2048;
+/** Milliseconds that a resolved host address is reused for. */
+static constexpr uint32_t DNS_CACHE_TTL_MS = 10 * 60 * 1000;
+
+/** TLS session saved for resumption. */
+struct SavedSession {
+    /** Host that the session was established with. */
+    char host[64];
+    /** Port that the session was established with. */
+    uint16_t port;
+    /** Size of the serialized session; zero if none is saved. */
+    uint16_t size;
+    /** Session serialized by mbedtls_ssl_session_save(). */
+    uint8_t data[SESSION_MAX_SIZE];
+};
+
+/** Saved session, kept across software resets. */
+static __NOINIT_ATTR Retained<SavedSession> Saved;
+/** Set once Saved has been prepared for use. */
+static bool SavedReady = false;
+/** Handshake counters shared by all clients. */
+static TLSClient::HandshakeStats Stats;
+
+/** Host address resolved for an earlier connection. */
+struct CachedAddress {
+    /** Host name that was resolved; empty if the entry is unused. */
+    char host[64];
+    /** Address the host resolved to. */
+    IPAddress address;
+    /** Value of millis() when the host was resolved. */
+    uint32_t resolvedAt;
+};
+
+/** Recently resolved addresses, e.g. of the API server and the MQTT broker. */
+static std::array<CachedAddress, 2> Addresses;
+/** Index of the entry in Addresses to replace next. */
+static unsigned NextAddress = 0;
+
+/**
+ * Finds the cached address of the given host.
+ * @return The cache entry, or nullptr if there is none or it has expired
+ */
+static CachedAddress *findAddress(const char *host)
+{
+    for (auto& entry : Addresses) {
+        if (entry.host[0] != '\0' && std::strncmp(entry.host, host, sizeof(entry.host)) == 0)
+            return millis() - entry.resolvedAt < DNS_CACHE_TTL_MS ? &entry : nullptr;
+    }
+
+    return nullptr;
+}
+
+/**
+ * Caches the resolved address of the given host.
+ * @return The cache entry, or nullptr if the host name is too long to cache
+ */
+static CachedAddress *saveAddress(const char *host, IPAddress address)
+{
+    if (std::strlen(host) >= sizeof(CachedAddress::host))
+        return nullptr;
+
+    // Reuse the host's old entry if it has one, otherwise the oldest entry.
+    auto entry = std::find_if(Addresses.begin(), Addresses.end(),
+        [host](const auto& e) { return std::strcmp(e.host, host) == 0; });
+    if (entry == Addresses.end()) {
+        entry = Addresses.begin() + NextAddress;
+        NextAddress = (NextAddress + 1) % Addresses.size();
+    }
+
+    std::strcpy(entry->host, host);
+    entry->address = address;
+    entry->resolvedAt = millis();
+    return &*entry;
+}
+
+#ifndef TLS_DEFAULT_PROFILE
+/** Cipher suites offered by the lean profile, in order of preference. */
+static const int LeanCiphersuites[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    // Fallback in case the server's certificate changes key type.
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    0
+};
+
+/** Elliptic curves offered by the lean profile; includes those of the certificate chain. */
+static const mbedtls_ecp_group_id LeanCurves[] = {
+    MBEDTLS_ECP_DP_SECP256R1,
+    MBEDTLS_ECP_DP_SECP384R1,
+    MBEDTLS_ECP_DP_NONE
+};
+#endif // !TLS_DEFAULT_PROFILE
+
+TLSClient::TLSClient()
+{
+    mbedtls_x509_crt_init(&anchor);
+
+    if (!SavedReady) {
+        Saved.begin();
+        esp_register_shutdown_handler([] { Saved.seal(); });
+        SavedReady = true;
+    }
+}
+
+TLSClient::~TLSClient()
+{
+    stop();
+    mbedtls_x509_crt_free(&anchor);
+}
+
+void TLSClient::setCACert(const uint8_t *der, size_t size)
+{
+    // Skip parsing again if the same certificate is set, e.g. on each request.
+    if (hasAnchor && anchor.raw.len == size && std::memcmp(anchor.raw.p, der, size) == 0)
+        return;
+
+    mbedtls_x509_crt_free(&anchor);
+    mbedtls_x509_crt_init(&anchor);
+
+    // Copies the certificate, so that the caller's data may be freed later.
+    const auto ret = mbedtls_x509_crt_parse_der(&anchor, der, size);
+    hasAnchor = ret == 0;
+    if (!hasAnchor) {
+        SERIAL.print("[tls] Bad root certificate: -0x");
+        SERIAL.println(-ret, HEX);
+    }
+}
+
+int TLSClient::connect(IPAddress ip, uint16_t port)
+{
+    return connect(ip.toString().c_str(), port, timeoutMs);
+}
+
+int TLSClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+    return connect(ip.toString().c_str(), port, timeout);
+}
+
+int TLSClient::connect(const char *host, uint16_t port)
+{
+    return connect(host, port, timeoutMs);
+}
+
+int TLSClient::connect(const char *host, uint16_t port, int32_t timeout)
+{
+    stop();
+    times = {};
+
+    auto start = millis();
+    IPAddress ip;
+    CachedAddress *cached = nullptr;
+
+    if (!ip.fromString(host)) {
+        cached = findAddress(host);
+        if (cached != nullptr)
+            ip = cached->address;
+        else if (WiFi.hostByName(host, ip))
+            cached = saveAddress(host, ip);
+        else
+            return 0;
+    }
+
+    times.resolveMs = millis() - start;
+    start = millis();
+
+    if (!tcp.connect(ip, port, timeout)) {
+        // The server may have moved: look it up again next time.
+        if (cached != nullptr)
+            cached->host[0] = '\0';
+        return 0;
+    }
+
+    times.tcpMs = millis() - start;
+    start = millis();
+
+    const auto ok = startSession(host, port);
+    times.handshakeMs = millis() - start;
+
+    if (!ok) {
+        stop();
+        return 0;
+    }
+
+    return 1;
+}
+
+size_t TLSClient::write(uint8_t data)
+{
+    return write(&data, 1);
+}
+
+size_t TLSClient::write(const uint8_t *buf, size_t size)
+{
+    if (!active)
+        return 0;
+
+    size_t written = 0;
+    while (written < size) {
+        const auto ret = mbedtls_ssl_write(&ssl, buf + written, size - written);
+
+        if (ret > 0) {
+            written += ret;
+        } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            stop();
+            break;
+        }
+    }
+
+    return written;
+}
+
+int TLSClient::available()
+{
+    if (!active)
+        return peeked >= 0 ? 1 : 0;
+
+    auto avail = mbedtls_ssl_get_bytes_avail(&ssl);
+
+    // Only decrypt the next record once it has started to arrive, so that
+    // this call does not block.
+    if (avail == 0 && tcp.available() > 0) {
+        const auto ret = mbedtls_ssl_read(&ssl, nullptr, 0);
+        if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE &&
+            ret != MBEDTLS_ERR_SSL_TIMEOUT)
+        {
+            stop();
+            return peeked >= 0 ? 1 : 0;
+        }
+
+        avail = mbedtls_ssl_get_bytes_avail(&ssl);
+    }
+
+    return avail + (peeked >= 0 ? 1 : 0);
+}
+
+int TLSClient::read()
+{
+    uint8_t data;
+    return read(&data, 1) > 0 ? data : -1;
+}
+
+int TLSClient::read(uint8_t *buf, size_t size)
+{
+    if (size == 0)
+        return 0;
+
+    int count = 0;
+    if (peeked >= 0) {
+        *buf++ = static_cast<uint8_t>(peeked);
+        peeked = -1;
+        --size;
+        ++count;
+    }
+
+    const auto avail = active ? mbedtls_ssl_get_bytes_avail(&ssl) : 0;
+    if (size > 0 && (avail > 0 || available() > 0)) {
+        const auto ret = mbedtls_ssl_read(&ssl, buf, size);
+        if (ret > 0)
+            count += ret;
+        else if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+            stop();
+    }
+
+    return count > 0 ? count : -1;
+}
+
+int TLSClient::peek()
+{
+    if (peeked < 0 && available() > 0) {
+        uint8_t data;
+        if (mbedtls_ssl_read(&ssl, &data, 1) == 1)
+            peeked = data;
+    }
+
+    return peeked;
+}
+
+void TLSClient::flush()
+{
+}
+
+void TLSClient::stop()
+{
+    if (active) {
+        if (tcp.connected())
+            mbedtls_ssl_close_notify(&ssl);
+
+        mbedtls_ssl_free(&ssl);
+        mbedtls_ssl_config_free(&conf);
+        active = false;
+    }
+
+    peeked = -1;
+    tcp.stop();
+}
+
+uint8_t TLSClient::connected()
+{
+    if (!active)
+        return peeked >= 0;
+
+    return peeked >= 0 || mbedtls_ssl_get_bytes_avail(&ssl) > 0 || tcp.connected();
+}
+
+int TLSClient::setTimeout(uint32_t seconds)
+{
+    timeoutMs = seconds * 1000;
+    // Also used by Stream's timed reads, e.g. while parsing a response.
+    Stream::setTimeout(timeoutMs);
+    if (active)
+        mbedtls_ssl_conf_read_timeout(&conf, timeoutMs);
+    return tcp.setTimeout(seconds);
+}
+
+void TLSClient::forgetSession()
+{
+    Saved->size = 0;
+}
+
+const TLSClient::HandshakeStats& TLSClient::stats() noexcept
+{
+    return Stats;
+}
+
+bool TLSClient::startSession(const char *host, uint16_t port)
+{
+    // Includes the record buffers allocated by mbedtls_ssl_setup().
+    const auto freeHeap = esp_get_free_heap_size();
+    minFreeHeap = freeHeap;
+
+    if (!hasAnchor)
+        return false;
+
+    mbedtls_ssl_init(&ssl);
+    mbedtls_ssl_config_init(&conf);
+    active = true;
+
+    auto ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT,
+        MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret != 0)
+        return false;
+
+    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&conf, &anchor, nullptr);
+    mbedtls_ssl_conf_verify(&conf, verifyCallback, this);
+    mbedtls_ssl_conf_rng(&conf, randomCallback, nullptr);
+    mbedtls_ssl_conf_read_timeout(&conf, timeoutMs);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+    mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+#ifndef TLS_DEFAULT_PROFILE
+    mbedtls_ssl_conf_ciphersuites(&conf, LeanCiphersuites);
+    mbedtls_ssl_conf_curves(&conf, LeanCurves);
+#ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+    mbedtls_ssl_conf_max_frag_len(&conf, MBEDTLS_SSL_MAX_FRAG_LEN_4096);
+#endif
+#endif // !TLS_DEFAULT_PROFILE
+
+    if (mbedtls_ssl_setup(&ssl, &conf) != 0 || mbedtls_ssl_set_hostname(&ssl, host) != 0)
+        return false;
+
+    mbedtls_ssl_set_bio(&ssl, this, sendCallback, nullptr, recvCallback);
+
+    const auto resuming = loadSession(host, port);
+    const auto start = millis();
+    verified = false;
+
+    do {
+        ret = mbedtls_ssl_handshake(&ssl);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    const auto elapsed = millis() - start;
+    sampleHeap();
+    Stats.peakHeap = std::max(Stats.peakHeap, freeHeap - minFreeHeap);
+
+    if (ret != 0) {
+        // The saved session may be what the server objected to.
+        forgetSession();
+        Stats.failed++;
+
+        SERIAL.print("[tls] Handshake failed: -0x");
+        SERIAL.println(-ret, HEX);
+        return false;
+    }
+
+    // The certificate chain is only verified when the session was not resumed.
+    if (resuming && !verified) {
+        Stats.resumed++;
+        Stats.resumedMs += elapsed;
+    } else {
+        Stats.full++;
+        Stats.fullMs += elapsed;
+    }
+
+#ifdef API_VERBOSE
+    SERIAL.print("[tls] ");
+    SERIAL.print(verified ? "Full" : "Resumed");
+    SERIAL.print(" handshake in ");
+    SERIAL.print(elapsed);
+    SERIAL.print(" ms using ");
+    SERIAL.print(freeHeap - minFreeHeap);
+    SERIAL.println(" bytes of heap");
+#endif
+
+    // The server may have issued a new ticket, so save after every handshake.
+    saveSession(host, port);
+    return true;
+}
+
+bool TLSClient::loadSession(const char *host, uint16_t port)
+{
+    if (Saved->size == 0 || Saved->port != port || std::strncmp(Saved->host, host, sizeof(Saved->host)) != 0)
+        return false;
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+
+    const auto loaded = mbedtls_ssl_session_load(&session, Saved->data, Saved->size) == 0 &&
+        mbedtls_ssl_set_session(&ssl, &session) == 0;
+
+    mbedtls_ssl_session_free(&session);
+
+    if (!loaded)
+        forgetSession();
+
+    return loaded;
+}
+
+void TLSClient::saveSession(const char *host, uint16_t port)
+{
+    if (std::strlen(host) >= sizeof(Saved->host)) {
+        forgetSession();
+        return;
+    }
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+
+    size_t size = 0;
+    const auto saved = mbedtls_ssl_get_session(&ssl, &session) == 0 &&
+        mbedtls_ssl_session_save(&session, Saved->data, sizeof(Saved->data), &size) == 0;
+
+    mbedtls_ssl_session_free(&session);
+
+    if (saved) {
+        std::strncpy(Saved->host, host, sizeof(Saved->host));
+        Saved->port = port;
+        Saved->size = static_cast<uint16_t>(size);
+    } else {
+        forgetSession();
+    }
+}
+
+void TLSClient::sampleHeap() noexcept
+{
+    minFreeHeap = std::min(minFreeHeap, esp_get_free_heap_size());
+}
+
+int TLSClient::sendCallback(void *ctx, const unsigned char *buf, size_t len)
+{
+    auto self = static_cast<TLSClient *>(ctx);
+    auto& tcp = self->tcp;
+
+    // Handshake allocations peak between the messages sent and received.
+    self->sampleHeap();
+
+    const auto n = tcp.write(buf, len);
+    return n > 0 ? static_cast<int>(n) : MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+int TLSClient::recvCallback(void *ctx, unsigned char *buf, size_t len, uint32_t timeout)
+{
+    auto self = static_cast<TLSClient *>(ctx);
+    auto& tcp = self->tcp;
+
+    self->sampleHeap();
+
+    // Wait for data on the socket rather than polling for it.
+    if (tcp.available() <= 0) {
+        const auto fd = tcp.fd();
+        if (fd < 0)
+            return MBEDTLS_ERR_NET_CONN_RESET;
+
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(fd, &readable);
+
+        timeval tv;
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+
+        if (select(fd + 1, &readable, nullptr, nullptr, timeout > 0 ? &tv : nullptr) <= 0)
+            return MBEDTLS_ERR_SSL_TIMEOUT;
+    }
+
+    const auto n = tcp.read(buf, len);
+    return n > 0 ? n : MBEDTLS_ERR_NET_CONN_RESET;
+}
+
+int TLSClient::verifyCallback(void *ctx, mbedtls_x509_crt *, int, uint32_t *)
+{
+    // Verification itself is left to mbedTLS; this only notes that it ran.
+    static_cast<TLSClient *>(ctx)->verified = true;
+    return 0;
+}
+
+int TLSClient::randomCallback(void *, unsigned char *buf, size_t len)
+{
+    // The hardware RNG is a true random source while the radio is enabled.
+    esp_fill_random(buf, len);
+    return 0;
+}
+
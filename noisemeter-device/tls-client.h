@@ -0,0 +1,170 @@
+/// @file
+/// @brief TLS client with session resumption
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TLS_CLIENT_H
+#define TLS_CLIENT_H
+
+#include <WiFiClient.h>
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Secure client that resumes previous TLS sessions.
+ *
+ * Works like WiFiClientSecure so that it can be used with HTTPClient, but
+ * keeps the session from the last successful handshake. Later connections
+ * to the same host offer that session (by ticket or session ID) so that the
+ * server can skip the key exchange and certificate verification.
+ *
+ * The saved session is shared by all instances and is kept in RAM across
+ * software resets, e.g. after an OTA update.
+ *
+ * Unless built with TLS_DEFAULT_PROFILE, connections use a memory-lean
+ * profile: only ECDHE key exchange with AES-GCM is offered, and the server is
+ * asked to limit records to 4 kB (max_fragment_length) so that mbedTLS can
+ * shrink its record buffers where its configuration allows.
+ *
+ * Host names are resolved through a small cache shared by all clients, so
+ * that reconnecting to the same server skips the DNS lookup. Cached addresses
+ * expire after ten minutes, or as soon as connecting to them fails.
+ */
+class TLSClient : public WiFiClient
+{
+public:
+    /** Counters for measuring the cost of TLS handshakes. */
+    struct HandshakeStats {
+        /** Number of full handshakes (with certificate verification). */
+        unsigned full = 0;
+        /** Number of handshakes that resumed a saved session. */
+        unsigned resumed = 0;
+        /** Number of handshakes that failed. */
+        unsigned failed = 0;
+        /** Total milliseconds spent in full handshakes. */
+        uint32_t fullMs = 0;
+        /** Total milliseconds spent in resumed handshakes. */
+        uint32_t resumedMs = 0;
+        /** Most heap memory in bytes that a single handshake has used. */
+        uint32_t peakHeap = 0;
+    };
+
+    /** Milliseconds spent in each phase of a connection. */
+    struct ConnectTimes {
+        /** Resolving the host name; zero if the address was cached. */
+        uint32_t resolveMs = 0;
+        /** Opening the TCP connection. */
+        uint32_t tcpMs = 0;
+        /** Performing the TLS handshake. */
+        uint32_t handshakeMs = 0;
+    };
+
+    TLSClient();
+    ~TLSClient();
+
+    TLSClient(const TLSClient&) = delete;
+    TLSClient& operator=(const TLSClient&) = delete;
+
+    /**
+     * Sets the root certificate that the server must be verified against.
+     * Each client keeps its own copy of the certificate, which is only parsed
+     * again if a different one is set.
+     * @param der DER-encoded certificate
+     * @param size Size of the certificate in bytes
+     */
+    void setCACert(const uint8_t *der, size_t size);
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(IPAddress ip, uint16_t port, int32_t timeout) override;
+    int connect(const char *host, uint16_t port) override;
+    int connect(const char *host, uint16_t port, int32_t timeout) override;
+    size_t write(uint8_t data) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    int setTimeout(uint32_t seconds) override;
+
+    operator bool() override {
+        return connected();
+    }
+
+    /**
+     * Provides the time taken by each phase of the last connection attempt.
+     */
+    const ConnectTimes& connectTimes() const noexcept {
+        return times;
+    }
+
+    /**
+     * Forgets the saved session so that the next handshake is a full one.
+     */
+    static void forgetSession();
+
+    /**
+     * Provides the handshake counters.
+     */
+    static const HandshakeStats& stats() noexcept;
+
+private:
+    /** Underlying TCP connection. */
+    WiFiClient tcp;
+    /** Root certificate that the server is verified against. */
+    mbedtls_x509_crt anchor;
+    /** True once anchor holds a parsed certificate. */
+    bool hasAnchor = false;
+    /** TLS configuration for the current connection. */
+    mbedtls_ssl_config conf;
+    /** TLS state for the current connection. */
+    mbedtls_ssl_context ssl;
+    /** True while conf and ssl are initialized. */
+    bool active = false;
+    /** Set when the server's certificate chain is verified during a handshake. */
+    bool verified = false;
+    /** Byte returned by peek() that has not been read yet, or -1. */
+    int peeked = -1;
+    /** Timeout for handshakes and reads in milliseconds. */
+    uint32_t timeoutMs = 5000;
+    /** Lowest free heap size seen during the current handshake. */
+    uint32_t minFreeHeap = 0;
+    /** Phase timings of the last connection attempt. */
+    ConnectTimes times;
+
+    /** Performs the TLS handshake over the connected TCP socket. */
+    bool startSession(const char *host, uint16_t port);
+    /** Offers the saved session for the given host, if there is one. */
+    bool loadSession(const char *host, uint16_t port);
+    /** Saves the current session for resumption. */
+    void saveSession(const char *host, uint16_t port);
+    /** Records the free heap size for the handshake's peak usage. */
+    void sampleHeap() noexcept;
+
+    static int sendCallback(void *ctx, const unsigned char *buf, size_t len);
+    static int recvCallback(void *ctx, unsigned char *buf, size_t len, uint32_t timeout);
+    static int verifyCallback(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags);
+    static int randomCallback(void *ctx, unsigned char *buf, size_t len);
+};
+
+#endif // TLS_CLIENT_H
+
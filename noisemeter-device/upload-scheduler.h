@@ -0,0 +1,158 @@
+/// @file
+/// @brief Scheduling of upload attempts across a fleet of devices
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef UPLOAD_SCHEDULER_H
+#define UPLOAD_SCHEDULER_H
+
+#include "timestamp.h"
+
+#include <esp_system.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+
+/**
+ * @brief Decides when the next upload should be attempted.
+ *
+ * Uploads happen once per interval at a fixed offset (phase) within the
+ * interval, derived from the device's ID and aligned to the wall clock. This
+ * spreads a fleet's uploads evenly, even when every device boots at once
+ * (e.g. after a power outage).
+ *
+ * After a failed upload the next attempt waits exponentially longer, with
+ * random jitter, up to MaxBackoffSec. A delay requested by the server (HTTP
+ * Retry-After) is honored up to MaxRetryAfterSec. The first success returns
+ * to the regular schedule.
+ *
+ * warmupDue() opens a short window before each attempt, in which the
+ * connection to the server can be set up so that the attempt itself is a
+ * single request.
+ *
+ * The scheduler holds only plain data, so it can be kept in Retained memory.
+ */
+class UploadScheduler
+{
+public:
+    /** Longest wait between attempts after repeated failures. */
+    static constexpr unsigned MaxBackoffSec = HR_TO_SEC(1);
+    /** Longest wait requested by the server that will be honored. */
+    static constexpr unsigned MaxRetryAfterSec = HR_TO_SEC(6);
+    /** Seconds before an attempt to start connecting to the server. */
+    static constexpr unsigned WarmupSec = 5;
+
+    /**
+     * Sets up the schedule for the given device.
+     * A schedule that was kept across a reset is continued.
+     * @param deviceId Device's ID string, from which the phase is derived
+     * @param interval Seconds between regular uploads
+     * @param now The current time
+     */
+    void begin(const char *deviceId, unsigned interval, Timestamp now) noexcept {
+        // FNV-1a hash of the ID.
+        uint32_t hash = 2166136261u;
+        for (; *deviceId != '\0'; ++deviceId)
+            hash = (hash ^ static_cast<uint8_t>(*deviceId)) * 16777619u;
+
+        const auto newPhase = hash % interval;
+        if (interval != period || newPhase != phase || !next.valid()) {
+            period = interval;
+            phase = newPhase;
+            failures = 0;
+            next = nextSlot(now);
+        }
+    }
+
+    /**
+     * Checks if an upload should be attempted now.
+     */
+    bool due(Timestamp now) const noexcept {
+        return now.valid() && next.secondsBetween(now) >= 0;
+    }
+
+    /**
+     * Checks if the next upload is close enough to prepare for, i.e. within
+     * WarmupSec, or already due.
+     */
+    bool warmupDue(Timestamp now) const noexcept {
+        return now.valid() && next.secondsBetween(now) >= -static_cast<double>(WarmupSec);
+    }
+
+    /**
+     * Gets the time of the next planned upload.
+     */
+    Timestamp nextAttempt() const noexcept {
+        return next;
+    }
+
+    /**
+     * Gets the number of failed attempts since the last success.
+     */
+    unsigned failureCount() const noexcept {
+        return failures;
+    }
+
+    /**
+     * Records a successful upload, returning to the regular schedule.
+     */
+    void succeeded(Timestamp now) noexcept {
+        failures = 0;
+        next = nextSlot(now);
+    }
+
+    /**
+     * Records a failed upload and backs off before the next attempt.
+     * @param now The current time
+     * @param retryAfter Seconds the server asked to wait, or zero
+     */
+    void failed(Timestamp now, unsigned retryAfter = 0) noexcept {
+        failures = std::min(failures + 1, 16u);
+
+        // Wait between half and all of the backoff time so that devices
+        // which failed together do not retry together.
+        const auto backoff = std::min<unsigned>(period << std::min(failures - 1, 8u), MaxBackoffSec);
+        auto delay = backoff / 2 + esp_random() % (backoff / 2 + 1);
+
+        if (retryAfter > 0) {
+            retryAfter = std::min(retryAfter, MaxRetryAfterSec);
+            delay = std::max(delay, retryAfter + esp_random() % (retryAfter / 4 + 1));
+        }
+
+        next = Timestamp(static_cast<std::time_t>(now) + delay);
+    }
+
+private:
+    /** Seconds between regular uploads. */
+    unsigned period = 0;
+    /** Offset of this device's uploads within the period, in seconds. */
+    unsigned phase = 0;
+    /** Number of failed attempts since the last success. */
+    unsigned failures = 0;
+    /** Time of the next planned upload. */
+    Timestamp next = Timestamp::invalidTimestamp();
+
+    /** Finds this device's first upload slot after the given time. */
+    Timestamp nextSlot(Timestamp now) const noexcept {
+        const auto t = static_cast<std::time_t>(now);
+        const auto base = t - (t - phase) % period;
+        return Timestamp(base + period);
+    }
+};
+
+#endif // UPLOAD_SCHEDULER_H
+
@@ -0,0 +1,194 @@
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "wifi-connection.h"
+#include "board.h"
+
+#include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+#include <algorithm>
+#include <cstdio>
+
+/** Event bit set once the station has an address. */
+static constexpr EventBits_t GOT_IP_BIT = BIT0;
+/** Event bit set when the station disconnects or fails to connect. */
+static constexpr EventBits_t DISCONNECTED_BIT = BIT1;
+/** Event bit set when the station's address is lost, e.g. its lease expired. */
+static constexpr EventBits_t LOST_IP_BIT = BIT2;
+/** All of the event bits. */
+static constexpr EventBits_t ALL_BITS = GOT_IP_BIT | DISCONNECTED_BIT | LOST_IP_BIT;
+
+/** Signals WiFi events to service(). */
+static EventGroupHandle_t Events = nullptr;
+
+String WiFiConnection::Cache::toString() const
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x,%d",
+        bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5],
+        static_cast<int>(channel));
+    return buf;
+}
+
+bool WiFiConnection::Cache::fromString(const String& str) noexcept
+{
+    std::array<unsigned, 6> mac;
+    int ch;
+
+    if (std::sscanf(str.c_str(), "%x:%x:%x:%x:%x:%x,%d",
+            &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &ch) != 7 ||
+        ch < 1 || ch > 14)
+    {
+        return false;
+    }
+
+    for (auto i = 0u; i < mac.size(); ++i)
+        bssid[i] = static_cast<uint8_t>(mac[i]);
+    channel = ch;
+    return true;
+}
+
+void WiFiConnection::begin()
+{
+    if (Events != nullptr)
+        return;
+
+    Events = xEventGroupCreate();
+
+    WiFi.onEvent([this](arduino_event_id_t event, arduino_event_info_t info) {
+        if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+            const auto& ip = info.got_ip.ip_info;
+
+            // Every new lease (e.g. after renewLease()) is cached.
+            cache.ip = ip.ip.addr;
+            cache.gateway = ip.gw.addr;
+            cache.subnet = ip.netmask.addr;
+            cache.dns = static_cast<uint32_t>(WiFi.dnsIP());
+            if (!reusingLease)
+                cache.leaseTime = Timestamp();
+
+            xEventGroupSetBits(Events, GOT_IP_BIT);
+        } else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) {
+            xEventGroupSetBits(Events, DISCONNECTED_BIT);
+        } else if (event == ARDUINO_EVENT_WIFI_STA_LOST_IP) {
+            xEventGroupSetBits(Events, LOST_IP_BIT);
+        }
+    });
+}
+
+void WiFiConnection::connectAsync(const String& ssid_, const String& psk_, unsigned timeoutMs)
+{
+    ssid = ssid_;
+    psk = psk_;
+    scanTimeoutMs = timeoutMs;
+    attemptStart = millis();
+    stepStart = attemptStart;
+    linkStatus = Status::Associating;
+    xEventGroupClearBits(Events, ALL_BITS);
+
+    if (!cache.valid()) {
+        startScan();
+        return;
+    }
+
+    fastPath = true;
+    reusingLease = cache.leaseUsable(Timestamp());
+    if (reusingLease) {
+        WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway),
+            IPAddress(cache.subnet), IPAddress(cache.dns));
+    }
+
+    WiFi.begin(ssid.c_str(), psk.c_str(), cache.channel, cache.bssid.data());
+}
+
+bool WiFiConnection::connect(const String& ssid_, const String& psk_, unsigned timeoutMs)
+{
+    connectAsync(ssid_, psk_, timeoutMs);
+
+    while (linkStatus == Status::Associating) {
+        // Wakes on the next event, or in time to notice a step's timeout.
+        xEventGroupWaitBits(Events, ALL_BITS, pdFALSE, pdFALSE, pdMS_TO_TICKS(100));
+        service();
+    }
+
+    return linkStatus == Status::Online;
+}
+
+bool WiFiConnection::service()
+{
+    const auto bits = xEventGroupClearBits(Events, ALL_BITS);
+    const auto previous = linkStatus;
+    const auto now = millis();
+
+    if (WiFi.status() == WL_CONNECTED) {
+        if (linkStatus != Status::Online) {
+            std::copy(WiFi.BSSID(), WiFi.BSSID() + cache.bssid.size(), cache.bssid.begin());
+            cache.channel = WiFi.channel();
+            lastConnectMs = now - attemptStart;
+            fastPath = false;
+            linkStatus = Status::Online;
+        }
+    } else if (linkStatus == Status::Online) {
+        // The driver reconnects on its own and DHCP renews a lost address,
+        // so they are given as long as a scan before this gives up.
+        linkStatus = Status::Associating;
+        attemptStart = now;
+        stepStart = now;
+    } else if (linkStatus == Status::Associating) {
+        if (fastPath) {
+            if ((bits & DISCONNECTED_BIT) || now - stepStart >= FastConnectTimeoutMs) {
+                SERIAL.println("Cached WiFi settings failed, scanning...");
+                startScan();
+            }
+        } else if (now - stepStart >= scanTimeoutMs) {
+            // The driver retries on its own after a failed attempt, so only
+            // the timeout ends a scan.
+            linkStatus = Status::Offline;
+        }
+    }
+
+    return linkStatus != previous;
+}
+
+void WiFiConnection::renewLease()
+{
+    if (reusingLease) {
+        reusingLease = false;
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    }
+}
+
+void WiFiConnection::startScan()
+{
+    if (fastPath) {
+        fastPath = false;
+        forget();
+        WiFi.disconnect();
+    }
+
+    if (reusingLease) {
+        // Back to DHCP.
+        reusingLease = false;
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    }
+
+    stepStart = millis();
+    xEventGroupClearBits(Events, ALL_BITS);
+    if (WiFi.begin(ssid.c_str(), psk.c_str()) == WL_CONNECT_FAILED)
+        linkStatus = Status::Offline;
+}
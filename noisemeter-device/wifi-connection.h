@@ -0,0 +1,199 @@
+/// @file
+/// @brief WiFi station connection with cached access point and lease
+/* noisemeter-device - Firmware for CivicTechTO's Noisemeter Device
+ * Copyright (C) 2024  Clyne Sullivan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef WIFI_CONNECTION_H
+#define WIFI_CONNECTION_H
+
+#include "timestamp.h"
+
+#include <WString.h>
+
+#include <array>
+#include <cstdint>
+
+/**
+ * @brief Connects to the configured WiFi network as quickly as possible.
+ *
+ * A plain WiFi.begin() scans every channel for the network and then waits
+ * for DHCP, which takes seconds. After a successful connection, the access
+ * point (BSSID) and its channel are cached, so the next connection goes
+ * straight to them, and the DHCP lease is cached, so the address can be set
+ * without waiting for DHCP. If connecting with the cached settings fails,
+ * they are dropped and a full scan with DHCP is made.
+ *
+ * A cached lease is only reused for a short while (LeaseReuseSec) and only
+ * until renewLease() is called, e.g. once the first upload after connecting
+ * is done; DHCP then takes over, so that an address that the router has
+ * since given away is not held for long.
+ *
+ * Connecting is driven by WiFi events: connectAsync() starts an attempt and
+ * returns right away, and service() moves it along (e.g. to a full scan)
+ * as events arrive. connect() does the same but waits for the outcome.
+ */
+class WiFiConnection
+{
+public:
+    /** Most seconds after it was obtained that a DHCP lease is reused. */
+    static constexpr unsigned LeaseReuseSec = MIN_TO_SEC(30);
+    /** Most milliseconds to wait for a connection with cached settings. */
+    static constexpr unsigned FastConnectTimeoutMs = 3000;
+
+    /** State of the station's link. */
+    enum class Status {
+        Offline,     /** Not connected, and not trying to */
+        Associating, /** Connecting or reconnecting, or waiting for an address */
+        Online       /** Connected with an address */
+    };
+
+    /**
+     * Settings of the last good connection.
+     * This is plain data so that it can be kept in Retained memory.
+     */
+    struct Cache {
+        /** Access point's MAC address. */
+        std::array<uint8_t, 6> bssid = {};
+        /** Access point's channel, or zero if nothing is cached. */
+        int32_t channel = 0;
+        /** Leased address, gateway, subnet mask and DNS server. */
+        uint32_t ip = 0, gateway = 0, subnet = 0, dns = 0;
+        /** When the lease was obtained. */
+        Timestamp leaseTime = Timestamp::invalidTimestamp();
+
+        /**
+         * Checks if the access point is known.
+         */
+        bool valid() const noexcept {
+            return channel > 0;
+        }
+
+        /**
+         * Checks if the lease may be reused at the given time.
+         */
+        bool leaseUsable(Timestamp now) const noexcept {
+            const auto age = leaseTime.secondsBetween(now);
+            return ip != 0 && leaseTime.valid() && now.valid() &&
+                age >= 0 && age < LeaseReuseSec;
+        }
+
+        /**
+         * Formats the access point for Storage, e.g. "a0:b1:c2:d3:e4:f5,6".
+         * The lease is not included, since it would be stale by the next
+         * power-up.
+         */
+        String toString() const;
+
+        /**
+         * Reads an access point saved by toString() into this cache.
+         * @return True if the string was valid
+         */
+        bool fromString(const String& str) noexcept;
+    };
+
+    /**
+     * Prepares an instance that keeps its settings in the given cache.
+     */
+    explicit WiFiConnection(Cache& cache_):
+        cache(cache_) {}
+
+    /**
+     * Registers for WiFi events; call once before connect().
+     */
+    void begin();
+
+    /**
+     * Starts connecting to the given network and returns right away.
+     * Call service() until status() is no longer Associating.
+     * @param ssid Network name
+     * @param psk Network password
+     * @param timeoutMs Most milliseconds to try for after scanning
+     */
+    void connectAsync(const String& ssid, const String& psk, unsigned timeoutMs);
+
+    /**
+     * Connects to the given network, waiting until an address is assigned.
+     * @param ssid Network name
+     * @param psk Network password
+     * @param timeoutMs Most milliseconds to wait for a connection after scanning
+     * @return True if connected
+     */
+    bool connect(const String& ssid, const String& psk, unsigned timeoutMs);
+
+    /**
+     * Handles the WiFi events since the last call. Never blocks.
+     * @return True if status() changed
+     */
+    bool service();
+
+    /**
+     * Gets the state of the link as of the last service().
+     */
+    Status status() const noexcept {
+        return linkStatus;
+    }
+
+    /**
+     * Switches from a reused lease back to DHCP. Briefly interrupts the
+     * connection if a reused lease is in use, so call it between uploads.
+     */
+    void renewLease();
+
+    /**
+     * Gets the settings of the last good connection.
+     */
+    const Cache& cached() const noexcept {
+        return cache;
+    }
+
+    /**
+     * Forgets the cached settings, e.g. after the network was changed.
+     */
+    void forget() noexcept {
+        cache = Cache();
+    }
+
+    /**
+     * Gets the milliseconds taken by the last successful connect().
+     */
+    uint32_t connectMs() const noexcept {
+        return lastConnectMs;
+    }
+
+private:
+    Cache& cache;
+    Status linkStatus = Status::Offline;
+    /** Network of the current attempt, kept for falling back to a scan. */
+    String ssid;
+    String psk;
+    /** Set while trying the cached access point. */
+    bool fastPath = false;
+    /** Set while the address comes from a reused lease. */
+    bool reusingLease = false;
+    /** When the current attempt started. */
+    uint32_t attemptStart = 0;
+    /** When the current step (cached access point or scan) started, and the scan's time limit. */
+    uint32_t stepStart = 0;
+    unsigned scanTimeoutMs = 0;
+    uint32_t lastConnectMs = 0;
+
+    /**
+     * Starts a full scan for the network, dropping the cached settings.
+     */
+    void startScan();
+};
+
+#endif // WIFI_CONNECTION_H